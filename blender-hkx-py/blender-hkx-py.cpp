@@ -0,0 +1,886 @@
+//Python extension module exposing the converter to the addon in-process.
+//Keys are passed both ways as float32 buffers, so that nothing is formatted
+//as text and no files are written.
+
+//Don't link the debug Python library in debug builds
+#ifdef _DEBUG
+#undef _DEBUG
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define _DEBUG
+#else
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#endif
+
+#include "pch.h"
+
+#include "common.h"
+#include "AnimationDecoder.h"
+#include "CurveBaker.h"
+#include "HKXInterface.h"
+#include "SkeletonLoader.h"
+#include "TrackMapper.h"
+
+using namespace iohkx;
+
+//Floats per transform key (Blender order: translation, wxyz rotation, scale)
+constexpr int TRANSFORM_SIZE = 10;
+//Floats per sparse key: frame, value, interpolation, left handle xy, right handle xy
+constexpr int CURVE_KEY_SIZE = 7;
+
+constexpr const char* TYPE_FLOAT = "float";
+constexpr const char* TYPE_TRANSFORM = "transform";
+
+//Thrown when a Python call has failed and set an exception
+struct PythonError {};
+
+//Throw if a Python call returned null
+template<typename T>
+static T* check(T* obj)
+{
+	if (!obj)
+		throw PythonError();
+	return obj;
+}
+
+//Owned reference that is released when we leave scope
+class PyRef
+{
+public:
+	PyRef(PyObject* obj = nullptr) : m_obj(obj) {}
+	~PyRef() { Py_XDECREF(m_obj); }
+
+	PyRef(const PyRef&) = delete;
+	PyRef& operator=(const PyRef&) = delete;
+
+	PyObject* get() const { return m_obj; }
+	//Give up ownership
+	PyObject* release() { PyObject* obj = m_obj; m_obj = nullptr; return obj; }
+
+private:
+	PyObject* m_obj;
+};
+
+//Keys of one track, exposed through the buffer protocol as
+//float32[keys][10] for transforms and float32[keys] for floats
+struct KeyBuffer
+{
+	PyObject_HEAD
+	std::vector<float>* keys;
+	int ndim;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+};
+
+static PyTypeObject* KeyBufferType = nullptr;
+
+static int KeyBuffer_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+	KeyBuffer* buf = reinterpret_cast<KeyBuffer*>(self);
+
+	view->obj = self;
+	Py_INCREF(self);
+	view->buf = buf->keys->data();
+	view->len = buf->keys->size() * sizeof(float);
+	view->readonly = 0;
+	view->itemsize = sizeof(float);
+	view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("f") : nullptr;
+	view->ndim = buf->ndim;
+	view->shape = (flags & PyBUF_ND) ? buf->shape : nullptr;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? buf->strides : nullptr;
+	view->suboffsets = nullptr;
+	view->internal = nullptr;
+	return 0;
+}
+
+static void KeyBuffer_dealloc(PyObject* self)
+{
+	PyTypeObject* type = Py_TYPE(self);
+	delete reinterpret_cast<KeyBuffer*>(self)->keys;
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyType_Slot KeyBufferSlots[] = {
+	{ Py_bf_getbuffer, reinterpret_cast<void*>(KeyBuffer_getbuffer) },
+	{ Py_tp_dealloc, reinterpret_cast<void*>(KeyBuffer_dealloc) },
+	{ 0, nullptr },
+};
+
+static PyType_Spec KeyBufferSpec = {
+	"_blender_hkx.KeyBuffer",
+	sizeof(KeyBuffer),
+	0,
+	Py_TPFLAGS_DEFAULT,
+	KeyBufferSlots,
+};
+
+//Take ownership of keys and wrap them in a KeyBuffer
+static PyObject* newKeyBuffer(std::vector<float>&& keys, int width)
+{
+	KeyBuffer* buf = check(PyObject_New(KeyBuffer, KeyBufferType));
+	buf->keys = new std::vector<float>(std::move(keys));
+	buf->ndim = width == 1 ? 1 : 2;
+	buf->shape[0] = buf->keys->size() / width;
+	buf->shape[1] = width;
+	buf->strides[0] = width * sizeof(float);
+	buf->strides[1] = sizeof(float);
+	return reinterpret_cast<PyObject*>(buf);
+}
+
+//Holds the buffers of the tracks we are packing, and reads keys from them
+class BufferKeySource : public KeySource
+{
+public:
+	~BufferKeySource()
+	{
+		for (auto&& item : m_buffers) {
+			PyBuffer_Release(&item.second);
+		}
+	}
+
+	//Get a float32 buffer from obj for this track
+	void add(const void* track, PyObject* obj, int width)
+	{
+		Py_buffer view;
+		if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0)
+			throw PythonError();
+
+		if (!view.format || std::strcmp(view.format, "f") != 0 || view.len % (width * sizeof(float)) != 0) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_TypeError, "Keys must be a float32 buffer");
+			throw PythonError();
+		}
+
+		m_buffers.push_back({ track, view });
+	}
+
+	virtual int readKeys(const BoneTrack* track, hkQsTransform* dst, int stride, int count) override
+	{
+		const Py_buffer* view = find(track);
+		if (!view)
+			//baked already
+			return copyKeys(track, dst, stride, count);
+
+		const float* raw = static_cast<const float*>(view->buf);
+		int n = std::min(static_cast<int>(view->len / (TRANSFORM_SIZE * sizeof(float))), count);
+		for (int i = 0; i < n; i++, raw += TRANSFORM_SIZE) {
+			//In object space, like the XML
+			hkQsTransform& T = dst[i * stride];
+			T.m_translation.set(raw[0], raw[1], raw[2]);
+			T.m_rotation.m_vec.set(raw[4], raw[5], raw[6], raw[3]);
+			T.m_scale.set(raw[7], raw[8], raw[9]);
+		}
+		return n;
+	}
+
+	virtual int readKeys(const FloatTrack* track, hkReal* dst, int stride, int count) override
+	{
+		const Py_buffer* view = find(track);
+		if (!view)
+			return copyKeys(track, dst, stride, count);
+
+		const float* raw = static_cast<const float*>(view->buf);
+		int n = std::min(static_cast<int>(view->len / sizeof(float)), count);
+		for (int i = 0; i < n; i++) {
+			dst[i * stride] = raw[i];
+		}
+		return n;
+	}
+
+private:
+	template<typename TrackType, typename KeyType>
+	static int copyKeys(const TrackType* track, KeyType* dst, int stride, int count)
+	{
+		int n = std::min(track->keys.getSize(), count);
+		for (int i = 0; i < n; i++) {
+			dst[i * stride] = track->keys[i];
+		}
+		return n;
+	}
+
+	const Py_buffer* find(const void* track) const
+	{
+		for (auto&& item : m_buffers) {
+			if (item.first == track)
+				return &item.second;
+		}
+		return nullptr;
+	}
+
+private:
+	std::vector<std::pair<const void*, Py_buffer>> m_buffers;
+};
+
+//Receives decompressed keys and lays them out the way Blender stores fcurves:
+//one array of (frame, value) pairs per channel, ten channels per transform
+//(location xyz, rotation wxyz, scale xyz) and one per float.
+//Keys are converted to the axes and units of the armature on the way.
+class ChannelSink : public KeySink
+{
+public:
+	//Armature bones are rotated by rotation relative to Havok bones, 
+	//and lengths are scale times shorter
+	ChannelSink(const hkQuaternion& rotation, float lengthScale) : 
+		m_rotation(rotation), m_lengthScale(lengthScale) {}
+
+	virtual void begin(const AnimationData& data) override
+	{
+		m_index.clear();
+		m_channels.clear();
+		for (auto&& clip : data.clips) {
+			if (clip.rootTransform)
+				add(clip.rootTransform, TRANSFORM_SIZE, data.frames);
+			for (int t = 0; t < clip.nBoneTracks; t++)
+				add(&clip.boneTracks[t], TRANSFORM_SIZE, data.frames);
+			for (int t = 0; t < clip.nFloatTracks; t++)
+				add(&clip.floatTracks[t], 1, data.frames);
+		}
+	}
+
+	virtual void writeBlock(int first, int count) override
+	{
+		for (auto&& item : m_index) {
+			std::vector<float>* channels = &m_channels[item.second.first];
+
+			if (item.second.second == 1) {
+				const FloatTrack* track = static_cast<const FloatTrack*>(item.first);
+				for (int f = 0; f < count; f++) {
+					//fcurves start at frame 1
+					channels[0].push_back(static_cast<float>(first + f + 1));
+					channels[0].push_back(track->keys[f]);
+				}
+				continue;
+			}
+
+			const BoneTrack* track = static_cast<const BoneTrack*>(item.first);
+			for (int f = 0; f < count; f++) {
+				const hkQsTransform& key = track->keys[f];
+
+				//same as framerot^-1 * key * framerot
+				hkVector4 t;
+				t.setRotatedInverseDir(m_rotation, key.getTranslation());
+				t.mul4(1.0f / m_lengthScale);
+
+				hkQuaternion q;
+				q.setInverseMul(m_rotation, key.getRotation());
+				q.setMul(q, m_rotation);
+				//(the decoder has kept the shortest path between keys, and the
+				//change of frame keeps it, so fcurves interpolate the right way)
+
+				//(axes are permuted, so scale stays positive)
+				hkVector4 s;
+				s.setRotatedInverseDir(m_rotation, key.getScale());
+				s.setAbs4(s);
+
+				float values[TRANSFORM_SIZE]{ 
+					t(0), t(1), t(2), q(3), q(0), q(1), q(2), s(0), s(1), s(2) };
+				float frame = static_cast<float>(first + f + 1);
+				for (int c = 0; c < TRANSFORM_SIZE; c++) {
+					channels[c].push_back(frame);
+					channels[c].push_back(values[c]);
+				}
+			}
+		}
+	}
+
+	virtual void end(const AnimationData&) override
+	{
+		//A channel that never changes needs only one key
+		for (auto&& channel : m_channels) {
+			bool constant = true;
+			for (size_t i = 3; i < channel.size(); i += 2) {
+				if (channel[i] != channel[1]) {
+					constant = false;
+					break;
+				}
+			}
+			if (constant && channel.size() > 2)
+				channel.resize(2);
+		}
+	}
+
+	//The i:th channel of track. Ours until moved from.
+	std::vector<float>& channel(const void* track, int i)
+	{
+		return m_channels[m_index.at(track).first + i];
+	}
+
+private:
+	void add(const void* track, int channels, int frames)
+	{
+		m_index[track] = { m_channels.size(), channels };
+		for (int c = 0; c < channels; c++) {
+			m_channels.emplace_back();
+			m_channels.back().reserve(2 * frames);
+		}
+	}
+
+private:
+	hkQuaternion m_rotation;
+	float m_lengthScale;
+
+	//(first channel, number of channels) of each track
+	std::map<const void*, std::pair<size_t, int>> m_index;
+	std::vector<std::vector<float>> m_channels;
+};
+
+//Load an hkx file given as a path or as a bytes-like object
+static hkRefPtr<hkaAnimationContainer> load(HKXInterface& hkx, PyObject* obj)
+{
+	if (PyUnicode_Check(obj))
+		return hkx.load(check(PyUnicode_AsUTF8(obj)));
+
+	Py_buffer view;
+	if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) != 0)
+		throw PythonError();
+	hkRefPtr<hkaAnimationContainer> result;
+	try {
+		result = hkx.load(view.buf, static_cast<int>(view.len));
+	}
+	catch (...) {
+		PyBuffer_Release(&view);
+		throw;
+	}
+	PyBuffer_Release(&view);
+	return result;
+}
+
+static void loadSkeletons(HKXInterface& hkx, PyObject* obj, SkeletonLoader& skeletons)
+{
+	PyRef seq(check(PySequence_Fast(obj, "skeletons must be a sequence")));
+	for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq.get()); i++) {
+		PyObject* item = PySequence_Fast_GET_ITEM(seq.get(), i);
+		if (PyUnicode_Check(item)) {
+			//Files can have a cache
+			skeletons.load(check(PyUnicode_AsUTF8(item)), hkx);
+		}
+		else {
+			hkRefPtr<hkaAnimationContainer> res = load(hkx, item);
+			if (res)
+				skeletons.load(res.val());
+		}
+	}
+	if (skeletons.empty())
+		throw Exception(ERR_INVALID_INPUT, "No skeleton found");
+}
+
+static PyObject* toPython(const hkQsTransform& T)
+{
+	const hkVector4& t = T.getTranslation();
+	const hkQuaternion& q = T.getRotation();
+	const hkVector4& s = T.getScale();
+	return check(Py_BuildValue("(ffffffffff)",
+		t(0), t(1), t(2), q(3), q(0), q(1), q(2), s(0), s(1), s(2)));
+}
+
+//Append bone and its descendants as (name, parent, object-space reference)
+static void appendBone(PyObject* list, const Bone* bone, int parent)
+{
+	int index = static_cast<int>(PyList_GET_SIZE(list));
+
+	PyRef ref(toPython(bone->refPoseObj));
+	PyRef item(check(Py_BuildValue("(siO)", bone->name.c_str(), parent, ref.get())));
+	if (PyList_Append(list, item.get()) != 0)
+		throw PythonError();
+
+	for (auto&& child : bone->children) {
+		appendBone(list, child, index);
+	}
+}
+
+static PyObject* toPython(const Skeleton* skeleton, int index)
+{
+	PyRef bones(check(PyList_New(0)));
+	appendBone(bones.get(), skeleton->rootBone, -1);
+
+	PyRef floats(check(PyList_New(skeleton->nFloats)));
+	for (int i = 0; i < skeleton->nFloats; i++) {
+		const Float& f = skeleton->floats[i];
+		PyList_SET_ITEM(floats.get(), i, check(Py_BuildValue("(sf)", f.name.c_str(), f.refValue)));
+	}
+
+	char name[8];
+	sprintf_s(name, sizeof(name), "%d", index);
+	return check(Py_BuildValue("{s:s,s:O,s:O}",
+		"name", name, "bones", bones.get(), "floats", floats.get()));
+}
+
+//Wrap the channels of a track in a list of KeyBuffers of [keys][2]
+static PyObject* toPython(ChannelSink* channels, const void* track, int count)
+{
+	PyRef list(check(PyList_New(count)));
+	for (int c = 0; c < count; c++) {
+		PyList_SET_ITEM(list.get(), c, newKeyBuffer(std::move(channels->channel(track, c)), 2));
+	}
+	return list.release();
+}
+
+static PyObject* toPython(const BoneTrack* track, ChannelSink* channels)
+{
+	if (channels) {
+		PyRef list(toPython(channels, track, TRANSFORM_SIZE));
+		return check(Py_BuildValue("(ssO)", track->target->name.c_str(), TYPE_TRANSFORM, list.get()));
+	}
+
+	std::vector<float> keys;
+	keys.reserve(track->keys.getSize() * TRANSFORM_SIZE);
+	for (int i = 0; i < track->keys.getSize(); i++) {
+		const hkVector4& t = track->keys[i].getTranslation();
+		const hkQuaternion& q = track->keys[i].getRotation();
+		const hkVector4& s = track->keys[i].getScale();
+		keys.insert(keys.end(), { t(0), t(1), t(2), q(3), q(0), q(1), q(2), s(0), s(1), s(2) });
+	}
+	PyRef buf(newKeyBuffer(std::move(keys), TRANSFORM_SIZE));
+	return check(Py_BuildValue("(ssO)", track->target->name.c_str(), TYPE_TRANSFORM, buf.get()));
+}
+
+static PyObject* toPython(const FloatTrack* track, ChannelSink* channels)
+{
+	if (channels) {
+		PyRef list(toPython(channels, track, 1));
+		return check(Py_BuildValue("(ssO)", track->target->name.c_str(), TYPE_FLOAT, list.get()));
+	}
+
+	std::vector<float> keys(track->keys.begin(), track->keys.end());
+	PyRef buf(newKeyBuffer(std::move(keys), 1));
+	return check(Py_BuildValue("(ssO)", track->target->name.c_str(), TYPE_FLOAT, buf.get()));
+}
+
+static PyObject* toPython(const Clip& clip, int index, ChannelSink* channels)
+{
+	PyRef tracks(check(PyList_New(0)));
+	auto append = [&tracks](PyObject* obj) {
+		PyRef item(obj);
+		if (PyList_Append(tracks.get(), item.get()) != 0)
+			throw PythonError();
+	};
+	if (clip.rootTransform)
+		append(toPython(clip.rootTransform, channels));
+	for (int i = 0; i < clip.nBoneTracks; i++)
+		append(toPython(&clip.boneTracks[i], channels));
+	for (int i = 0; i < clip.nFloatTracks; i++)
+		append(toPython(&clip.floatTracks[i], channels));
+
+	PyRef annotations(check(PyList_New(clip.annotations.size())));
+	for (unsigned int i = 0; i < clip.annotations.size(); i++) {
+		PyList_SET_ITEM(annotations.get(), i, check(Py_BuildValue("(is)",
+			clip.annotations[i].frame, clip.annotations[i].text.c_str())));
+	}
+
+	char name[8];
+	sprintf_s(name, sizeof(name), "%d", index);
+	return check(Py_BuildValue("{s:s,s:s,s:s,s:O,s:O}",
+		"name", name,
+		"skeleton", clip.skeleton->name.c_str(),
+		"referenceFrame", REF_INDEX[clip.refFrame],
+		"tracks", tracks.get(),
+		"annotations", annotations.get()));
+}
+
+static PyObject* toPython(const AnimationData& data, ChannelSink* channels)
+{
+	PyRef skeletons(check(PyList_New(0)));
+	std::vector<const Skeleton*> added;
+	for (unsigned int i = 0; i < data.clips.size(); i++) {
+		//reject duplicates
+		if (std::find(added.begin(), added.end(), data.clips[i].skeleton) != added.end())
+			continue;
+		added.push_back(data.clips[i].skeleton);
+
+		PyRef item(toPython(data.clips[i].skeleton, i));
+		if (PyList_Append(skeletons.get(), item.get()) != 0)
+			throw PythonError();
+	}
+
+	PyRef animations(check(PyList_New(data.clips.size())));
+	for (unsigned int i = 0; i < data.clips.size(); i++) {
+		PyList_SET_ITEM(animations.get(), i, toPython(data.clips[i], i, channels));
+	}
+
+	return check(Py_BuildValue("{s:i,s:i,s:O,s:O,s:O}",
+		"frames", data.frames,
+		"frameRate", data.frameRate,
+		"additive", data.additive ? Py_True : Py_False,
+		"skeletons", skeletons.get(),
+		"animations", animations.get()));
+}
+
+//Borrowed reference to a required dict item
+static PyObject* getItem(PyObject* dict, const char* key)
+{
+	PyObject* item = PyDict_GetItemString(dict, key);
+	if (!item) {
+		PyErr_Format(PyExc_KeyError, "Missing '%s'", key);
+		throw PythonError();
+	}
+	return item;
+}
+
+static int getInt(PyObject* dict, const char* key)
+{
+	long val = PyLong_AsLong(getItem(dict, key));
+	if (val == -1 && PyErr_Occurred())
+		throw PythonError();
+	return static_cast<int>(val);
+}
+
+//Read the sparse keys of one channel from a float32 buffer of [keys][7]
+static Curve toCurve(PyObject* obj)
+{
+	Py_buffer view;
+	if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0)
+		throw PythonError();
+
+	Curve curve;
+	bool valid = view.format && std::strcmp(view.format, "f") == 0
+		&& view.len % (CURVE_KEY_SIZE * sizeof(float)) == 0;
+	if (valid) {
+		const float* raw = static_cast<const float*>(view.buf);
+		curve.resize(view.len / (CURVE_KEY_SIZE * sizeof(float)));
+		for (size_t i = 0; i < curve.size(); i++, raw += CURVE_KEY_SIZE) {
+			CurveKey& key = curve[i];
+			key.frame = raw[0];
+			key.value = raw[1];
+			key.interp = static_cast<Interpolation>(static_cast<int>(raw[2]));
+			key.left[0] = raw[3];
+			key.left[1] = raw[4];
+			key.right[0] = raw[5];
+			key.right[1] = raw[6];
+
+			if (key.interp < INTERP_CONSTANT || key.interp > INTERP_BEZIER
+				|| (i > 0 && key.frame <= curve[i - 1].frame))
+				valid = false;
+		}
+	}
+	PyBuffer_Release(&view);
+
+	if (!valid) {
+		PyErr_SetString(PyExc_ValueError, "Invalid sparse keys");
+		throw PythonError();
+	}
+	return curve;
+}
+
+//Build the clip for one animation dict, requesting the key buffers from src
+static void fromPython(PyObject* obj, const std::vector<Skeleton*>& skeletons,
+	AnimationData& data, BufferKeySource& src, CurveBaker& baker)
+{
+	if (!PyDict_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError, "Animation must be a dict");
+		throw PythonError();
+	}
+
+	Clip& clip = addClip(data, skeletons);
+
+	clip.refFrame = REF_OBJECT;
+	if (PyObject* ref = PyDict_GetItemString(obj, "referenceFrame")) {
+		const char* str = check(PyUnicode_AsUTF8(ref));
+		if (std::strcmp(str, REF_INDEX[REF_BONE]) == 0)
+			clip.refFrame = REF_BONE;
+		else if (std::strcmp(str, REF_INDEX[REF_OBJECT]) != 0 && *str)
+			throw Exception(ERR_INVALID_INPUT, "Unsupported reference frame");
+	}
+
+	//Sparse tracks that have a rest pose, with the name of the track it is relative to.
+	//They are added to the baker once we have all the tracks.
+	struct RestTrack
+	{
+		BoneTrack* track;
+		std::vector<Curve> channels;
+		hkQsTransform rest;
+		std::string parent;
+	};
+	std::vector<RestTrack> restTracks;
+	std::map<std::string, BoneTrack*> trackNames;
+
+	PyRef tracks(check(PySequence_Fast(getItem(obj, "tracks"), "tracks must be a sequence")));
+	for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(tracks.get()); i++) {
+		const char* name;
+		const char* type;
+		PyObject* keys;
+		PyObject* restObj = nullptr;
+		const char* parent = nullptr;
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(tracks.get(), i), "ssO|Oz", &name, &type, &keys, &restObj, &parent))
+			throw PythonError();
+
+		//A list of sparse channels, or a buffer of dense keys
+		bool sparse = PyList_Check(keys);
+		if (!sparse && clip.refFrame == REF_BONE)
+			throw Exception(ERR_INVALID_INPUT, "Bone-space tracks must have sparse keys");
+
+		if (std::strcmp(type, TYPE_TRANSFORM) == 0) {
+			BoneTrack* track = addBoneTrack(clip, name);
+			if (track && sparse) {
+				if (PyList_GET_SIZE(keys) != TRANSFORM_SIZE) {
+					PyErr_SetString(PyExc_ValueError, "Transform tracks have 10 channels");
+					throw PythonError();
+				}
+				std::vector<Curve> channels;
+				for (int c = 0; c < TRANSFORM_SIZE; c++)
+					channels.push_back(toCurve(PyList_GET_ITEM(keys, c)));
+				trackNames[name] = track;
+
+				if (restObj && restObj != Py_None) {
+					//same layout as a key
+					float k[TRANSFORM_SIZE];
+					if (!PyArg_ParseTuple(restObj, "ffffffffff",
+						&k[0], &k[1], &k[2], &k[3], &k[4], &k[5], &k[6], &k[7], &k[8], &k[9]))
+						throw PythonError();
+					RestTrack item{ track, std::move(channels) };
+					item.rest.m_translation.set(k[0], k[1], k[2]);
+					item.rest.m_rotation.m_vec.set(k[4], k[5], k[6], k[3]);
+					item.rest.m_rotation.normalize();
+					item.rest.m_scale.set(k[7], k[8], k[9]);
+					item.parent = parent ? parent : "";
+					restTracks.push_back(std::move(item));
+				}
+				else
+					baker.add(track, std::move(channels));
+			}
+			else if (track)
+				src.add(track, keys, TRANSFORM_SIZE);
+		}
+		else if (std::strcmp(type, TYPE_FLOAT) == 0) {
+			FloatTrack* track = addFloatTrack(clip, name);
+			if (track && sparse) {
+				if (PyList_GET_SIZE(keys) != 1) {
+					PyErr_SetString(PyExc_ValueError, "Float tracks have 1 channel");
+					throw PythonError();
+				}
+				baker.add(track, toCurve(PyList_GET_ITEM(keys, 0)));
+			}
+			else if (track)
+				src.add(track, keys, 1);
+		}
+		//else ignore
+	}
+
+	for (auto&& item : restTracks) {
+		BoneTrack* parent = nullptr;
+		if (!item.parent.empty()) {
+			auto it = trackNames.find(item.parent);
+			if (it == trackNames.end())
+				throw Exception(ERR_INVALID_INPUT, "Rest pose relative to a track without keys");
+			parent = it->second;
+		}
+		baker.add(item.track, std::move(item.channels), item.rest, parent);
+	}
+
+	if (PyObject* annotations = PyDict_GetItemString(obj, "annotations")) {
+		PyRef seq(check(PySequence_Fast(annotations, "annotations must be a sequence")));
+		for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq.get()); i++) {
+			int frame;
+			const char* text;
+			if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq.get(), i), "is", &frame, &text))
+				throw PythonError();
+			clip.annotations.push_back({ frame, text });
+		}
+	}
+}
+
+PyDoc_STRVAR(unpack_doc,
+"unpack(hkx, skeletons, layout='keys', rotation=(1, 0, 0, 0), scale=1.0, binding=0) -> dict\n\n\
+Decompress an animation. hkx and each skeleton are a path or a bytes-like object.\n\
+binding picks the animation of a file that holds more than one.\n\
+With layout 'keys', keys are returned as float32 buffers, [keys][10] (location,\n\
+wxyz rotation, scale) for transform tracks and [keys] for float tracks.\n\
+With layout 'channels', each track is a list of float32 buffers of [keys][2]\n\
+(frame, value), one per fcurve. These keys are converted by the wxyz rotation\n\
+of the armature bones relative to the Havok bones, and lengths divided by scale.");
+
+static PyObject* unpack(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* kwlist[] = { "hkx", "skeletons", "layout", "rotation", "scale", "binding", nullptr };
+
+	PyObject* hkxObj;
+	PyObject* skeletonsObj;
+	const char* layout = "keys";
+	float w = 1.0f, x = 0.0f, y = 0.0f, z = 0.0f;
+	float scale = 1.0f;
+	int binding = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|s(ffff)fi", const_cast<char**>(kwlist),
+		&hkxObj, &skeletonsObj, &layout, &w, &x, &y, &z, &scale, &binding))
+		return nullptr;
+
+	try {
+		std::unique_ptr<ChannelSink> channels;
+		if (std::strcmp(layout, "channels") == 0) {
+			if (scale == 0.0f)
+				throw Exception(ERR_INVALID_ARGS, "Invalid scale");
+			hkQuaternion rotation(x, y, z, w);
+			rotation.normalize();
+			channels = std::make_unique<ChannelSink>(rotation, scale);
+		}
+		else if (std::strcmp(layout, "keys") != 0) {
+			throw Exception(ERR_INVALID_ARGS, "Unknown layout");
+		}
+
+		HavokEngine engine;
+		HKXInterface hkx;
+
+		SkeletonLoader skeletons;
+		loadSkeletons(hkx, skeletonsObj, skeletons);
+
+		hkRefPtr<hkaAnimationContainer> anim = load(hkx, hkxObj);
+
+		AnimationDecoder animation;
+		animation.m_options.binding = binding;
+		animation.decompress(anim, skeletons.get(), channels.get());
+
+		return toPython(animation.get(), channels.get());
+	}
+	catch (const PythonError&) {
+		return nullptr;
+	}
+	catch (const Exception& e) {
+		PyErr_SetString(PyExc_RuntimeError, e.msg);
+		return nullptr;
+	}
+	//Nothing may unwind into Python
+	catch (const std::bad_alloc&) {
+		PyErr_NoMemory();
+		return nullptr;
+	}
+	catch (const std::exception& e) {
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+		return nullptr;
+	}
+	catch (...) {
+		PyErr_SetString(PyExc_RuntimeError, "Unknown error");
+		return nullptr;
+	}
+}
+
+PyDoc_STRVAR(pack_doc,
+"pack(data, skeletons, layout, rotation=(1, 0, 0, 0), scale=1.0) -> bytes\n\n\
+Compress an animation given as returned by unpack. Only frames, additive and\n\
+the tracks and annotations of each animation are used. layout is 'WIN32',\n\
+'AMD64' or 'XML'.\n\
+The keys of a track are either a float32 buffer of dense keys in object space,\n\
+or a list of sparse channels (one per fcurve) as float32 buffers of [keys][7]\n\
+(frame, value, interpolation, left handle xy, right handle xy). Sparse keys are\n\
+sampled at frameStart + i * frameStep for each frame. If the referenceFrame of\n\
+the animation is 'BONE', its channels are pose bone channels, converted by the\n\
+wxyz rotation of the armature bones relative to the Havok bones and lengths\n\
+multiplied by scale. A sparse transform track may then be given as (name, type,\n\
+channels, rest, parent): rest is its rest pose in the armature relative to that\n\
+of the track named parent (None for the armature), as a converted key. It is\n\
+used instead of the reference pose of the skeleton to move the track to object\n\
+space. Either all or none of the tracks of an animation have one.");
+
+static PyObject* pack(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* kwlist[] = { "data", "skeletons", "layout", "rotation", "scale", nullptr };
+
+	PyObject* dataObj;
+	PyObject* skeletonsObj;
+	const char* layout;
+	float w = 1.0f, x = 0.0f, y = 0.0f, z = 0.0f;
+	float scale = 1.0f;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!Os|(ffff)f", const_cast<char**>(kwlist),
+		&PyDict_Type, &dataObj, &skeletonsObj, &layout, &w, &x, &y, &z, &scale))
+		return nullptr;
+
+	try {
+		HavokEngine engine;
+		HKXInterface hkx;
+
+		SkeletonLoader skeletons;
+		loadSkeletons(hkx, skeletonsObj, skeletons);
+
+		AnimationDecoder animation;
+		AnimationData& data = animation.get();
+		data.frames = getInt(dataObj, "frames");
+		if (PyDict_GetItemString(dataObj, "frameRate"))
+			data.frameRate = getInt(dataObj, "frameRate");
+		if (PyObject* additive = PyDict_GetItemString(dataObj, "additive"))
+			data.additive = PyObject_IsTrue(additive) == 1;
+
+		BufferKeySource src;
+		CurveBaker baker;
+		baker.m_options.rotation.set(x, y, z, w);
+		baker.m_options.rotation.normalize();
+		baker.m_options.lengthScale = scale;
+
+		PyRef anims(check(PySequence_Fast(getItem(dataObj, "animations"), "animations must be a sequence")));
+		for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(anims.get()); i++) {
+			fromPython(PySequence_Fast_GET_ITEM(anims.get(), i), skeletons.get(), data, src, baker);
+		}
+
+		//Sample any sparse keys
+		double start = 1.0;
+		double step = 1.0;
+		if (PyObject* obj = PyDict_GetItemString(dataObj, "frameStart"))
+			start = PyFloat_AsDouble(obj);
+		if (PyObject* obj = PyDict_GetItemString(dataObj, "frameStep"))
+			step = PyFloat_AsDouble(obj);
+		if (PyErr_Occurred())
+			throw PythonError();
+		baker.bake(data, static_cast<float>(start), static_cast<float>(step));
+
+		hkRefPtr<hkaAnimationContainer> anim = animation.compress(&src);
+		if (!anim)
+			throw Exception(ERR_INVALID_INPUT, "Nothing to export");
+
+		if (_stricmp(layout, "WIN32") == 0) {
+			hkx.m_options.layout = LAYOUT_WIN32;
+		}
+		else if (_stricmp(layout, "XML") == 0) {
+			hkx.m_options.textFormat = true;
+		}
+		else {
+			hkx.m_options.layout = LAYOUT_AMD64;
+		}
+
+		hkArray<char> out;
+		hkx.save(anim.val(), out);
+
+		return check(PyBytes_FromStringAndSize(out.begin(), out.getSize()));
+	}
+	catch (const PythonError&) {
+		return nullptr;
+	}
+	catch (const Exception& e) {
+		PyErr_SetString(PyExc_RuntimeError, e.msg);
+		return nullptr;
+	}
+	//Nothing may unwind into Python
+	catch (const std::bad_alloc&) {
+		PyErr_NoMemory();
+		return nullptr;
+	}
+	catch (const std::exception& e) {
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+		return nullptr;
+	}
+	catch (...) {
+		PyErr_SetString(PyExc_RuntimeError, "Unknown error");
+		return nullptr;
+	}
+}
+
+static PyMethodDef methods[] = {
+	{ "unpack", reinterpret_cast<PyCFunction>(unpack), METH_VARARGS | METH_KEYWORDS, unpack_doc },
+	{ "pack", reinterpret_cast<PyCFunction>(pack), METH_VARARGS | METH_KEYWORDS, pack_doc },
+	{ nullptr, nullptr, 0, nullptr },
+};
+
+static PyModuleDef module = {
+	PyModuleDef_HEAD_INIT,
+	"_blender_hkx",
+	"In-process Havok animation converter for the io_hkx_animation addon.",
+	-1,
+	methods,
+};
+
+PyMODINIT_FUNC PyInit__blender_hkx()
+{
+	if (!KeyBufferType) {
+		KeyBufferType = reinterpret_cast<PyTypeObject*>(PyType_FromSpec(&KeyBufferSpec));
+		if (!KeyBufferType)
+			return nullptr;
+	}
+	return PyModule_Create(&module);
+}
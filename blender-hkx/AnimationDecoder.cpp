@@ -1,36 +1,57 @@
 #include "pch.h"
 #include "AnimationDecoder.h"
+#include "Conditioning.h"
+#include "Profiler.h"
+#include "Rotations.h"
+#include "SplineBlocks.h"
 #include "TrackMapper.h"
 
 constexpr int FRAME_RATE = 30;
 
 using namespace iohkx;
 
+//The keys of all tracks at one frame, while packing
+struct Frame
+{
+	//interleaved keys of the tracks that have a slot in the raw animation
+	hkQsTransform* raw;
+	int index;
+
+	//The key of this track at this frame, or null if it has no keys
+	hkQsTransform* key(BoneTrack* track) const
+	{
+		if (!track)
+			return nullptr;
+		else if (track->slot >= 0)
+			return &raw[track->slot];
+		else if (!track->keys.isEmpty())
+			return &track->keys[index];
+		else
+			return nullptr;
+	}
+};
+
 //Transform the bone and its descendants to parent-space transform T
-static void objToBone(Bone* bone, Clip& clip, int frame,
+static void objToBone(Bone* bone, Clip& clip, const Frame& frame,
 	const hkQsTransform& T, const hkQsTransform& iT)
 {
-	assert(bone && frame >= 0);
+	assert(bone && frame.index >= 0);
 
 	//T is our parent's current pose (in object space) and iT its inverse
 
 	//Calc our recursion transforms
-	BoneTrack* track = bone->index >= 0 ? clip.boneMap[bone->index] : clip.rootTransform;
+	hkQsTransform* key = frame.key(bone->index >= 0 ? clip.boneMap[bone->index] : clip.rootTransform);
 	//if we have no track, our transform is T * our parent-space ref
 	//if we do have a track, we use our current key
 	hkQsTransform next_T;
-	if (track && !track->keys.isEmpty()) {
-		//as long as we export in object space, we need keys on every frame
-		assert(track->keys.getSize() > frame);
+	if (key) {
 		//save current
-		next_T = track->keys[frame];
+		next_T = *key;
 		//and update
 		//we want
 		//inv ref pose * inv parent current pose * current pose
-		hkQsTransform iRef;
-		iRef.setInverse(track->target->refPose);
-		track->keys[frame].setMul(iT, track->keys[frame]);
-		track->keys[frame].setMul(iRef, track->keys[frame]);
+		key->setMul(iT, *key);
+		key->setMul(bone->refPoseInv, *key);
 	}
 	else {
 		next_T.setMul(T, bone->refPose);
@@ -46,25 +67,23 @@ static void objToBone(Bone* bone, Clip& clip, int frame,
 }
 
 //Transform the bone and its descendants to parent-space transform T
-static void objToParent(Bone* bone, Clip& clip, int frame, 
+static void objToParent(Bone* bone, Clip& clip, const Frame& frame, 
 	const hkQsTransform& T, const hkQsTransform& iT)
 {
-	assert(bone && frame >= 0);
+	assert(bone && frame.index >= 0);
 
 	//T is our parent's current pose (in object space) and iT its inverse
 
 	//Calc our recursion transforms
-	BoneTrack* track = bone->index >= 0 ? clip.boneMap[bone->index] : clip.rootTransform;
+	hkQsTransform* key = frame.key(bone->index >= 0 ? clip.boneMap[bone->index] : clip.rootTransform);
 	//if we have no track, our transform is T * our parent-space ref
 	//if we do have a track, we use our current key
 	hkQsTransform next_T;
-	if (track && !track->keys.isEmpty()) {
-		//as long as we export in object space, we need keys on every frame
-		assert(track->keys.getSize() > frame);
+	if (key) {
 		//save current
-		next_T = track->keys[frame];
+		next_T = *key;
 		//and update
-		track->keys[frame].setMul(iT, track->keys[frame]);
+		key->setMul(iT, *key);
 	}
 	else {
 		next_T.setMul(T, bone->refPose);
@@ -79,18 +98,155 @@ static void objToParent(Bone* bone, Clip& clip, int frame,
 	}
 }
 
-//Set the sign of all quaternions so that they rotate the shortest path
-static void sanitiseQuats(Clip& clip)
+//Read the keys of a track into dst and repeat the last one until we have count keys
+template<typename TrackType, typename KeyType>
+static void readTrack(KeySource* src, TrackType* track, KeyType* dst, int stride, int count)
 {
-	for (int i = 0; i < clip.nBoneTracks; i++) {
-		for (int j = 1; j < clip.boneTracks[i].keys.getSize(); j++) {
-			auto&& thisR = clip.boneTracks[i].keys[j].m_rotation.m_vec;
-			auto&& prevR = clip.boneTracks[i].keys[j - 1].m_rotation.m_vec;
-			if (thisR.dot4(prevR) < 0.0f) {
-				thisR.setNeg4(thisR);
-			}
+	assert(track && count > 0);
+
+	int n;
+	if (src) {
+		n = src->readKeys(track, dst, stride, count);
+	}
+	else {
+		n = std::min(track->keys.getSize(), count);
+		for (int f = 0; f < n; f++) {
+			dst[f * stride] = track->keys[f];
 		}
 	}
+
+	//What if there are no keys? How would we deal with it?
+	if (n == 0)
+		throw Exception(ERR_INVALID_INPUT, "Track with no keys");
+
+	for (int f = n; f < count; f++) {
+		dst[f * stride] = dst[(n - 1) * stride];
+	}
+}
+
+//Do the bindings map their tracks to the same bones and floats?
+static bool sameTracks(const hkaAnimationBinding* a, const hkaAnimationBinding* b)
+{
+	assert(a && b);
+
+	auto same = [](const hkArray<hkInt16>& lhs, const hkArray<hkInt16>& rhs) {
+		return lhs.getSize() == rhs.getSize() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+	};
+	return a->m_blendHint == b->m_blendHint
+		&& same(a->m_transformTrackToBoneIndices, b->m_transformTrackToBoneIndices)
+		&& same(a->m_floatTrackToFloatSlotIndices, b->m_floatTrackToFloatSlotIndices);
+}
+
+//Can we sample some tracks without decoding all of them?
+static bool canSampleIndividually(const hkaAnimation* anim)
+{
+	assert(anim);
+
+	if (anim->getType() == hkaAnimation::HK_SPLINE_COMPRESSED_ANIMATION) {
+		//only if it was compressed with m_enableSampleSingleTracks
+		auto spline = static_cast<const hkaSplineCompressedAnimation*>(anim);
+		return !spline->m_transformOffsets.isEmpty() || !spline->m_floatOffsets.isEmpty();
+	}
+	else
+		return true;
+}
+
+static hkaSplineCompressedAnimation::TrackCompressionParams trackParams(const CompressionSettings& settings)
+{
+	hkaSplineCompressedAnimation::TrackCompressionParams tcp;
+	tcp.m_translationTolerance = settings.translationTolerance;
+	tcp.m_rotationTolerance = settings.rotationTolerance;
+	tcp.m_scaleTolerance = settings.scaleTolerance;
+	tcp.m_floatingTolerance = settings.floatTolerance;
+
+	tcp.m_translationQuantizationType = settings.translationQuantization;
+	tcp.m_rotationQuantizationType = settings.rotationQuantization;
+	tcp.m_scaleQuantizationType = settings.scaleQuantization;
+	tcp.m_floatQuantizationType = settings.floatQuantization;
+
+	if (settings.degree > 0) {
+		tcp.m_translationDegree = static_cast<hkUint16>(settings.degree);
+		tcp.m_rotationDegree = static_cast<hkUint16>(settings.degree);
+		tcp.m_scaleDegree = static_cast<hkUint16>(settings.degree);
+		tcp.m_floatingDegree = static_cast<hkUint16>(settings.degree);
+	}
+
+	if (!tcp.isOk())
+		throw Exception(ERR_INVALID_ARGS, "Invalid spline compression settings");
+
+	return tcp;
+}
+
+static hkaSplineCompressedAnimation::AnimationCompressionParams animationParams(
+	const CompressionSettings& settings, bool paired)
+{
+	hkaSplineCompressedAnimation::AnimationCompressionParams acp;
+	if (settings.framesPerBlock > 0)
+		acp.m_maxFramesPerBlock = static_cast<hkUint16>(settings.framesPerBlock);
+	if (paired || settings.sampleSingleTracks)
+		//paired animations need this (crash otherwise)
+		acp.m_enableSampleSingleTracks = true;
+	return acp;
+}
+
+//Encode raw as settings say (a new reference)
+static hkaAnimation* encode(hkaInterleavedUncompressedAnimation* raw, const CompressionSettings& settings, bool paired)
+{
+	assert(raw);
+
+	switch (settings.encoding) {
+	case ENCODING_SPLINE:
+	{
+		hkaSplineCompressedAnimation::TrackCompressionParams tcp = trackParams(settings);
+		hkaSplineCompressedAnimation::AnimationCompressionParams acp = animationParams(settings, paired);
+
+		ProfileScope compressStage("Spline compression");
+		compressStage.keys(raw->m_transforms.getSize() + raw->m_floats.getSize());
+		return new hkaSplineCompressedAnimation(*raw, tcp, acp);
+	}
+	case ENCODING_INTERLEAVED:
+		//Already is
+		raw->addReference();
+		return raw;
+	case ENCODING_DELTA:
+	{
+		hkaDeltaCompressedAnimation::CompressionParams params;
+		if (settings.quantizationBits > 0)
+			params.m_quantizationBits = settings.quantizationBits;
+		if (settings.framesPerBlock > 0)
+			params.m_blockSize = settings.framesPerBlock;
+		params.m_absolutePositionTolerance = settings.translationTolerance;
+		params.m_rotationTolerance = settings.rotationTolerance;
+		params.m_scaleTolerance = settings.scaleTolerance;
+		params.m_absoluteFloatTolerance = settings.floatTolerance;
+
+		ProfileScope compressStage("Delta compression");
+		compressStage.keys(raw->m_transforms.getSize() + raw->m_floats.getSize());
+		return new hkaDeltaCompressedAnimation(*raw, params);
+	}
+	case ENCODING_WAVELET:
+	{
+		hkaWaveletCompressedAnimation::CompressionParams params;
+		if (settings.quantizationBits > 0)
+			params.m_quantizationBits = settings.quantizationBits;
+		if (settings.framesPerBlock > 0)
+			params.m_blockSize = settings.framesPerBlock;
+		if (settings.preserve >= 0)
+			params.m_preserve = settings.preserve;
+		if (settings.truncation >= 0.0f)
+			params.m_truncProp = settings.truncation;
+		params.m_absolutePositionTolerance = settings.translationTolerance;
+		params.m_rotationTolerance = settings.rotationTolerance;
+		params.m_scaleTolerance = settings.scaleTolerance;
+		params.m_absoluteFloatTolerance = settings.floatTolerance;
+
+		ProfileScope compressStage("Wavelet compression");
+		compressStage.keys(raw->m_transforms.getSize() + raw->m_floats.getSize());
+		return new hkaWaveletCompressedAnimation(*raw, params);
+	}
+	default:
+		throw Exception(ERR_INVALID_ARGS, "Unknown encoding");
+	}
 }
 
 iohkx::AnimationDecoder::AnimationDecoder()
@@ -105,8 +261,10 @@ iohkx::AnimationDecoder::~AnimationDecoder()
 	}
 }
 
-hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
+hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress(KeySource* src)
 {
+	m_reusedBlocks = -1;
+
 	if (m_data.frames < 1 || m_data.clips.empty())
 		//Nothing to compress
 		return hkRefPtr<hkaAnimationContainer>();
@@ -114,8 +272,6 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 	if (m_data.frameRate != FRAME_RATE)
 		throw Exception(ERR_INVALID_INPUT, "Unsupported frame rate");
 
-	preProcess();
-
 	//Create binding (will be filled out by map*Comp)
 	hkaAnimationBinding* binding = new hkaAnimationBinding;
 
@@ -126,8 +282,10 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 
 	//Map the source data to the hkaAnimation in a way that works for both 
 	//single and paired animations
+	ProfileScope mapStage("Track mapping");
 	TrackPacker map;
 	map.map(m_data, raw, binding);
+	mapStage.end();
 
 	//The mapping functions should have determined how many tracks we need
 	int nBones = map.m_bones.size();
@@ -145,22 +303,16 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 	raw->m_transforms.setSize(nBones * m_data.frames);
 	raw->m_floats.setSize(nFloats * m_data.frames);
 
-	//Transfer data to raw anim
+	//Transfer data to raw anim. The keys go straight into their final slot.
+	ProfileScope readStage("Read keys");
+	readStage.keys(static_cast<long long>(nBones + nFloats) * m_data.frames);
 
 	//bone tracks
 	for (int i = 0; i < nBones; i++) {
 		BoneTrack* track = map.m_bones[i].first;
 		if (track) {
-			auto&& keys = track->keys;
-
-			//What if there are no keys? How would we deal with it?
-			if (keys.isEmpty())
-				throw Exception(ERR_INVALID_INPUT, "Track with no keys");
-
-			for (int f = 0; f < m_data.frames; f++) {
-				//Use current key, or last if none
-				raw->m_transforms[i + f * nBones] = keys.getSize() > f ? keys[f] : keys.back();
-			}
+			track->slot = i;
+			readTrack(src, track, &raw->m_transforms[i], nBones, m_data.frames);
 		}
 		else if (!m_data.additive) {
 			//fill with ref pose (or identity if we have no bone)
@@ -180,19 +332,18 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 	for (int i = 0; i < nFloats; i++) {
 		FloatTrack* track = map.m_floats[i];
 		if (track) {
-			auto&& keys = track->keys;
-
-			//What if there are no keys? How would we deal with it?
-			if (keys.isEmpty())
-				throw Exception(ERR_INVALID_INPUT, "Track with no keys");
-
-			for (int f = 0; f < m_data.frames; f++) {
-				//Use current key, or last if none
-				raw->m_floats[i + f * nFloats] = keys.getSize() > f ? keys[f] : keys.back();
-			}
+			readTrack(src, track, &raw->m_floats[i], nFloats, m_data.frames);
 		}
 		//else ignore (never fill)
 	}
+
+	readStage.end();
+
+	//Convert to parent space in place
+	ProfileScope convertStage("Hierarchy conversion");
+	preProcess(raw, src);
+	convertStage.end();
+
 	//annotations
 	for (int i : { 0, 1 }) {
 		if (map.m_annotationTracks[i] != -1) {
@@ -205,27 +356,70 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 		}
 	}
 
-	hkaSkeletonUtils::normalizeRotations(raw->m_transforms.begin(), raw->m_transforms.getSize());
-
-	hkaSplineCompressedAnimation::AnimationCompressionParams acp;
-	if (m_data.clips.size() == 2)
-		//paired animations need this (crash otherwise)
-		acp.m_enableSampleSingleTracks = true;
-
-	hkaSplineCompressedAnimation::TrackCompressionParams tcp;
-	tcp.m_translationTolerance = 0.004f;
-	tcp.m_rotationTolerance = 0.001f;
-	tcp.m_scaleTolerance = 0.004f;
-	tcp.m_floatingTolerance = 0.004f;
-
-	tcp.m_translationQuantizationType = hkaSplineCompressedAnimation::TrackCompressionParams::BITS8;
-	tcp.m_rotationQuantizationType = hkaSplineCompressedAnimation::TrackCompressionParams::THREECOMP40;
-	tcp.m_scaleQuantizationType = hkaSplineCompressedAnimation::TrackCompressionParams::BITS8;
-	tcp.m_floatQuantizationType = hkaSplineCompressedAnimation::TrackCompressionParams::BITS8;
+	//Normalise and set all rotations to the shortest distance from the previous key,
+	//a frame at a time
+	ProfileScope rotationStage("Rotations");
+	rotationStage.keys(static_cast<long long>(nBones) * m_data.frames);
+	for (int f = 0; f < m_data.frames; f++) {
+		normaliseFrameRotations(&raw->m_transforms[f * nBones], nBones,
+			f > 0 ? &raw->m_transforms[(f - 1) * nBones] : nullptr);
+	}
+	rotationStage.end();
+
+	const CompressionSettings& settings = m_options.compression;
+	bool paired = m_data.clips.size() == 2;
+
+	//Smooth the keys, if asked to. To tell what that saved us, we also encode them without.
+	m_unfilteredSize = -1;
+	if (settings.filter != FILTER_NONE) {
+		if (m_options.measureFilter) {
+			hkRefPtr<hkaInterleavedUncompressedAnimation> unfiltered = new hkaInterleavedUncompressedAnimation;
+			unfiltered->removeReference();
+			unfiltered->m_duration = raw->m_duration;
+			unfiltered->m_numberOfTransformTracks = raw->m_numberOfTransformTracks;
+			unfiltered->m_numberOfFloatTracks = raw->m_numberOfFloatTracks;
+			unfiltered->m_transforms.setSize(raw->m_transforms.getSize());
+			unfiltered->m_floats.setSize(raw->m_floats.getSize());
+			std::copy(raw->m_transforms.begin(), raw->m_transforms.end(), unfiltered->m_transforms.begin());
+			std::copy(raw->m_floats.begin(), raw->m_floats.end(), unfiltered->m_floats.begin());
+
+			hkRefPtr<hkaAnimation> anim = encode(unfiltered, settings, paired);
+			anim->removeReference();
+			m_unfilteredSize = anim->getSizeInBytes();
+		}
 
-	assert(tcp.isOk());
+		ProfileScope filterStage("Conditioning");
+		filterStage.keys(raw->m_transforms.getSize() + raw->m_floats.getSize());
+		conditionKeys(raw, settings);
+	}
 
-	binding->m_animation = new hkaSplineCompressedAnimation( *raw, tcp, acp );
+	//Smoothing took part of the tolerances
+	CompressionSettings encoding = encoderSettings(settings);
+
+	//Can we start from the base?
+	hkaSplineCompressedAnimation* base = nullptr;
+	if (settings.encoding == ENCODING_SPLINE && m_options.base && sameTracks(m_options.base, binding)
+		&& m_options.base->m_animation
+		&& m_options.base->m_animation->getType() == hkaAnimation::HK_SPLINE_COMPRESSED_ANIMATION)
+		base = static_cast<hkaSplineCompressedAnimation*>(m_options.base->m_animation.val());
+
+	int reencoded = base ? reencodeChangedBlocks(base, *raw, trackParams(encoding), animationParams(encoding, paired)) : -1;
+	if (reencoded >= 0) {
+		m_reusedBlocks = base->m_numBlocks - reencoded;
+		//(with our annotations)
+		base->m_annotationTracks.setSize(raw->m_annotationTracks.getSize());
+		for (int i = 0; i < raw->m_annotationTracks.getSize(); i++) {
+			base->m_annotationTracks[i].m_trackName = raw->m_annotationTracks[i].m_trackName;
+			base->m_annotationTracks[i].m_annotations.clear();
+			for (auto&& a : raw->m_annotationTracks[i].m_annotations)
+				base->m_annotationTracks[i].m_annotations.pushBack(a);
+		}
+		binding->m_animation = base;
+	}
+	else {
+		binding->m_animation = encode(raw, encoding, paired);
+		binding->m_animation->removeReference();
+	}
 
 	hkRefPtr<hkaAnimationContainer> animCtnr = new hkaAnimationContainer;
 	animCtnr->removeReference();
@@ -235,8 +429,43 @@ hkRefPtr<hkaAnimationContainer> iohkx::AnimationDecoder::compress()
 	return animCtnr;
 }
 
+std::string iohkx::CompressionSettings::describe() const
+{
+	//Keep in sync with compress()
+	static const char* const ENCODING_NAMES[]{ "spline", "interleaved", "delta", "wavelet" };
+	static const char* const ROTATION_NAMES[]{ "polar32", "threecomp40", "threecomp48", "threecomp24", "straight16", "uncompressed" };
+
+	char buf[256];
+	if (encoding == ENCODING_INTERLEAVED)
+		sprintf_s(buf, sizeof(buf), "%s", ENCODING_NAMES[encoding]);
+	else {
+		int n = sprintf_s(buf, sizeof(buf), "%s t%g r%g s%g f%g b%d",
+			ENCODING_NAMES[encoding], translationTolerance, rotationTolerance, scaleTolerance, floatTolerance, framesPerBlock);
+		if (encoding == ENCODING_SPLINE)
+			sprintf_s(buf + n, sizeof(buf) - n, " %s %d/%d/%d d%d%s", ROTATION_NAMES[rotationQuantization],
+				translationQuantization == ScalarQuantization::BITS16 ? 16 : 8,
+				scaleQuantization == ScalarQuantization::BITS16 ? 16 : 8,
+				floatQuantization == ScalarQuantization::BITS16 ? 16 : 8,
+				degree, sampleSingleTracks ? " single" : "");
+		else
+			sprintf_s(buf + n, sizeof(buf) - n, " q%d p%d x%g", quantizationBits, preserve, truncation);
+	}
+
+	std::string result(buf);
+	if (filter != FILTER_NONE) {
+		if (filter == FILTER_LOWPASS)
+			sprintf_s(buf, sizeof(buf), " lowpass%d", filterRadius);
+		else
+			sprintf_s(buf, sizeof(buf), " savgol%d/%d", filterRadius, filterDegree);
+		result += buf;
+		sprintf_s(buf, sizeof(buf), " cap %g,%g,%g,%g", translationCap, rotationCap, scaleCap, floatCap);
+		result += buf;
+	}
+	return result;
+}
+
 void iohkx::AnimationDecoder::decompress(
-	hkaAnimationContainer* animCtnr, const std::vector<Skeleton*>& skeletons)
+	hkaAnimationContainer* animCtnr, const std::vector<Skeleton*>& skeletons, KeySink* sink)
 {
 	//Init to a meaningful state, whether we are being reused or not
 	m_data.frames = 0;
@@ -244,89 +473,185 @@ void iohkx::AnimationDecoder::decompress(
 	m_data.additive = false;
 	m_data.clips.clear();
 
+	//If there's nothing to decompress, a sink still gets the empty animation we're left with
+	auto nothing = [this, sink]() {
+		if (sink) {
+			sink->begin(m_data);
+			sink->end(m_data);
+		}
+	};
+
 	//Abort if there is no data
-	if (!animCtnr || animCtnr->m_animations.isEmpty() || animCtnr->m_bindings.isEmpty())
+	if (!animCtnr || animCtnr->m_animations.isEmpty() || animCtnr->m_bindings.isEmpty()) {
+		nothing();
 		return;
+	}
+
+	if (m_options.binding < 0 || m_options.binding >= animCtnr->m_bindings.getSize())
+		throw Exception(ERR_INVALID_ARGS, "No such animation");
 
-	hkaAnimation* anim = animCtnr->m_animations[0];
-	hkaAnimationBinding* binding = animCtnr->m_bindings[0];
+	hkaAnimationBinding* binding = animCtnr->m_bindings[m_options.binding];
+	//(bindings should point to their animation, but fall back on the order)
+	hkaAnimation* anim = binding->m_animation;
+	if (!anim && m_options.binding < animCtnr->m_animations.getSize())
+		anim = animCtnr->m_animations[m_options.binding];
+	if (!anim) {
+		nothing();
+		return;
+	}
 
 	//Map the source data to our AnimationData in a way that works for both 
 	//single and paired animations
+	ProfileScope mapStage("Track mapping");
 	TrackUnpacker map;
-	if (!map.map(m_data, skeletons, anim, binding))
+	map.m_include = m_options.tracks;
+	if (!map.map(m_data, skeletons, anim, binding)) {
 		//mapping failed
+		nothing();
 		return;
+	}
+	mapStage.end();
 
-	//Set frame count, framerate, blend mode
-	m_data.frames = static_cast<int>(std::round(anim->m_duration * FRAME_RATE)) + 1;
+	//Set frame range, framerate, blend mode
+	int frames = static_cast<int>(std::round(anim->m_duration * FRAME_RATE)) + 1;
+	int first = std::max(m_options.firstFrame, 0);
+	int last = m_options.lastFrame < 0 ? frames - 1 : std::min(m_options.lastFrame, frames - 1);
+	if (first > last)
+		throw Exception(ERR_INVALID_ARGS, "Frame range is empty");
+
+	m_data.frames = last - first + 1;
 	m_data.frameRate = FRAME_RATE;
 	m_data.additive = binding->m_blendHint == hkaAnimationBinding::ADDITIVE;
+	for (auto&& clip : m_data.clips) {
+		clip.refFrame = REF_BONE;
+	}
+
+	//If we have a sink, we only hold a block of frames at a time
+	int blockSize = m_data.frames;
+	if (sink && m_options.blockSize > 0 && m_options.blockSize < m_data.frames)
+		blockSize = m_options.blockSize;
 
-	//Init the key arrays
+	//Init the key arrays and list the tracks we need to sample
+	hkArray<hkInt16> boneTracks;
+	hkArray<hkInt16> floatTracks;
 	for (int i = 0; i < anim->m_numberOfTransformTracks; i++) {
-		if (map.m_bones[i])
-			map.m_bones[i]->keys.setSize(m_data.frames);
+		if (map.m_bones[i]) {
+			map.m_bones[i]->keys.setSize(blockSize);
+			boneTracks.pushBack(i);
+		}
 	}
 	for (int i = 0; i < anim->m_numberOfFloatTracks; i++) {
-		if (map.m_floats[i])
-			map.m_floats[i]->keys.setSize(m_data.frames);
+		if (map.m_floats[i]) {
+			map.m_floats[i]->keys.setSize(blockSize);
+			floatTracks.pushBack(i);
+		}
 	}
 
+	//If we only need some of the tracks, don't decode the others
+	bool partial = boneTracks.getSize() < anim->m_numberOfTransformTracks
+		|| floatTracks.getSize() < anim->m_numberOfFloatTracks;
+	bool individual = partial && canSampleIndividually(anim);
+	//(if we can't sample them individually, we can at least skip the ones at the end)
+	int nT = boneTracks.isEmpty() ? 0 : boneTracks.back() + 1;
+	int nF = floatTracks.isEmpty() ? 0 : floatTracks.back() + 1;
+
 	//Sample animation and transfer keys
 	hkArray<hkQsTransform> tmpT(anim->m_numberOfTransformTracks);
 	hkArray<hkReal> tmpF(anim->m_numberOfFloatTracks);
+	//last rotation of each bone track in the previous block
+	hkArray<hkQuaternion> lastRotations(boneTracks.getSize());
+	if (sink)
+		sink->begin(m_data);
+
+	ProfileScope sampleStage("Sampling");
+	sampleStage.keys(static_cast<long long>(boneTracks.getSize() + floatTracks.getSize()) * m_data.frames);
+
 	for (int f = 0; f < m_data.frames; f++) {
-		anim->sampleTracks((float)f / FRAME_RATE, tmpT.begin(), tmpF.begin(), HK_NULL);
+		//key index within the current block
+		int k0 = f % blockSize;
+
+		hkReal time = (float)(first + f) / FRAME_RATE;
+		if (individual) {
+			//keys will be ordered as our track lists
+			anim->sampleIndividualTransformTracks(
+				time, boneTracks.begin(), boneTracks.getSize(), tmpT.begin());
+			anim->sampleIndividualFloatTracks(
+				time, floatTracks.begin(), floatTracks.getSize(), tmpF.begin());
+		}
+		else if (partial) {
+			anim->samplePartialTracks(time, nT, tmpT.begin(), nF, tmpF.begin(), HK_NULL);
+		}
+		else {
+			anim->sampleTracks(time, tmpT.begin(), tmpF.begin(), HK_NULL);
+		}
 
 		//convert tmpT to bone space
-		for (int i = 0; i < tmpT.getSize(); i++) {
-			if (map.m_bones[i]) {
-				assert(map.m_bones[i]->target);
+		for (int k = 0; k < boneTracks.getSize(); k++) {
+			int i = boneTracks[k];
+			hkQsTransform& key = tmpT[individual ? k : i];
 
-				//if additive, the offset first needs to be applied in parent space
-				if (m_data.additive) {
-					tmpT[i].setMulEq(map.m_bones[i]->target->refPose);
-				}
+			assert(map.m_bones[i] && map.m_bones[i]->target);
 
-				//now transform back to the ref space of the bone
-				//bone space = inv * tmpT
-				tmpT[i].setMul(map.m_bones[i]->target->refPoseInv, tmpT[i]);
+			//if additive, the offset first needs to be applied in parent space
+			if (m_data.additive) {
+				key.setMulEq(map.m_bones[i]->target->refPose);
 			}
-		}
 
-		hkaSkeletonUtils::normalizeRotations(tmpT.begin(), tmpT.getSize());
+			//now transform back to the ref space of the bone
+			//bone space = inv * tmpT
+			key.setMul(map.m_bones[i]->target->refPoseInv, key);
 
-		for (int i = 0; i < anim->m_numberOfTransformTracks; i++) {
-			if (map.m_bones[i])
-				map.m_bones[i]->keys[f] = tmpT[i];
+			map.m_bones[i]->keys[k0] = key;
 		}
-		for (int i = 0; i < anim->m_numberOfFloatTracks; i++) {
-			if (map.m_floats[i])
-				map.m_floats[i]->keys[f] = tmpF[i];
+		for (int k = 0; k < floatTracks.getSize(); k++) {
+			int i = floatTracks[k];
+			map.m_floats[i]->keys[k0] = tmpF[individual ? k : i];
+		}
+
+		if (k0 == blockSize - 1 || f == m_data.frames - 1) {
+			//Normalise the block and set all rotations to the shortest distance
+			//from the previous key, continuing from the last block
+			for (int k = 0; k < boneTracks.getSize(); k++) {
+				hkArray<hkQsTransform>& keys = map.m_bones[boneTracks[k]]->keys;
+				normaliseTrackRotations(keys.begin(), k0 + 1, f > k0 ? &lastRotations[k] : nullptr);
+				lastRotations[k] = keys[k0].m_rotation;
+			}
+
+			//Pass on any full block
+			if (sink)
+				sink->writeBlock(f - k0, k0 + 1);
 		}
-	}
-	for (auto&& clip : m_data.clips) {
-		clip.refFrame = REF_BONE;
 	}
 
-	removeDuplicateKeys();
+	sampleStage.end();
+
+	//The sink is responsible for this if we have one
+	if (!sink)
+		removeDuplicateKeys();
 
 	//Annotations
 	//map should point us to the annotation track for each clip
 	if (map.m_annotationClip != -1 && map.m_annotationTrack != -1) {
-		//store each annotation in the source animation
+		//store each annotation in the source animation that is within our range
 		for (auto&& item : anim->m_annotationTracks[map.m_annotationTrack].m_annotations) {
 			//(convert time to frame)
-			m_data.clips[map.m_annotationClip].annotations.push_back({
-				static_cast<int>(std::round(item.m_time * FRAME_RATE)),
-				item.m_text.cString() });
+			int frame = static_cast<int>(std::round(item.m_time * FRAME_RATE));
+			if (frame >= first && frame <= last) {
+				m_data.clips[map.m_annotationClip].annotations.push_back({
+					frame - first,
+					item.m_text.cString() });
+			}
 		}
 	}
+
+	if (sink)
+		sink->end(m_data);
 }
 
 void iohkx::AnimationDecoder::removeDuplicateKeys()
 {
+	ProfileScope stage("Remove duplicate keys");
+
 	//If all keys are equal, keep only one
 	for (auto&& clip : m_data.clips) {
 		//bones
@@ -358,34 +683,62 @@ void iohkx::AnimationDecoder::removeDuplicateKeys()
 	}
 }
 
-void iohkx::AnimationDecoder::preProcess()
+void iohkx::AnimationDecoder::preProcess(hkaInterleavedUncompressedAnimation* raw, KeySource* src)
 {
+	assert(raw);
+
+	int nBones = raw->m_numberOfTransformTracks;
+
 	hkQsTransform I(hkQsTransform::IDENTITY);
 	for (auto&& clip : m_data.clips) {
+		//Any tracks that didn't make it to the raw animation (like the root of a 
+		//single animation) may still affect their children, so we need their keys too
+		auto prepare = [this, src](BoneTrack* track) {
+			if (track && track->slot < 0 && track->target) {
+				hkArray<hkQsTransform>& keys = track->keys;
+				if (src) {
+					keys.setSize(m_data.frames);
+					keys.setSize(src->readKeys(track, keys.begin(), 1, m_data.frames));
+				}
+				//fill with the last key
+				if (!keys.isEmpty()) {
+					while (keys.getSize() < m_data.frames)
+						keys.pushBack(keys.back());
+				}
+			}
+		};
+		prepare(clip.rootTransform);
+		for (int t = 0; t < clip.nBoneTracks; t++)
+			prepare(&clip.boneTracks[t]);
+
 		//We expect transforms to be in object space now
 
 		//if (m_data.additive) {
 			//Transform to bone space
 		//	for (int f = 0; f < m_data.frames; f++) {
-		//		objToBone(clip.skeleton->rootBone, clip, f, I, I);
+		//		objToBone(clip.skeleton->rootBone, clip, { &raw->m_transforms[f * nBones], f }, I, I);
 		//	}
 		//}
 		//else {
 			//Transform to parent-bone space
+			ProfileScope parentStage("Object to parent space");
+			parentStage.keys(static_cast<long long>(nBones) * m_data.frames);
 			for (int f = 0; f < m_data.frames; f++) {
-				objToParent(clip.skeleton->rootBone, clip, f, I, I);
+				objToParent(clip.skeleton->rootBone, clip, { &raw->m_transforms[f * nBones], f }, I, I);
 			}
+			parentStage.end();
 		//}
 		if (m_data.additive) {
-			//convert to offset (right-mult by inverse of ref pose)
 			for (int t = 0; t < clip.nBoneTracks; t++) {
-				for (auto&& key : clip.boneTracks[t].keys) {
-					key.setMulEq(clip.boneTracks[t].target->refPoseInv);
+				BoneTrack& track = clip.boneTracks[t];
+				if (track.slot < 0)
+					continue;
+
+				//convert to offset (right-mult by inverse of ref pose)
+				for (int f = 0; f < m_data.frames; f++) {
+					raw->m_transforms[track.slot + f * nBones].setMulEq(track.target->refPoseInv);
 				}
 			}
 		}
-
-		//set all rotations to the shortest distance from previous key
-		sanitiseQuats(clip);
 	}
 }
@@ -3,24 +3,127 @@
 
 namespace iohkx
 {
+	//Kinds of animation compress() can make
+	enum Encoding
+	{
+		ENCODING_SPLINE,
+		ENCODING_INTERLEAVED,
+		ENCODING_DELTA,
+		ENCODING_WAVELET,
+	};
+
+	//How compress() smooths the keys before encoding them
+	enum Filter
+	{
+		FILTER_NONE,
+		//weighted (Gaussian) average of the neighbouring keys
+		FILTER_LOWPASS,
+		//least-squares polynomial through the neighbouring keys
+		FILTER_SAVITZKY_GOLAY,
+	};
+
+	//How compress() encodes an animation. Negative values leave Havok's default.
+	struct CompressionSettings
+	{
+		using RotationQuantization = hkaSplineCompressedAnimation::TrackCompressionParams::RotationQuantization;
+		using ScalarQuantization = hkaSplineCompressedAnimation::TrackCompressionParams::ScalarQuantization;
+
+		Encoding encoding{ ENCODING_SPLINE };
+
+		//Largest error allowed (all but interleaved)
+		float translationTolerance{ 0.004f };
+		float rotationTolerance{ 0.001f };
+		float scaleTolerance{ 0.004f };
+		float floatTolerance{ 0.004f };
+
+		//Frames in each independently decoded block (all but interleaved)
+		int framesPerBlock{ -1 };
+
+		//Spline only
+		RotationQuantization rotationQuantization{ RotationQuantization::THREECOMP40 };
+		ScalarQuantization translationQuantization{ ScalarQuantization::BITS8 };
+		ScalarQuantization scaleQuantization{ ScalarQuantization::BITS8 };
+		ScalarQuantization floatQuantization{ ScalarQuantization::BITS8 };
+		int degree{ -1 };
+		//Paired animations always get this
+		bool sampleSingleTracks{ false };
+
+		//Delta and wavelet only
+		int quantizationBits{ -1 };
+
+		//Wavelet only
+		int preserve{ -1 };
+		float truncation{ -1.0f };
+
+		//Smoothing of the parent-space keys (any encoding). Each key is smoothed over
+		//filterRadius frames on either side and moved no further than the cap of
+		//its kind (negative for half its tolerance). The encoder only gets what's
+		//left of the tolerance, so that the keys still end up within it.
+		Filter filter{ FILTER_NONE };
+		int filterRadius{ 2 };
+		//Savitzky-Golay only: degree of the polynomial
+		int filterDegree{ 2 };
+		float translationCap{ -1.0f };
+		float rotationCap{ -1.0f };
+		float scaleCap{ -1.0f };
+		float floatCap{ -1.0f };
+
+		//Describes all of the above, so that outputs can be told apart
+		std::string describe() const;
+	};
+
 	class AnimationDecoder
 	{
 	public:
 		AnimationDecoder();
 		~AnimationDecoder();
 
-		hkRefPtr<hkaAnimationContainer> compress();
+		//Keys are read from src if given, else from our tracks
+		hkRefPtr<hkaAnimationContainer> compress(KeySource* src = nullptr);
+		//If sink is given, keys are passed to it a block at a time 
+		//instead of being kept for the whole animation
 		void decompress(hkaAnimationContainer* animCtnr, 
-			const std::vector<Skeleton*>& skeletons);
+			const std::vector<Skeleton*>& skeletons, KeySink* sink = nullptr);
+
+		//Blocks of the base that the last compress() kept, or -1 if it didn't use one
+		int reusedBlocks() const { return m_reusedBlocks; }
+		//Size the last compress() would have made without smoothing, or -1 if it didn't measure it
+		int unfilteredSize() const { return m_unfilteredSize; }
 
 		AnimationData& get() { return m_data; }
 		const AnimationData& get() const { return m_data; }
 
+	public:
+		struct
+		{
+			//If not empty, only the tracks of these bones and floats are decompressed
+			std::set<std::string> tracks;
+			//Range of frames to decompress (-1 for the last frame of the animation)
+			int firstFrame{ 0 };
+			int lastFrame{ -1 };
+			//Number of frames to hold at a time when decompressing to a sink
+			int blockSize{ 64 };
+			//Which of the container's bindings (and its animation) to decompress
+			int binding{ 0 };
+			//How to compress
+			CompressionSettings compression;
+			//An earlier output of the same animation. If it's spline compressed with the
+			//same tracks, its blocks that still match the keys are kept and only the rest
+			//are compressed again (this changes its animation). It must have been made with
+			//the same settings: we can't tell the tolerances it was made with, so the
+			//caller has to (pack keeps them next to its outputs).
+			hkaAnimationBinding* base{ nullptr };
+			//Also encode the keys without smoothing, to tell what it saved (if we smooth)
+			bool measureFilter{ false };
+		} m_options;
+
 	private:
 		void removeDuplicateKeys();
-		void preProcess();
+		void preProcess(hkaInterleavedUncompressedAnimation* raw, KeySource* src);
 
 	private:
 		AnimationData m_data;
+		int m_reusedBlocks{ -1 };
+		int m_unfilteredSize{ -1 };
 	};
 }
@@ -0,0 +1,201 @@
+#include "pch.h"
+#include "AnimationDiff.h"
+#include "Profiler.h"
+#include "TrackMapper.h"
+
+using namespace iohkx;
+
+static float floatKey(const FloatTrack* track, const Float& target, int f)
+{
+	if (!track || track->keys.isEmpty())
+		return target.refValue;
+	return track->keys[std::min(f, track->keys.getSize() - 1)];
+}
+
+//Angle between two rotations, whichever sign they have
+static float angle(const hkQuaternion& a, const hkQuaternion& b)
+{
+	float dot = std::abs(static_cast<float>(a.m_vec.dot4(b.m_vec)));
+	return 2.0f * std::acos(std::min(dot, 1.0f));
+}
+
+void iohkx::AnimationDiff::compare(const AnimationData& a, const AnimationData& b)
+{
+	ProfileScope stage("Compare");
+
+	m_frames[0] = a.frames;
+	m_frames[1] = b.frames;
+	m_compared = std::min(a.frames, b.frames);
+	m_additive[0] = a.additive;
+	m_additive[1] = b.additive;
+
+	m_sameClips = a.clips.size() == b.clips.size();
+	for (size_t c = 0; c < a.clips.size() && m_sameClips; c++) {
+		m_sameClips = a.clips[c].skeleton && a.clips[c].skeleton == b.clips[c].skeleton;
+	}
+
+	m_bones.clear();
+	m_floats.clear();
+	m_annotations.clear();
+	if (!m_sameClips)
+		return;
+
+	for (size_t c = 0; c < a.clips.size(); c++) {
+		compareClips(static_cast<int>(c), a.clips[c], b.clips[c]);
+	}
+
+	for (auto&& bone : m_bones)
+		stage.keys(m_compared * (bone.tracked[0] + bone.tracked[1]));
+	for (auto&& track : m_floats)
+		stage.keys(m_compared * (track.tracked[0] + track.tracked[1]));
+}
+
+void iohkx::AnimationDiff::compareClips(int c, const Clip& a, const Clip& b)
+{
+	const Skeleton* skeleton = a.skeleton;
+	assert(skeleton && skeleton == b.skeleton);
+
+	//Every bone, then the root
+	int nBones = skeleton->nBones;
+	size_t firstBone = m_bones.size();
+	for (int i = 0; i <= nBones; i++) {
+		BoneErrors errors;
+		errors.clip = c;
+		errors.bone = i < nBones ? &skeleton->bones[i] : skeleton->rootBone;
+		errors.tracked[0] = trackOf(a, errors.bone) != nullptr;
+		errors.tracked[1] = trackOf(b, errors.bone) != nullptr;
+		m_bones.push_back(errors);
+	}
+
+	size_t firstFloat = m_floats.size();
+	for (int i = 0; i < skeleton->nFloats; i++) {
+		FloatErrors errors;
+		errors.clip = c;
+		errors.target = &skeleton->floats[i];
+		errors.tracked[0] = i < static_cast<int>(a.floatMap.size()) && a.floatMap[i];
+		errors.tracked[1] = i < static_cast<int>(b.floatMap.size()) && b.floatMap[i];
+		m_floats.push_back(errors);
+	}
+
+	std::vector<hkQsTransform> parent[2]{ std::vector<hkQsTransform>(nBones + 1), std::vector<hkQsTransform>(nBones + 1) };
+	std::vector<hkQsTransform> object[2]{ std::vector<hkQsTransform>(nBones + 1), std::vector<hkQsTransform>(nBones + 1) };
+	hkQsTransform I(hkQsTransform::IDENTITY);
+
+	for (int f = 0; f < m_compared; f++) {
+		bonePoses(skeleton->rootBone, a, f, I, parent[0], object[0]);
+		bonePoses(skeleton->rootBone, b, f, I, parent[1], object[1]);
+
+		for (int i = 0; i <= nBones; i++) {
+			BoneErrors& e = m_bones[firstBone + i];
+			e.parentTranslation.add(parent[0][i].m_translation.distanceTo3(parent[1][i].m_translation));
+			e.parentRotation.add(angle(parent[0][i].m_rotation, parent[1][i].m_rotation));
+			e.parentScale.add(parent[0][i].m_scale.distanceTo3(parent[1][i].m_scale));
+			e.objectTranslation.add(object[0][i].m_translation.distanceTo3(object[1][i].m_translation));
+			e.objectRotation.add(angle(object[0][i].m_rotation, object[1][i].m_rotation));
+			e.objectScale.add(object[0][i].m_scale.distanceTo3(object[1][i].m_scale));
+		}
+
+		for (int i = 0; i < skeleton->nFloats; i++) {
+			const Float& target = skeleton->floats[i];
+			const FloatTrack* ta = i < static_cast<int>(a.floatMap.size()) ? a.floatMap[i] : nullptr;
+			const FloatTrack* tb = i < static_cast<int>(b.floatMap.size()) ? b.floatMap[i] : nullptr;
+			m_floats[firstFloat + i].value.add(std::abs(floatKey(ta, target, f) - floatKey(tb, target, f)));
+		}
+	}
+
+	//Annotations are the same if they have the same text at the same frame
+	auto less = [](const Annotation& lhs, const Annotation& rhs) {
+		return lhs.frame != rhs.frame ? lhs.frame < rhs.frame : lhs.text < rhs.text;
+	};
+	std::vector<Annotation> annotations[2]{ a.annotations, b.annotations };
+	for (auto&& list : annotations)
+		std::sort(list.begin(), list.end(), less);
+
+	for (int side : { 0, 1 }) {
+		std::vector<Annotation> only;
+		std::set_difference(annotations[side].begin(), annotations[side].end(),
+			annotations[1 - side].begin(), annotations[1 - side].end(), std::back_inserter(only), less);
+		for (auto&& annotation : only)
+			m_annotations.push_back({ c, side, annotation });
+	}
+}
+
+bool iohkx::AnimationDiff::passes(const DiffThresholds& thresholds) const
+{
+	if (m_frames[0] != m_frames[1] || m_additive[0] != m_additive[1] || !m_sameClips || !m_annotations.empty())
+		return false;
+
+	for (auto&& e : m_bones) {
+		if (std::max(e.parentTranslation.max, e.objectTranslation.max) > thresholds.translation
+			|| std::max(e.parentRotation.max, e.objectRotation.max) > thresholds.rotation
+			|| std::max(e.parentScale.max, e.objectScale.max) > thresholds.scale)
+			return false;
+	}
+	for (auto&& e : m_floats) {
+		if (e.value.max > thresholds.value)
+			return false;
+	}
+	return true;
+}
+
+void iohkx::AnimationDiff::writeError(std::ostream& out, const char* name, const Error& e) const
+{
+	double rms = m_compared > 0 ? std::sqrt(e.sumSq / m_compared) : 0.0;
+	out << '"' << name << "\":{\"max\":" << e.max << ",\"rms\":" << rms << '}';
+}
+
+void iohkx::AnimationDiff::write(std::ostream& out, const std::string& a, const std::string& b,
+	const DiffThresholds& thresholds) const
+{
+	auto flag = [](bool b) { return b ? "true" : "false"; };
+
+	out << "{\"a\":";
+	writeJSONString(out, a);
+	out << ",\"b\":";
+	writeJSONString(out, b);
+	out << ",\"pass\":" << flag(passes(thresholds))
+		<< ",\"frames\":[" << m_frames[0] << ',' << m_frames[1] << ']'
+		<< ",\"additive\":[" << flag(m_additive[0]) << ',' << flag(m_additive[1]) << ']'
+		<< ",\"same_clips\":" << flag(m_sameClips);
+
+	out << ",\"bones\":[";
+	for (size_t i = 0; i < m_bones.size(); i++) {
+		const BoneErrors& e = m_bones[i];
+		out << (i ? "," : "") << "{\"clip\":" << e.clip << ",\"name\":";
+		writeJSONString(out, e.bone->name);
+		out << ",\"tracked\":[" << flag(e.tracked[0]) << ',' << flag(e.tracked[1]) << ']';
+		out << ",\"parent\":{";
+		writeError(out, "translation", e.parentTranslation);
+		out << ',';
+		writeError(out, "rotation", e.parentRotation);
+		out << ',';
+		writeError(out, "scale", e.parentScale);
+		out << "},\"object\":{";
+		writeError(out, "translation", e.objectTranslation);
+		out << ',';
+		writeError(out, "rotation", e.objectRotation);
+		out << ',';
+		writeError(out, "scale", e.objectScale);
+		out << "}}";
+	}
+
+	out << "],\"floats\":[";
+	for (size_t i = 0; i < m_floats.size(); i++) {
+		const FloatErrors& e = m_floats[i];
+		out << (i ? "," : "") << "{\"clip\":" << e.clip << ",\"name\":";
+		writeJSONString(out, e.target->name);
+		out << ",\"tracked\":[" << flag(e.tracked[0]) << ',' << flag(e.tracked[1]) << "],";
+		writeError(out, "value", e.value);
+		out << '}';
+	}
+
+	out << "],\"annotations\":[";
+	for (size_t i = 0; i < m_annotations.size(); i++) {
+		const AnnotationDiff& d = m_annotations[i];
+		out << (i ? "," : "") << "{\"clip\":" << d.clip << ",\"only\":\"" << (d.only ? 'b' : 'a')
+			<< "\",\"frame\":" << d.annotation.frame << ",\"text\":";
+		writeJSONString(out, d.annotation.text);
+		out << '}';
+	}
+	out << "]}";
+}
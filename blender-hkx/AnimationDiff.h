@@ -0,0 +1,91 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Largest differences two animations can have and still count as the same
+	struct DiffThresholds
+	{
+		//distance, in the units of the skeleton
+		float translation{ 0.01f };
+		//angle, in radians
+		float rotation{ 0.01f };
+		float scale{ 0.01f };
+		//of float tracks
+		float value{ 0.01f };
+	};
+
+	//Frame-by-frame comparison of two decompressed animations of the same skeleton(s).
+	//Every bone is compared in parent and object space, every float slot by value,
+	//and the annotations by frame and text.
+	class AnimationDiff
+	{
+	public:
+		void compare(const AnimationData& a, const AnimationData& b);
+
+		bool passes(const DiffThresholds& thresholds) const;
+
+		//As one JSON object (no newline), naming the animations a and b
+		void write(std::ostream& out, const std::string& a, const std::string& b,
+			const DiffThresholds& thresholds) const;
+
+	private:
+		struct Error
+		{
+			float max{ 0.0f };
+			double sumSq{ 0.0 };
+
+			void add(float e)
+			{
+				max = std::max(max, e);
+				sumSq += static_cast<double>(e) * e;
+			}
+		};
+
+		struct BoneErrors
+		{
+			int clip{ 0 };
+			const Bone* bone{ nullptr };
+			//whether a and b have a track for it
+			bool tracked[2]{ false, false };
+
+			Error parentTranslation;
+			Error parentRotation;
+			Error parentScale;
+			Error objectTranslation;
+			Error objectRotation;
+			Error objectScale;
+		};
+
+		struct FloatErrors
+		{
+			int clip{ 0 };
+			const Float* target{ nullptr };
+			bool tracked[2]{ false, false };
+			Error value;
+		};
+
+		struct AnnotationDiff
+		{
+			int clip{ 0 };
+			//animation (0 or 1) that has it and the other doesn't
+			int only{ 0 };
+			Annotation annotation;
+		};
+
+		void compareClips(int c, const Clip& a, const Clip& b);
+		void writeError(std::ostream& out, const char* name, const Error& e) const;
+
+	private:
+		int m_frames[2]{ 0, 0 };
+		//frames in both
+		int m_compared{ 0 };
+		bool m_additive[2]{ false, false };
+		//same number of clips, of the same skeletons
+		bool m_sameClips{ true };
+
+		std::vector<BoneErrors> m_bones;
+		std::vector<FloatErrors> m_floats;
+		std::vector<AnnotationDiff> m_annotations;
+	};
+}
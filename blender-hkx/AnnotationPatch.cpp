@@ -0,0 +1,115 @@
+#include "pch.h"
+#include "AnnotationPatch.h"
+#include "Profiler.h"
+
+constexpr int FRAME_RATE = 30;
+
+//Track of bone 0 of the first actor in the paired animations we make:
+//PairedRoot, then the root of the first actor, then its bones
+constexpr int PAIRED_ANNOTATION_TRACK = 2;
+
+using namespace iohkx;
+
+int iohkx::findAnnotationTrack(const hkaAnimation* animation, const hkaAnimationBinding* binding)
+{
+	assert(animation && binding);
+
+	for (int i = 0; i < animation->m_annotationTracks.getSize(); i++) {
+		if (!animation->m_annotationTracks[i].m_annotations.isEmpty())
+			return i;
+	}
+
+	int nTracks = animation->m_numberOfTransformTracks;
+	if (nTracks == 0)
+		return -1;
+
+	if (binding->m_originalSkeletonName == "PairedRoot")
+		return std::min(PAIRED_ANNOTATION_TRACK, nTracks - 1);
+
+	//Same as the unpacker: the track bound to bone 0, or the first if they are not mapped
+	const hkArray<hkInt16>& bones = binding->m_transformTrackToBoneIndices;
+	for (int i = 0; i < bones.getSize(); i++) {
+		if (bones[i] == 0)
+			return i;
+	}
+	return 0;
+}
+
+int iohkx::AnnotationPatch::apply(hkaAnimationContainer* animCtnr, int binding) const
+{
+	assert(animCtnr);
+
+	ProfileScope stage("Patch annotations");
+
+	if (binding < 0 || binding >= animCtnr->m_bindings.getSize())
+		throw Exception(ERR_INVALID_ARGS, "No such animation");
+
+	hkaAnimationBinding* b = animCtnr->m_bindings[binding];
+	hkaAnimation* animation = b->m_animation;
+	if (!animation && binding < animCtnr->m_animations.getSize())
+		animation = animCtnr->m_animations[binding];
+	if (!animation)
+		throw Exception(ERR_INVALID_INPUT, "No animation found");
+
+	int track = findAnnotationTrack(animation, b);
+	if (track < 0)
+		throw Exception(ERR_INVALID_INPUT, "Animation has no tracks to annotate");
+
+	//There should be one annotation track per transform track, even if they're all empty
+	auto&& tracks = animation->m_annotationTracks;
+	if (tracks.getSize() < animation->m_numberOfTransformTracks) {
+		int first = tracks.getSize();
+		tracks.setSize(animation->m_numberOfTransformTracks);
+		for (int i = first; i < tracks.getSize(); i++) {
+			//(the strings are not initialised)
+			tracks[i].m_trackName = "";
+			tracks[i].m_annotations.clear();
+		}
+	}
+
+	//Work on a copy, in frames
+	std::vector<Annotation> result;
+	if (!clear) {
+		for (auto&& a : tracks[track].m_annotations) {
+			const char* text = a.m_text.cString();
+			if (!text)
+				text = "";
+			if (remove.find(text) == remove.end())
+				result.push_back({ static_cast<int>(std::round(a.m_time * FRAME_RATE)), text });
+		}
+	}
+	for (auto&& a : add) {
+		if (a.frame < 0)
+			throw Exception(ERR_INVALID_ARGS, "Invalid annotation frame");
+
+		if (std::find_if(result.begin(), result.end(), [&a](const Annotation& b) {
+			return a.frame == b.frame && a.text == b.text; }) == result.end())
+			result.push_back(a);
+	}
+	std::stable_sort(result.begin(), result.end(),
+		[](const Annotation& lhs, const Annotation& rhs) { return lhs.frame < rhs.frame; });
+
+	//Existing annotations keep their exact times
+	hkArray<hkaAnnotationTrack::Annotation>& dst = tracks[track].m_annotations;
+	std::vector<std::pair<float, std::string>> times;
+	for (auto&& a : dst) {
+		times.push_back({ a.m_time, a.m_text.cString() ? a.m_text.cString() : "" });
+	}
+
+	dst.clear();
+	for (auto&& a : result) {
+		hkaAnnotationTrack::Annotation item;
+		item.m_time = static_cast<float>(a.frame) / FRAME_RATE;
+		for (auto it = times.begin(); it != times.end(); ++it) {
+			if (it->second == a.text && static_cast<int>(std::round(it->first * FRAME_RATE)) == a.frame) {
+				item.m_time = it->first;
+				times.erase(it);
+				break;
+			}
+		}
+		item.m_text = a.text.c_str();
+		dst.pushBack(item);
+	}
+
+	return dst.getSize();
+}
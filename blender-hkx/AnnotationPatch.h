@@ -0,0 +1,25 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Changes to the annotations of an animation, made to a loaded container
+	//without touching its compressed tracks
+	struct AnnotationPatch
+	{
+		//Remove all existing annotations first
+		bool clear{ false };
+		//Remove existing annotations with any of these texts
+		std::set<std::string> remove;
+		//Then add these, unless there is one with the same frame and text already
+		std::vector<Annotation> add;
+
+		//Apply to the animation of binding. Returns the number of annotations it ends up with.
+		int apply(hkaAnimationContainer* animCtnr, int binding) const;
+	};
+
+	//The track an animation keeps its annotations in: any track that already has
+	//some, else the one of bone 0 (of the first actor, if paired).
+	//-1 if it has no transform tracks.
+	int findAnnotationTrack(const hkaAnimation* animation, const hkaAnimationBinding* binding);
+}
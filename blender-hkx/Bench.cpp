@@ -0,0 +1,581 @@
+#include "pch.h"
+#include "Bench.h"
+#include "AnimationDecoder.h"
+#include "Profiler.h"
+#include "Rotations.h"
+#include "XMLInterface.h"
+
+constexpr float PI = 3.14159265f;
+//times we look up each name in the lookup phase
+constexpr int LOOKUP_ROUNDS = 1000;
+//size of the buffer we overwrite to empty the caches
+constexpr size_t EVICT_SIZE = 64 * 1024 * 1024;
+//cold samples are this much fewer than warm
+constexpr int COLD_SAMPLE_RATIO = 10;
+
+using namespace iohkx;
+
+iohkx::SyntheticData::SyntheticData(const BenchConfig& config) : m_config(config)
+{
+	if (m_config.bones < 1 || m_config.depth < 1 || m_config.floats < 0 || m_config.frames < 1)
+		throw Exception(ERR_INVALID_ARGS, "Invalid benchmark configuration");
+	if (m_config.paired && m_config.additive)
+		//the packer doesn't support this
+		throw Exception(ERR_INVALID_ARGS, "Paired animations can't be additive");
+
+	addSkeleton("Synthetic");
+	if (m_config.paired)
+		addSkeleton("Synthetic");
+}
+
+void iohkx::SyntheticData::addSkeleton(const char* name)
+{
+	hkRefPtr<hkaSkeleton> skeleton = new hkaSkeleton;
+	skeleton->removeReference();
+
+	skeleton->m_name = name;
+	skeleton->m_bones.setSize(m_config.bones);
+	skeleton->m_parentIndices.setSize(m_config.bones);
+	skeleton->m_referencePose.setSize(m_config.bones);
+
+	char buf[32];
+	for (int i = 0; i < m_config.bones; i++) {
+		sprintf_s(buf, sizeof(buf), "Bone%d", i);
+		skeleton->m_bones[i].m_name = buf;
+		skeleton->m_bones[i].m_lockTranslation = false;
+
+		//Chains of bones hanging off bone 0, none longer than depth.
+		//Parents always come first.
+		if (i == 0 || m_config.depth == 1)
+			skeleton->m_parentIndices[i] = -1;
+		else
+			skeleton->m_parentIndices[i] = (i - 1) % (m_config.depth - 1) == 0 ? 0 : i - 1;
+
+		hkQsTransform& ref = skeleton->m_referencePose[i];
+		ref.setIdentity();
+		ref.m_translation.set(0.0f, 0.1f, 0.0f);
+	}
+
+	skeleton->m_floatSlots.setSize(m_config.floats);
+	skeleton->m_referenceFloats.setSize(m_config.floats);
+	for (int i = 0; i < m_config.floats; i++) {
+		sprintf_s(buf, sizeof(buf), "Float%d", i);
+		skeleton->m_floatSlots[i] = buf;
+		skeleton->m_referenceFloats[i] = 0.0f;
+	}
+
+	hkRefPtr<hkaAnimationContainer> animCtnr = new hkaAnimationContainer;
+	animCtnr->removeReference();
+	animCtnr->m_skeletons.pushBack(skeleton);
+
+	m_skeletons.load(animCtnr.val());
+}
+
+void iohkx::SyntheticData::fill(AnimationData& data) const
+{
+	data.frames = m_config.frames;
+	data.frameRate = 30;
+	data.additive = m_config.additive;
+
+	data.clips.resize(m_config.paired ? 2 : 1);
+	for (unsigned int i = 0; i < data.clips.size(); i++) {
+		fillClip(data.clips[i], i);
+	}
+}
+
+void iohkx::SyntheticData::fillClip(Clip& clip, int actor) const
+{
+	const Skeleton* skeleton = m_skeletons[actor];
+	int frames = m_config.frames;
+
+	clip.skeleton = skeleton;
+	clip.refFrame = REF_OBJECT;
+
+	clip.rootTransform = new BoneTrack;
+	clip.boneTracks = new BoneTrack[skeleton->nBones];
+	clip.floatTracks = new FloatTrack[skeleton->nFloats];
+	clip.boneMap.resize(skeleton->nBones, nullptr);
+	clip.floatMap.resize(skeleton->nFloats, nullptr);
+
+	//Root: the secondary actor stands a bit away from the primary
+	clip.rootTransform->target = skeleton->rootBone;
+	clip.rootTransform->keys.setSize(frames);
+	for (int f = 0; f < frames; f++) {
+		clip.rootTransform->keys[f].setIdentity();
+		clip.rootTransform->keys[f].m_translation.set(static_cast<float>(actor), 0.0f, 0.0f);
+	}
+
+	//Bones: each one swings about one of the axes, a quarter of them don't move at all
+	clip.nBoneTracks = skeleton->nBones;
+	for (int i = 0; i < skeleton->nBones; i++) {
+		BoneTrack& track = clip.boneTracks[i];
+		const Bone& bone = skeleton->bones[i];
+		track.target = &bone;
+		clip.boneMap[i] = &track;
+
+		hkVector4 axis(i % 3 == 0 ? 1.0f : 0.0f, i % 3 == 1 ? 1.0f : 0.0f, i % 3 == 2 ? 1.0f : 0.0f);
+		float amplitude = i % 4 == 3 ? 0.0f : 0.5f;
+		float phase = 0.37f * i;
+
+		track.keys.setSize(frames);
+		for (int f = 0; f < frames; f++) {
+			hkQsTransform local = bone.refPose;
+			hkQuaternion q;
+			q.setAxisAngle(axis, amplitude * std::sin(2.0f * PI * f / 60.0f + phase));
+			local.m_rotation.setMul(local.m_rotation, q);
+
+			//we want object space
+			const hkQsTransform& parent = bone.parent->index >= 0 ?
+				clip.boneTracks[bone.parent->index].keys[f] : clip.rootTransform->keys[f];
+			track.keys[f].setMul(parent, local);
+		}
+	}
+
+	//Floats
+	clip.nFloatTracks = skeleton->nFloats;
+	for (int i = 0; i < skeleton->nFloats; i++) {
+		FloatTrack& track = clip.floatTracks[i];
+		track.target = &skeleton->floats[i];
+		clip.floatMap[i] = &track;
+
+		track.keys.setSize(frames);
+		for (int f = 0; f < frames; f++) {
+			track.keys[f] = 0.5f + 0.5f * std::sin(2.0f * PI * f / 45.0f + i);
+		}
+	}
+
+	if (actor == 0) {
+		clip.annotations.push_back({ 0, "SoundPlay.Synthetic" });
+		clip.annotations.push_back({ frames / 2, "Synthetic" });
+	}
+}
+
+//Per-stage results of every run of one phase
+struct StageRuns
+{
+	std::string phase;
+	std::string stage;
+	std::vector<long long> wall;
+	std::vector<long long> cpu;
+	long long keys{ 0 };
+	long long allocs{ 0 };
+	long long allocBytes{ 0 };
+};
+
+//Run a phase and add the stages it recorded to results
+template<typename Fn>
+static void runPhase(Profiler& profiler, const char* phase, Fn fn, std::vector<StageRuns>& results)
+{
+	profiler.clear();
+	{
+		ProfileScope total(phase);
+		fn();
+	}
+
+	//Stages can repeat within a run (per clip); sum them
+	std::vector<size_t> thisRun;
+	for (auto&& s : profiler.stages()) {
+		auto it = std::find_if(results.begin(), results.end(), [&](const StageRuns& r) {
+			return r.phase == phase && r.stage == s.name; });
+		if (it == results.end()) {
+			results.push_back({ phase, s.name });
+			it = results.end() - 1;
+		}
+		size_t index = it - results.begin();
+		StageRuns& r = *it;
+		if (std::find(thisRun.begin(), thisRun.end(), index) == thisRun.end()) {
+			thisRun.push_back(index);
+			r.wall.push_back(0);
+			r.cpu.push_back(0);
+			//same every run
+			r.keys = r.allocs = r.allocBytes = 0;
+		}
+		r.wall.back() += s.wall;
+		r.cpu.back() += s.cpu;
+		r.keys += s.keys;
+		r.allocs += s.allocs;
+		r.allocBytes += s.allocBytes;
+	}
+}
+
+//Big enough to push anything else out of the caches
+static void evictCaches()
+{
+	static std::vector<char> buf(EVICT_SIZE);
+	static std::mutex mutex;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < buf.size(); i += 64)
+		buf[i]++;
+}
+
+double iohkx::timeSampling(const hkaAnimation* anim, const SampleConfig& config)
+{
+	assert(anim && config.samples > 0);
+
+	int nTransforms = anim->m_numberOfTransformTracks;
+	int nFloats = anim->m_numberOfFloatTracks;
+	bool partial = config.tracks >= 0 && (config.tracks < nTransforms || config.tracks < nFloats);
+	if (partial) {
+		nTransforms = std::min(nTransforms, config.tracks);
+		nFloats = std::min(nFloats, config.tracks);
+	}
+
+	hkArray<hkQsTransform> transforms(std::max(anim->m_numberOfTransformTracks, 1));
+	hkArray<hkReal> floats(std::max(anim->m_numberOfFloatTracks, 1));
+
+	//Decide the times first, so we only time the sampling
+	std::vector<hkReal> times(config.samples);
+	if (config.random) {
+		//(same times every run)
+		std::mt19937 rng(config.samples);
+		std::uniform_real_distribution<float> dist(0.0f, anim->m_duration);
+		for (auto&& t : times)
+			t = dist(rng);
+	}
+	else {
+		for (int i = 0; i < config.samples; i++)
+			times[i] = anim->m_duration * i / config.samples;
+	}
+
+	auto sample = [&](hkReal time) {
+		if (partial)
+			anim->samplePartialTracks(time, nTransforms, transforms.begin(), nFloats, floats.begin(), HK_NULL);
+		else
+			anim->sampleTracks(time, transforms.begin(), floats.begin(), HK_NULL);
+	};
+
+	std::chrono::steady_clock::duration total{ 0 };
+	if (config.cold) {
+		for (hkReal time : times) {
+			evictCaches();
+			auto start = std::chrono::steady_clock::now();
+			sample(time);
+			total += std::chrono::steady_clock::now() - start;
+		}
+	}
+	else {
+		auto start = std::chrono::steady_clock::now();
+		for (hkReal time : times)
+			sample(time);
+		total = std::chrono::steady_clock::now() - start;
+	}
+
+	return std::chrono::duration<double, std::nano>(total).count() / config.samples;
+}
+
+static const char* encodingName(const hkaAnimation* anim)
+{
+	switch (anim->getType()) {
+	case hkaAnimation::HK_INTERLEAVED_ANIMATION:
+		return "interleaved";
+	case hkaAnimation::HK_DELTA_COMPRESSED_ANIMATION:
+		return "delta";
+	case hkaAnimation::HK_WAVELET_COMPRESSED_ANIMATION:
+		return "wavelet";
+	case hkaAnimation::HK_SPLINE_COMPRESSED_ANIMATION:
+		return "spline";
+	default:
+		return "other";
+	}
+}
+
+void iohkx::runSampleBenchmark(const hkaAnimationContainer* anim, const char* name,
+	int samples, int partialTracks, std::ostream& out)
+{
+	assert(anim && name);
+
+	if (samples < 1)
+		throw Exception(ERR_INVALID_ARGS, "Invalid number of samples");
+
+	for (int b = 0; b < anim->m_bindings.getSize(); b++) {
+		const hkaAnimation* animation = anim->m_bindings[b]->m_animation;
+		if (!animation && b < anim->m_animations.getSize())
+			animation = anim->m_animations[b];
+		if (!animation)
+			continue;
+
+		int nTracks = animation->m_numberOfTransformTracks + animation->m_numberOfFloatTracks;
+		int partial = partialTracks >= 0 ? partialTracks : std::max(animation->m_numberOfTransformTracks / 4, 1);
+
+		for (bool random : { false, true }) {
+			for (bool all : { true, false }) {
+				for (bool cold : { false, true }) {
+					SampleConfig config;
+					//(the evicting takes much longer than the sampling)
+					config.samples = cold ? std::max(samples / COLD_SAMPLE_RATIO, 1) : samples;
+					config.random = random;
+					config.tracks = all ? -1 : partial;
+					config.cold = cold;
+
+					int tracks = all ? nTracks : std::min(partial, animation->m_numberOfTransformTracks)
+						+ std::min(partial, animation->m_numberOfFloatTracks);
+
+					double ns = timeSampling(animation, config);
+
+					out << "{\"file\":";
+					writeJSONString(out, name);
+					out << ",\"binding\":" << b
+						<< ",\"encoding\":\"" << encodingName(animation) << "\""
+						<< ",\"bytes\":" << animation->getSizeInBytes()
+						<< ",\"duration\":" << animation->m_duration
+						<< ",\"pattern\":\"" << (random ? "random" : "sequential") << "\""
+						<< ",\"set\":\"" << (all ? "full" : "partial") << "\""
+						<< ",\"cache\":\"" << (cold ? "cold" : "warm") << "\""
+						<< ",\"tracks\":" << tracks
+						<< ",\"samples\":" << config.samples
+						<< ",\"ns_per_pose\":" << ns
+						<< ",\"ns_per_track\":" << (tracks > 0 ? ns / tracks : 0.0) << "}\n";
+				}
+			}
+		}
+	}
+}
+
+//Look up every bone and float name (and as many that don't exist) in the
+//skeleton's name indices and in the std::maps they replaced. Names are given as
+//C strings, like the track mappers get them.
+static void benchLookup(const Skeleton& skeleton)
+{
+	std::map<std::string, const Bone*> boneMap;
+	for (int i = 0; i < skeleton.nBones; i++) {
+		boneMap[skeleton.bones[i].name] = &skeleton.bones[i];
+	}
+	std::map<std::string, const Float*> floatMap;
+	for (int i = 0; i < skeleton.nFloats; i++) {
+		floatMap[skeleton.floats[i].name] = &skeleton.floats[i];
+	}
+
+	std::vector<std::string> bones;
+	for (int i = 0; i < skeleton.nBones; i++) {
+		bones.push_back(skeleton.bones[i].name);
+		bones.push_back(skeleton.bones[i].name + " Missing");
+	}
+	std::vector<std::string> floats;
+	for (int i = 0; i < skeleton.nFloats; i++) {
+		floats.push_back(skeleton.floats[i].name);
+		floats.push_back(skeleton.floats[i].name + " Missing");
+	}
+	long long lookups = static_cast<long long>(LOOKUP_ROUNDS) * (bones.size() + floats.size());
+
+	int mapFound = 0;
+	{
+		ProfileScope stage("Name lookup (map)");
+		stage.keys(lookups);
+		for (int r = 0; r < LOOKUP_ROUNDS; r++) {
+			for (auto&& name : bones) {
+				mapFound += boneMap.find(name.c_str()) != boneMap.end();
+			}
+			for (auto&& name : floats) {
+				mapFound += floatMap.find(name.c_str()) != floatMap.end();
+			}
+		}
+	}
+
+	int indexFound = 0;
+	{
+		ProfileScope stage("Name lookup (hashed)");
+		stage.keys(lookups);
+		for (int r = 0; r < LOOKUP_ROUNDS; r++) {
+			for (auto&& name : bones) {
+				indexFound += skeleton.boneIndex.find(name.c_str()) != nullptr;
+			}
+			for (auto&& name : floats) {
+				indexFound += skeleton.floatIndex.find(name.c_str()) != nullptr;
+			}
+		}
+	}
+
+	//(also keeps the loops from being optimised away)
+	if (mapFound != indexFound)
+		throw Exception(ERR_INVALID_INPUT, "Name index disagrees with map");
+}
+
+//Are a and b the same rotations with the same signs?
+static bool sameRotations(const hkArray<hkQsTransform>& a, const hkArray<hkQsTransform>& b)
+{
+	for (int i = 0; i < a.getSize(); i++) {
+		if (a[i].m_rotation.m_vec.dot4(b[i].m_rotation.m_vec) < 0.999f)
+			return false;
+	}
+	return true;
+}
+
+//Normalise and fix the signs of the rotations of the first clip, both as the
+//interleaved frames that pack makes and as the tracks that unpack makes.
+//Each is done with its kernel and as it was done before them: key by key,
+//and in separate passes.
+static void benchRotations(const AnimationData& data)
+{
+	const Clip& clip = data.clips.front();
+	int nBones = clip.nBoneTracks;
+	int frames = data.frames;
+	long long keys = static_cast<long long>(nBones) * frames;
+
+	//Give them something to do: every other key has the wrong sign and length
+	hkArray<hkQsTransform> src(nBones * frames);
+	for (int t = 0; t < nBones; t++) {
+		for (int f = 0; f < frames; f++) {
+			hkQsTransform& key = src[f * nBones + t];
+			key = clip.boneTracks[t].keys[f];
+			if (f % 2)
+				key.m_rotation.m_vec.mul4(-2.0f);
+		}
+	}
+
+	//Interleaved
+	hkArray<hkQsTransform> before(src.getSize());
+	std::copy(src.begin(), src.end(), before.begin());
+	{
+		ProfileScope stage("Frame rotations (two-pass)");
+		stage.keys(keys);
+		for (int t = 0; t < nBones; t++) {
+			for (int f = 1; f < frames; f++) {
+				hkVector4& q = before[f * nBones + t].m_rotation.m_vec;
+				if (q.dot4(before[(f - 1) * nBones + t].m_rotation.m_vec) < 0.0f)
+					q.setNeg4(q);
+			}
+		}
+		hkaSkeletonUtils::normalizeRotations(before.begin(), before.getSize());
+	}
+
+	hkArray<hkQsTransform> after(src.getSize());
+	std::copy(src.begin(), src.end(), after.begin());
+	{
+		ProfileScope stage("Frame rotations (kernel)");
+		stage.keys(keys);
+		for (int f = 0; f < frames; f++) {
+			normaliseFrameRotations(&after[f * nBones], nBones, f > 0 ? &after[(f - 1) * nBones] : nullptr);
+		}
+	}
+
+	if (!sameRotations(before, after))
+		throw Exception(ERR_INVALID_INPUT, "Frame rotation kernel disagrees with reference");
+
+	//Track by track
+	for (int t = 0; t < nBones; t++) {
+		for (int f = 0; f < frames; f++) {
+			before[t * frames + f] = src[f * nBones + t];
+		}
+	}
+	std::copy(before.begin(), before.end(), after.begin());
+	{
+		ProfileScope stage("Track rotations (per key)");
+		stage.keys(keys);
+		for (int t = 0; t < nBones; t++) {
+			hkQsTransform* track = &before[t * frames];
+			for (int f = 0; f < frames; f++) {
+				track[f].m_rotation.normalize();
+				if (f > 0 && track[f].m_rotation.m_vec.dot4(track[f - 1].m_rotation.m_vec) < 0.0f)
+					track[f].m_rotation.m_vec.setNeg4(track[f].m_rotation.m_vec);
+			}
+		}
+	}
+	{
+		ProfileScope stage("Track rotations (kernel)");
+		stage.keys(keys);
+		for (int t = 0; t < nBones; t++) {
+			normaliseTrackRotations(&after[t * frames], frames);
+		}
+	}
+
+	if (!sameRotations(before, after))
+		throw Exception(ERR_INVALID_INPUT, "Track rotation kernel disagrees with reference");
+}
+
+static long long median(std::vector<long long> v)
+{
+	assert(!v.empty());
+	std::sort(v.begin(), v.end());
+	return v[v.size() / 2];
+}
+
+void iohkx::runBenchmark(const BenchConfig& config, int runs, const char* version, std::ostream& out)
+{
+	if (runs < 1)
+		throw Exception(ERR_INVALID_ARGS, "Invalid number of runs");
+	if (Profiler::get())
+		throw Exception(ERR_INVALID_ARGS, "Can't profile a benchmark");
+
+	HavokEngine::setAllocator(config.allocator);
+	HavokEngine::countMemory(true);
+	HavokEngine engine;
+
+	SyntheticData synth(config);
+
+	std::string xmlFile = (std::filesystem::temp_directory_path() / "blender-hkx-bench.xml").string();
+
+	Profiler profiler;
+	std::vector<StageRuns> results;
+
+	for (int run = 0; run < runs; run++) {
+		//Everything except the synthetic data is rebuilt each run, so that
+		//allocations are counted the same every time
+		AnimationDecoder source;
+		synth.fill(source.get());
+
+		hkRefPtr<hkaAnimationContainer> anim;
+		runPhase(profiler, "pack", [&]() {
+			anim = source.compress();
+		}, results);
+
+		AnimationDecoder unpacked;
+		runPhase(profiler, "unpack", [&]() {
+			unpacked.decompress(anim.val(), synth.skeletons());
+		}, results);
+
+		runPhase(profiler, "xml-write", [&]() {
+			XMLInterface xml;
+			xml.write(unpacked.get(), xmlFile.c_str());
+		}, results);
+
+		runPhase(profiler, "xml-read", [&]() {
+			AnimationDecoder read;
+			XMLInterface xml;
+			xml.read(xmlFile.c_str(), synth.skeletons(), read.get());
+		}, results);
+
+		runPhase(profiler, "rotations", [&]() {
+			benchRotations(source.get());
+		}, results);
+
+		runPhase(profiler, "lookup", [&]() {
+			benchLookup(*synth.skeletons().front());
+		}, results);
+	}
+
+	std::remove(xmlFile.c_str());
+
+	auto writeConfig = [&]() {
+		out << "{\"version\":\"" << version << "\""
+			<< ",\"bones\":" << config.bones
+			<< ",\"depth\":" << config.depth
+			<< ",\"floats\":" << config.floats
+			<< ",\"frames\":" << config.frames
+			<< ",\"paired\":" << (config.paired ? "true" : "false")
+			<< ",\"additive\":" << (config.additive ? "true" : "false")
+			<< ",\"allocator\":\"" << (config.allocator == HAVOK_POOL ? "pool" : "malloc") << "\"";
+	};
+
+	for (auto&& r : results) {
+		writeConfig();
+		out << ",\"phase\":\"" << r.phase << "\""
+			<< ",\"stage\":\"" << r.stage << "\""
+			<< ",\"runs\":" << r.wall.size()
+			<< ",\"wall_us_min\":" << *std::min_element(r.wall.begin(), r.wall.end())
+			<< ",\"wall_us_median\":" << median(r.wall)
+			<< ",\"cpu_us_median\":" << median(r.cpu)
+			<< ",\"keys\":" << r.keys
+			<< ",\"allocs\":" << r.allocs
+			<< ",\"alloc_bytes\":" << r.allocBytes << "}\n";
+	}
+
+	//peak and reserved include the synthetic data, which is the same for both allocators
+	HavokMemoryStats memory = HavokEngine::memoryStats();
+	writeConfig();
+	out << ",\"phase\":\"havok-memory\""
+		<< ",\"runs\":" << runs
+		<< ",\"allocations\":" << memory.allocations
+		<< ",\"peak_bytes\":" << memory.peakInUse
+		<< ",\"reserved_bytes\":" << memory.reserved << "}\n";
+}
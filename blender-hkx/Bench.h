@@ -0,0 +1,69 @@
+#pragma once
+#include "common.h"
+#include "HavokEngine.h"
+#include "SkeletonLoader.h"
+
+namespace iohkx
+{
+	//Shape of a synthetic skeleton and animation
+	struct BenchConfig
+	{
+		int bones{ 100 };
+		//length of the longest chain of bones
+		int depth{ 8 };
+		int floats{ 4 };
+		int frames{ 300 };
+		bool paired{ false };
+		bool additive{ false };
+		//where Havok gets its memory from
+		HavokAllocator allocator{ HAVOK_MALLOC };
+	};
+
+	//Builds skeletons and animations that look enough like the real thing
+	//to exercise every stage of pack and unpack
+	class SyntheticData
+	{
+	public:
+		SyntheticData(const BenchConfig& config);
+
+		const std::vector<Skeleton*>& skeletons() const { return m_skeletons.get(); }
+
+		//Fill data with object-space keys, like the addon exports
+		void fill(AnimationData& data) const;
+
+	private:
+		void addSkeleton(const char* name);
+		void fillClip(Clip& clip, int actor) const;
+
+	private:
+		BenchConfig m_config;
+		SkeletonLoader m_skeletons;
+	};
+
+	//How timeSampling picks its samples
+	struct SampleConfig
+	{
+		int samples{ 1000 };
+		//At random times instead of spread evenly over the duration, in order
+		bool random{ false };
+		//Sample only the first this many transform and float tracks (all if negative)
+		int tracks{ -1 };
+		//Evict the data caches before each sample (the evicting isn't timed)
+		bool cold{ false };
+	};
+
+	//Average time to sample anim, in nanoseconds per pose
+	double timeSampling(const hkaAnimation* anim, const SampleConfig& config = SampleConfig());
+
+	//Time sampling every animation of anim in sequential and random order,
+	//with all tracks and the first partialTracks of them, with warm and cold caches.
+	//Writes one JSON object per line for each animation and measurement.
+	void runSampleBenchmark(const hkaAnimationContainer* anim, const char* name,
+		int samples, int partialTracks, std::ostream& out);
+
+	//Time the stages of pack, unpack and XML I/O on synthetic data, in an
+	//engine of its own using config.allocator.
+	//Writes one JSON object per line for each stage, and one for what Havok
+	//did with its memory over all runs.
+	void runBenchmark(const BenchConfig& config, int runs, const char* version, std::ostream& out);
+}
@@ -0,0 +1,251 @@
+#include "pch.h"
+#include "Conditioning.h"
+#include "AnimationDecoder.h"
+
+#include <xmmintrin.h>
+
+//Floats in a key: translation, rotation and scale, 4 each
+constexpr int FLOATS_PER_KEY = 12;
+//Times we try to bring a rotation within its cap before leaving the key as it was
+constexpr int CAP_ATTEMPTS = 4;
+//Capped keys are aimed this much inside the cap, so that rounding doesn't take them past it
+constexpr float CAP_MARGIN = 0.999f;
+//Share of the tolerance smoothing may use if no cap is given (the encoder gets the rest)
+constexpr float DEFAULT_CAP_SHARE = 0.5f;
+
+static_assert(sizeof(hkQsTransform) == FLOATS_PER_KEY * sizeof(float), "Unexpected hkQsTransform layout");
+
+using namespace iohkx;
+
+//Gaussian weights of the keys within radius, with the outermost at 2 standard deviations
+static std::vector<float> lowpassWeights(int radius)
+{
+	double sigma = radius / 2.0;
+
+	std::vector<float> weights(2 * radius + 1);
+	double sum = 0.0;
+	for (int k = -radius; k <= radius; k++)
+		sum += std::exp(-k * k / (2.0 * sigma * sigma));
+	for (int k = -radius; k <= radius; k++)
+		weights[k + radius] = static_cast<float>(std::exp(-k * k / (2.0 * sigma * sigma)) / sum);
+	return weights;
+}
+
+//Weights that give the value at 0 of the least-squares polynomial of degree
+//through the keys within radius
+static std::vector<float> savitzkyGolayWeights(int radius, int degree)
+{
+	if (degree < 0 || degree >= 2 * radius)
+		throw Exception(ERR_INVALID_ARGS, "Filter degree must be less than twice the radius");
+
+	//Solve the normal equations of the fit, (A^T A) c = e0 with A[k][j] = k^j
+	int m = degree + 1;
+	std::vector<double> ata(m * m, 0.0);
+	for (int k = -radius; k <= radius; k++) {
+		for (int i = 0; i < m; i++) {
+			for (int j = 0; j < m; j++)
+				ata[i * m + j] += std::pow(static_cast<double>(k), i + j);
+		}
+	}
+	std::vector<double> c(m, 0.0);
+	c[0] = 1.0;
+
+	for (int col = 0; col < m; col++) {
+		int pivot = col;
+		for (int row = col + 1; row < m; row++) {
+			if (std::abs(ata[row * m + col]) > std::abs(ata[pivot * m + col]))
+				pivot = row;
+		}
+		for (int j = 0; j < m; j++)
+			std::swap(ata[col * m + j], ata[pivot * m + j]);
+		std::swap(c[col], c[pivot]);
+
+		for (int row = 0; row < m; row++) {
+			if (row == col)
+				continue;
+			double factor = ata[row * m + col] / ata[col * m + col];
+			for (int j = col; j < m; j++)
+				ata[row * m + j] -= factor * ata[col * m + j];
+			c[row] -= factor * c[col];
+		}
+	}
+	for (int i = 0; i < m; i++)
+		c[i] /= ata[i * m + i];
+
+	std::vector<float> weights(2 * radius + 1);
+	for (int k = -radius; k <= radius; k++) {
+		double w = 0.0;
+		for (int j = 0; j < m; j++)
+			w += c[j] * std::pow(static_cast<double>(k), j);
+		weights[k + radius] = static_cast<float>(w);
+	}
+	return weights;
+}
+
+//out += w * in, for n floats
+static void addScaled(float* out, const float* in, float w, int n)
+{
+	__m128 vw = _mm_set1_ps(w);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(vw, _mm_loadu_ps(in + i))));
+	for (; i < n; i++)
+		out[i] += w * in[i];
+}
+
+//Convolve the columns of frames rows of width floats with weights (centred).
+//Past the ends, the rows are reflected through the end row, so that keys
+//that move in a straight line near the ends stay on it.
+static void filterRows(const float* in, float* out, int frames, int width, const std::vector<float>& weights)
+{
+	int radius = static_cast<int>(weights.size()) / 2;
+
+	for (int f = 0; f < frames; f++) {
+		float* row = out + static_cast<size_t>(f) * width;
+		std::fill(row, row + width, 0.0f);
+
+		for (int k = -radius; k <= radius; k++) {
+			float w = weights[k + radius];
+			int g = f + k;
+			if (g >= 0 && g < frames)
+				addScaled(row, in + static_cast<size_t>(g) * width, w, width);
+			else {
+				int edge = g < 0 ? 0 : frames - 1;
+				int mirror = std::clamp(2 * edge - g, 0, frames - 1);
+				addScaled(row, in + static_cast<size_t>(edge) * width, 2.0f * w, width);
+				addScaled(row, in + static_cast<size_t>(mirror) * width, -w, width);
+			}
+		}
+	}
+}
+
+static float capOf(float cap, float tolerance)
+{
+	return cap >= 0.0f ? std::min(cap, tolerance) : tolerance * DEFAULT_CAP_SHARE;
+}
+
+static float distance(const float* a, const float* b, int n)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++)
+		sum += (b[i] - a[i]) * (b[i] - a[i]);
+	return std::sqrt(sum);
+}
+
+//Move b back towards a until they are at most cap apart
+static void capVector(const float* a, float* b, int n, float cap)
+{
+	float d = distance(a, b, n);
+	if (d > cap) {
+		float t = cap / d * CAP_MARGIN;
+		for (int i = 0; i < n; i++)
+			b[i] = a[i] + (b[i] - a[i]) * t;
+		if (distance(a, b, n) > cap)
+			std::copy(a, a + n, b);
+	}
+}
+
+static bool normalise(float* q)
+{
+	float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+	if (length < 1e-6f)
+		return false;
+	for (int i = 0; i < 4; i++)
+		q[i] /= length;
+	return true;
+}
+
+//Normalise rotation b (in the hemisphere of a) and move it back towards a until
+//they are at most cap apart
+static void capRotation(const float* a, float* b, float cap)
+{
+	if (!normalise(b)) {
+		std::copy(a, a + 4, b);
+		return;
+	}
+	if (a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3] < 0.0f) {
+		for (int i = 0; i < 4; i++)
+			b[i] = -b[i];
+	}
+
+	//Normalising pushes the blend a little further out, so we may need a few tries
+	float target[4]{ b[0], b[1], b[2], b[3] };
+	float t = 1.0f;
+	for (int attempt = 0; attempt < CAP_ATTEMPTS; attempt++) {
+		float d = distance(a, b, 4);
+		if (d <= cap)
+			return;
+
+		t *= cap / d * CAP_MARGIN;
+		for (int i = 0; i < 4; i++)
+			b[i] = a[i] + (target[i] - a[i]) * t;
+		if (!normalise(b))
+			break;
+	}
+	if (distance(a, b, 4) > cap)
+		std::copy(a, a + 4, b);
+}
+
+void iohkx::conditionKeys(hkaInterleavedUncompressedAnimation* raw, const CompressionSettings& settings)
+{
+	assert(raw);
+
+	if (settings.filter == FILTER_NONE)
+		return;
+	if (settings.filterRadius < 1)
+		throw Exception(ERR_INVALID_ARGS, "Invalid filter radius");
+
+	std::vector<float> weights = settings.filter == FILTER_LOWPASS ? lowpassWeights(settings.filterRadius) :
+		savitzkyGolayWeights(settings.filterRadius, settings.filterDegree);
+
+	int nTransforms = raw->m_numberOfTransformTracks;
+	int nFloats = raw->m_numberOfFloatTracks;
+	int frames = nTransforms > 0 ? raw->m_transforms.getSize() / nTransforms : raw->m_floats.getSize() / std::max(nFloats, 1);
+	if (frames < 3)
+		//Nothing to smooth
+		return;
+
+	if (nTransforms > 0) {
+		float translationCap = capOf(settings.translationCap, settings.translationTolerance);
+		float rotationCap = capOf(settings.rotationCap, settings.rotationTolerance);
+		float scaleCap = capOf(settings.scaleCap, settings.scaleTolerance);
+
+		int width = nTransforms * FLOATS_PER_KEY;
+		float* keys = reinterpret_cast<float*>(raw->m_transforms.begin());
+		std::vector<float> original(keys, keys + static_cast<size_t>(frames) * width);
+		filterRows(original.data(), keys, frames, width, weights);
+
+		for (size_t i = 0; i < original.size(); i += FLOATS_PER_KEY) {
+			const float* a = &original[i];
+			float* b = keys + i;
+			capVector(a, b, 3, translationCap);
+			b[3] = a[3];
+			capRotation(a + 4, b + 4, rotationCap);
+			capVector(a + 8, b + 8, 3, scaleCap);
+			b[11] = a[11];
+		}
+	}
+
+	if (nFloats > 0) {
+		float floatCap = capOf(settings.floatCap, settings.floatTolerance);
+
+		float* values = raw->m_floats.begin();
+		std::vector<float> original(values, values + static_cast<size_t>(frames) * nFloats);
+		filterRows(original.data(), values, frames, nFloats, weights);
+
+		for (size_t i = 0; i < original.size(); i++)
+			capVector(&original[i], values + i, 1, floatCap);
+	}
+}
+
+CompressionSettings iohkx::encoderSettings(const CompressionSettings& settings)
+{
+	CompressionSettings result = settings;
+	if (settings.filter != FILTER_NONE) {
+		result.translationTolerance -= capOf(settings.translationCap, settings.translationTolerance);
+		result.rotationTolerance -= capOf(settings.rotationCap, settings.rotationTolerance);
+		result.scaleTolerance -= capOf(settings.scaleCap, settings.scaleTolerance);
+		result.floatTolerance -= capOf(settings.floatCap, settings.floatTolerance);
+	}
+	return result;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	struct CompressionSettings;
+
+	//Smooth the keys of raw as settings.filter says, before they are encoded. The
+	//keys are expected in parent space, with normalised rotations that turn the
+	//short way from one frame to the next. Every channel of every track is smoothed
+	//at once, a frame at a time, with SSE. No key moves further than its cap (half
+	//its tolerance if not given), with rotations measured as the distance between
+	//the quaternions (as the tolerance).
+	void conditionKeys(hkaInterleavedUncompressedAnimation* raw, const CompressionSettings& settings);
+
+	//settings, with each tolerance less the cap smoothing takes out of it
+	CompressionSettings encoderSettings(const CompressionSettings& settings);
+}
@@ -0,0 +1,77 @@
+#include "pch.h"
+#include "ContentHash.h"
+
+#define NOMINMAX
+#include <Windows.h>
+#include <bcrypt.h>
+
+constexpr int DIGEST_SIZE = 32;
+
+iohkx::ContentHash::ContentHash()
+{
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&m_alg, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+		throw Exception(ERR_INVALID_INPUT, "Failed to initialise hash");
+	if (!BCRYPT_SUCCESS(BCryptCreateHash(m_alg, &m_hash, nullptr, 0, nullptr, 0, 0))) {
+		BCryptCloseAlgorithmProvider(m_alg, 0);
+		throw Exception(ERR_INVALID_INPUT, "Failed to initialise hash");
+	}
+}
+
+iohkx::ContentHash::~ContentHash()
+{
+	if (m_hash)
+		BCryptDestroyHash(m_hash);
+	BCryptCloseAlgorithmProvider(m_alg, 0);
+}
+
+void iohkx::ContentHash::add(const void* data, size_t size)
+{
+	assert(m_hash);
+	//(doesn't modify data, despite the signature)
+	if (!BCRYPT_SUCCESS(BCryptHashData(m_hash,
+		static_cast<UCHAR*>(const_cast<void*>(data)), static_cast<ULONG>(size), 0)))
+		throw Exception(ERR_INVALID_INPUT, "Hash failed");
+}
+
+void iohkx::ContentHash::add(const std::string& str)
+{
+	unsigned long long size = str.size();
+	add(&size, sizeof(size));
+	add(str.data(), str.size());
+}
+
+void iohkx::ContentHash::addFile(const char* fileName)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	if (!file)
+		throw Exception(ERR_READ_FAIL, "Failed to open input file");
+
+	std::vector<char> buf(1 << 16);
+	while (file) {
+		file.read(buf.data(), buf.size());
+		if (file.gcount() > 0)
+			add(buf.data(), static_cast<size_t>(file.gcount()));
+	}
+	if (file.bad())
+		throw Exception(ERR_READ_FAIL, "Failed to read input file");
+}
+
+std::string iohkx::ContentHash::hex()
+{
+	assert(m_hash);
+
+	UCHAR digest[DIGEST_SIZE];
+	NTSTATUS status = BCryptFinishHash(m_hash, digest, DIGEST_SIZE, 0);
+	BCryptDestroyHash(m_hash);
+	m_hash = nullptr;
+	if (!BCRYPT_SUCCESS(status))
+		throw Exception(ERR_INVALID_INPUT, "Hash failed");
+
+	constexpr const char* DIGITS = "0123456789abcdef";
+	std::string result;
+	for (UCHAR c : digest) {
+		result.push_back(DIGITS[c >> 4]);
+		result.push_back(DIGITS[c & 0xf]);
+	}
+	return result;
+}
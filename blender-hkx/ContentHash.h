@@ -0,0 +1,29 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//SHA-256 of any number of files and strings, for identifying inputs by content
+	class ContentHash
+	{
+	public:
+		ContentHash();
+		~ContentHash();
+
+		ContentHash(const ContentHash&) = delete;
+		ContentHash& operator=(const ContentHash&) = delete;
+
+		void add(const void* data, size_t size);
+		//Adds the length too, so that consecutive strings can't run together
+		void add(const std::string& str);
+		//Adds the contents of a file, throws if it can't be read
+		void addFile(const char* fileName);
+
+		//Lower-case hex digest. No more data can be added after this.
+		std::string hex();
+
+	private:
+		void* m_alg{ nullptr };
+		void* m_hash{ nullptr };
+	};
+}
@@ -0,0 +1,117 @@
+#include "pch.h"
+#include "ConversionCache.h"
+#include "Profiler.h"
+
+constexpr const char* ENTRY_EXT = ".hkx";
+
+namespace fs = std::filesystem;
+
+iohkx::ConversionCache::ConversionCache(const char* dir, long long maxBytes) :
+	m_dir(dir), m_maxBytes(maxBytes)
+{
+	assert(dir);
+
+	std::error_code err;
+	fs::create_directories(m_dir, err);
+	if (err || !fs::is_directory(m_dir))
+		throw Exception(ERR_WRITE_FAIL, "Failed to create cache directory");
+}
+
+bool iohkx::ConversionCache::fetch(const std::string& key, const char* fileName)
+{
+	ProfileScope stage("Cache lookup");
+
+	fs::path path = entry(key);
+	std::error_code err;
+	if (!fs::is_regular_file(path, err))
+		return false;
+
+	//(CopyFile clones the blocks on file systems that support it)
+	if (!fs::copy_file(path, fileName, fs::copy_options::overwrite_existing, err))
+		return false;
+	stage.bytesOut(Profiler::fileSize(fileName));
+
+	//Mark as recently used
+	fs::last_write_time(path, fs::file_time_type::clock::now(), err);
+
+	m_hit = true;
+	evict();
+	return true;
+}
+
+void iohkx::ConversionCache::store(const std::string& key, const char* fileName)
+{
+	ProfileScope stage("Cache store");
+
+	//Copy to a temp name first, so that a concurrent fetch never sees half a file
+	fs::path path = entry(key);
+	fs::path tmp = path;
+	tmp += ".tmp";
+
+	std::error_code err;
+	if (fs::copy_file(fileName, tmp, fs::copy_options::overwrite_existing, err))
+		fs::rename(tmp, path, err);
+	if (err) {
+		fs::remove(tmp, err);
+		//A failed store only costs us the next build
+		std::cerr << "Failed to add to cache\n";
+	}
+	else
+		stage.bytesOut(Profiler::fileSize(path.string().c_str()));
+
+	evict();
+}
+
+void iohkx::ConversionCache::printStats(std::ostream& out) const
+{
+	out << "Cache " << (m_hit ? "hit" : "miss")
+		<< ": " << m_entries << " entries, "
+		<< (m_bytes + 512 * 1024) / (1024 * 1024) << " of " << m_maxBytes / (1024 * 1024) << " MB, "
+		<< m_evicted << " evicted\n";
+}
+
+fs::path iohkx::ConversionCache::entry(const std::string& key) const
+{
+	return m_dir / (key + ENTRY_EXT);
+}
+
+void iohkx::ConversionCache::evict()
+{
+	struct Entry
+	{
+		fs::path path;
+		fs::file_time_type time;
+		long long size;
+	};
+
+	std::vector<Entry> entries;
+	m_bytes = 0;
+
+	std::error_code err;
+	for (auto&& item : fs::directory_iterator(m_dir, err)) {
+		if (item.path().extension() != ENTRY_EXT || !item.is_regular_file(err))
+			continue;
+		Entry e{ item.path(), item.last_write_time(err), static_cast<long long>(item.file_size(err)) };
+		if (!err) {
+			m_bytes += e.size;
+			entries.push_back(std::move(e));
+		}
+	}
+
+	m_entries = static_cast<int>(entries.size());
+
+	if (m_bytes > m_maxBytes) {
+		//oldest first
+		std::sort(entries.begin(), entries.end(),
+			[](const Entry& lhs, const Entry& rhs) { return lhs.time < rhs.time; });
+
+		//never evict the newest entry, even if it's too big on its own
+		for (size_t i = 0; i + 1 < entries.size() && m_bytes > m_maxBytes; i++) {
+			if (fs::remove(entries[i].path, err)) {
+				m_bytes -= entries[i].size;
+				m_entries--;
+				m_evicted++;
+			}
+		}
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Directory of previous outputs, named by the hash of everything that went
+	//into them. Entries are evicted least recently used first once the
+	//directory grows past its size limit.
+	class ConversionCache
+	{
+	public:
+		ConversionCache(const char* dir, long long maxBytes);
+
+		//If we have an entry for key, copy it to fileName and return true
+		bool fetch(const std::string& key, const char* fileName);
+		//Add fileName as the entry for key, then evict down to our size limit
+		void store(const std::string& key, const char* fileName);
+
+		//One line: hit or miss, entries, size and evictions
+		void printStats(std::ostream& out) const;
+
+	private:
+		std::filesystem::path entry(const std::string& key) const;
+		void evict();
+
+	private:
+		std::filesystem::path m_dir;
+		long long m_maxBytes;
+
+		bool m_hit{ false };
+		int m_entries{ 0 };
+		long long m_bytes{ 0 };
+		int m_evicted{ 0 };
+	};
+}
@@ -0,0 +1,361 @@
+#include "pch.h"
+#include "CurveBaker.h"
+#include "Profiler.h"
+
+#include <emmintrin.h>
+
+using namespace iohkx;
+
+//Default value of each transform channel
+constexpr float TRANSFORM_DEFAULTS[]{ 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+constexpr int TRANSFORM_CHANNELS = 10;
+
+//A bezier segment as polynomials in t, x(t) = ((ax * t + bx) * t + cx) * t + x0
+struct BezierSegment
+{
+	float x0, ax, bx, cx;
+	float y0, ay, by, cy;
+
+	BezierSegment(const CurveKey& k0, const CurveKey& k1)
+	{
+		//Move the handles in so that x(t) is monotonic (what Blender does)
+		float h1[2]{ k0.frame - k0.right[0], k0.value - k0.right[1] };
+		float h2[2]{ k1.frame - k1.left[0], k1.value - k1.left[1] };
+		float len = k1.frame - k0.frame;
+		float len1 = std::abs(h1[0]);
+		float len2 = std::abs(h2[0]);
+		float fac = len1 + len2 > len && len1 + len2 > 0.0f ? len / (len1 + len2) : 1.0f;
+
+		float p0[2]{ k0.frame, k0.value };
+		float p1[2]{ k0.frame - fac * h1[0], k0.value - fac * h1[1] };
+		float p2[2]{ k1.frame - fac * h2[0], k1.value - fac * h2[1] };
+		float p3[2]{ k1.frame, k1.value };
+
+		x0 = p0[0];
+		cx = 3.0f * (p1[0] - p0[0]);
+		bx = 3.0f * (p2[0] - 2.0f * p1[0] + p0[0]);
+		ax = p3[0] - p0[0] - cx - bx;
+
+		y0 = p0[1];
+		cy = 3.0f * (p1[1] - p0[1]);
+		by = 3.0f * (p2[1] - 2.0f * p1[1] + p0[1]);
+		ay = p3[1] - p0[1] - cy - by;
+	}
+
+	float eval(float x) const
+	{
+		//Solve x(t) = x by Newton's method, falling back to bisection
+		float span = ax + bx + cx;
+		float t = span > 0.0f ? (x - x0) / span : 0.0f;
+		float lo = 0.0f;
+		float hi = 1.0f;
+		for (int i = 0; i < 16; i++) {
+			float err = ((ax * t + bx) * t + cx) * t + x0 - x;
+			if (std::abs(err) < 1e-5f)
+				break;
+			if (err > 0.0f)
+				hi = t;
+			else
+				lo = t;
+			float dx = (3.0f * ax * t + 2.0f * bx) * t + cx;
+			float next = dx != 0.0f ? t - err / dx : -1.0f;
+			t = next > lo && next < hi ? next : 0.5f * (lo + hi);
+		}
+		return ((ay * t + by) * t + cy) * t + y0;
+	}
+
+	//eval of 4 frames at once. Each lane takes the same steps as eval would,
+	//and stops where eval would.
+	__m128 eval4(__m128 x) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		const __m128 eps = _mm_set1_ps(1e-5f);
+		const __m128 vx0 = _mm_set1_ps(x0);
+		const __m128 vax = _mm_set1_ps(ax);
+		const __m128 vbx = _mm_set1_ps(bx);
+		const __m128 vcx = _mm_set1_ps(cx);
+		const __m128 vax3 = _mm_set1_ps(3.0f * ax);
+		const __m128 vbx2 = _mm_set1_ps(2.0f * bx);
+
+		float span = ax + bx + cx;
+		__m128 t = span > 0.0f ? _mm_div_ps(_mm_sub_ps(x, vx0), _mm_set1_ps(span)) : zero;
+		__m128 lo = zero;
+		__m128 hi = _mm_set1_ps(1.0f);
+		//lanes that have converged
+		__m128 done = zero;
+
+		for (int i = 0; i < 16; i++) {
+			__m128 err = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(
+				_mm_add_ps(_mm_mul_ps(vax, t), vbx), t), vcx), t), vx0), x);
+			done = _mm_or_ps(done, _mm_cmplt_ps(_mm_and_ps(err, absMask), eps));
+			if (_mm_movemask_ps(done) == 0xf)
+				break;
+
+			__m128 over = _mm_cmpgt_ps(err, zero);
+			hi = _mm_or_ps(_mm_and_ps(over, t), _mm_andnot_ps(over, hi));
+			lo = _mm_or_ps(_mm_andnot_ps(over, t), _mm_and_ps(over, lo));
+
+			__m128 dx = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vax3, t), vbx2), t), vcx);
+			__m128 next = _mm_sub_ps(t, _mm_div_ps(err, dx));
+			//(NaN if dx is 0, which fails both)
+			__m128 ok = _mm_and_ps(_mm_cmpgt_ps(next, lo), _mm_cmplt_ps(next, hi));
+			ok = _mm_and_ps(ok, _mm_cmpneq_ps(dx, zero));
+			__m128 bisect = _mm_mul_ps(half, _mm_add_ps(lo, hi));
+			__m128 step = _mm_or_ps(_mm_and_ps(ok, next), _mm_andnot_ps(ok, bisect));
+
+			t = _mm_or_ps(_mm_and_ps(done, t), _mm_andnot_ps(done, step));
+		}
+
+		return _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(
+			_mm_set1_ps(ay), t), _mm_set1_ps(by)), t), _mm_set1_ps(cy)), t), _mm_set1_ps(y0));
+	}
+};
+
+//Frames start + i * step of samples i, i + 1, i + 2 and i + 3
+static __m128 frames4(float start, float step, int i)
+{
+	__m128 index = _mm_add_ps(_mm_set1_ps(static_cast<float>(i)), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+	return _mm_add_ps(_mm_set1_ps(start), _mm_mul_ps(index, _mm_set1_ps(step)));
+}
+
+//First sample from i on (and before count) whose frame is not before frame
+static int firstSampleAt(float frame, float start, float step, int i, int count)
+{
+	while (i < count && start + i * step < frame)
+		i++;
+	return i;
+}
+
+void iohkx::bakeCurve(const Curve& curve, float def, float start, float step, int count, float* dst)
+{
+	assert(step > 0.0f && dst);
+
+	if (curve.empty()) {
+		std::fill(dst, dst + count, def);
+		return;
+	}
+
+	//Samples come in order, so we only need to pass over the segments once
+	int i = 0;
+	float x = start;
+	for (; i < count && x <= curve.front().frame; x = start + ++i * step)
+		dst[i] = curve.front().value;
+
+	for (size_t k = 0; k + 1 < curve.size() && i < count; k++) {
+		const CurveKey& k0 = curve[k];
+		const CurveKey& k1 = curve[k + 1];
+		if (x >= k1.frame)
+			continue;
+
+		//Samples [i, end) are in this segment. Fill them 4 at a time with SSE.
+		int end = firstSampleAt(k1.frame, start, step, i, count);
+
+		switch (k0.interp) {
+		case INTERP_CONSTANT:
+			std::fill(dst + i, dst + end, k0.value);
+			break;
+		case INTERP_LINEAR:
+		{
+			float slope = (k1.value - k0.value) / (k1.frame - k0.frame);
+			__m128 v0 = _mm_set1_ps(k0.value);
+			__m128 f0 = _mm_set1_ps(k0.frame);
+			__m128 vslope = _mm_set1_ps(slope);
+			for (; i + 4 <= end; i += 4)
+				_mm_storeu_ps(dst + i, _mm_add_ps(v0, _mm_mul_ps(vslope, _mm_sub_ps(frames4(start, step, i), f0))));
+			for (; i < end; i++)
+				dst[i] = k0.value + slope * (start + i * step - k0.frame);
+			break;
+		}
+		default:
+		{
+			if (k0.value == k1.value && k0.right[1] == k0.value && k1.left[1] == k1.value) {
+				//flat
+				std::fill(dst + i, dst + end, k0.value);
+			}
+			else {
+				BezierSegment segment(k0, k1);
+				for (; i + 4 <= end; i += 4)
+					_mm_storeu_ps(dst + i, segment.eval4(frames4(start, step, i)));
+				for (; i < end; i++)
+					dst[i] = segment.eval(start + i * step);
+			}
+			break;
+		}
+		}
+		i = end;
+		x = start + i * step;
+	}
+
+	for (; i < count; i++)
+		dst[i] = curve.back().value;
+}
+
+void iohkx::CurveBaker::add(BoneTrack* track, std::vector<Curve>&& channels)
+{
+	assert(track && channels.size() == TRANSFORM_CHANNELS);
+	m_bones.push_back({ track, std::move(channels) });
+}
+
+void iohkx::CurveBaker::add(BoneTrack* track, std::vector<Curve>&& channels,
+	const hkQsTransform& rest, BoneTrack* parent)
+{
+	assert(track && channels.size() == TRANSFORM_CHANNELS);
+	m_bones.push_back({ track, std::move(channels), true, rest, parent });
+}
+
+void iohkx::CurveBaker::add(FloatTrack* track, Curve&& curve)
+{
+	assert(track);
+	m_floats.push_back({ track, std::move(curve) });
+}
+
+void iohkx::CurveBaker::bake(AnimationData& data, float start, float step)
+{
+	if (step <= 0.0f)
+		throw Exception(ERR_INVALID_ARGS, "Invalid frame step");
+
+	ProfileScope stage("Bake curves");
+	stage.keys(static_cast<long long>(m_bones.size() + m_floats.size()) * data.frames);
+
+	for (auto&& clip : data.clips) {
+		bool boneSpace = clip.refFrame == REF_BONE;
+		int tracks = 0;
+		int rests = 0;
+		for (auto&& item : m_bones) {
+			if (item.track == clip.rootTransform
+				|| (item.track >= clip.boneTracks && item.track < clip.boneTracks + clip.nBoneTracks)) {
+				bakeTrack(item.track, item.channels, boneSpace, data.frames, start, step);
+				tracks++;
+				rests += item.hasRest;
+			}
+		}
+		if (boneSpace) {
+			//Rest poses of the armature, if it gave them, else those of the skeleton
+			if (rests == 0)
+				toObject(clip, data.frames);
+			else if (rests == tracks)
+				restToObject(clip, data.frames);
+			else
+				throw Exception(ERR_INVALID_INPUT, "Either all or none of the tracks must have a rest pose");
+			clip.refFrame = REF_OBJECT;
+		}
+	}
+
+	for (auto&& item : m_floats) {
+		//(a slot without keys rests at its reference value)
+		float def = item.first->target ? item.first->target->refValue : 0.0f;
+		item.first->keys.setSize(data.frames);
+		bakeCurve(item.second, def, start, step, data.frames, item.first->keys.begin());
+	}
+}
+
+void iohkx::CurveBaker::bakeTrack(BoneTrack* track, const std::vector<Curve>& channels,
+	bool boneSpace, int frames, float start, float step)
+{
+	//Bake each channel in turn, then assemble the transforms
+	std::vector<float> baked(TRANSFORM_CHANNELS * frames);
+	for (int c = 0; c < TRANSFORM_CHANNELS; c++)
+		bakeCurve(channels[c], TRANSFORM_DEFAULTS[c], start, step, frames, &baked[c * frames]);
+
+	const float* loc[3]{ &baked[0], &baked[frames], &baked[2 * frames] };
+	const float* rot[4]{ &baked[3 * frames], &baked[4 * frames], &baked[5 * frames], &baked[6 * frames] };
+	const float* scl[3]{ &baked[7 * frames], &baked[8 * frames], &baked[9 * frames] };
+
+	const hkQuaternion& q = m_options.rotation;
+	hkQuaternion qInv;
+	qInv.setInverse(q);
+
+	track->keys.setSize(frames);
+	for (int f = 0; f < frames; f++) {
+		hkQsTransform& key = track->keys[f];
+		key.m_translation.set(loc[0][f], loc[1][f], loc[2][f]);
+		key.m_rotation.m_vec.set(rot[1][f], rot[2][f], rot[3][f], rot[0][f]);
+		key.m_scale.set(scl[0][f], scl[1][f], scl[2][f]);
+
+		//Blender normalises when it evaluates the pose, and so must we
+		if (key.m_rotation.m_vec.length4() > 0.0f)
+			key.m_rotation.normalize();
+		else
+			key.m_rotation.setIdentity();
+
+		if (boneSpace) {
+			//same as framerot * key * framerot^-1
+			key.m_translation.setRotatedDir(q, key.m_translation);
+			key.m_translation.mul4(m_options.lengthScale);
+
+			key.m_rotation.setMul(q, key.m_rotation);
+			key.m_rotation.setMul(key.m_rotation, qInv);
+
+			//(axes are permuted, so scale stays positive)
+			key.m_scale.setRotatedDir(q, key.m_scale);
+			key.m_scale.setAbs4(key.m_scale);
+		}
+	}
+}
+
+//Replace the bone-space keys of bone and its descendants by object-space keys.
+//T is the object-space pose of the parent.
+static void boneToObject(const Bone* bone, Clip& clip, int f, const hkQsTransform& T)
+{
+	BoneTrack* track = bone->index >= 0 ? clip.boneMap[bone->index] : clip.rootTransform;
+
+	hkQsTransform next_T;
+	next_T.setMul(T, bone->refPose);
+	if (track && !track->keys.isEmpty()) {
+		hkQsTransform key = track->keys[f];
+		track->keys[f].setMul(next_T, key);
+		next_T = track->keys[f];
+	}
+
+	for (auto&& child : bone->children) {
+		boneToObject(child, clip, f, next_T);
+	}
+}
+
+void iohkx::CurveBaker::toObject(Clip& clip, int frames)
+{
+	assert(clip.skeleton && clip.skeleton->rootBone);
+
+	hkQsTransform I(hkQsTransform::IDENTITY);
+	for (int f = 0; f < frames; f++) {
+		boneToObject(clip.skeleton->rootBone, clip, f, I);
+	}
+}
+
+void iohkx::CurveBaker::restToObject(const Clip& clip, int frames)
+{
+	//Parents first, then their children on top of them
+	std::set<const BoneTrack*> done;
+	std::function<void(const BoneCurves&)> convert = [&](const BoneCurves& item) {
+		if (!done.insert(item.track).second)
+			return;
+
+		hkArray<hkQsTransform>& keys = item.track->keys;
+		const hkArray<hkQsTransform>* parent = nullptr;
+		if (item.parent) {
+			auto it = std::find_if(m_bones.begin(), m_bones.end(),
+				[&](const BoneCurves& other) { return other.track == item.parent; });
+			if (it == m_bones.end())
+				throw Exception(ERR_INVALID_INPUT, "Rest pose relative to a track without keys");
+			convert(*it);
+			parent = &item.parent->keys;
+		}
+
+		for (int f = 0; f < frames; f++) {
+			hkQsTransform local;
+			local.setMul(item.rest, keys[f]);
+			if (parent)
+				keys[f].setMul((*parent)[f], local);
+			else
+				keys[f] = local;
+		}
+	};
+
+	for (auto&& item : m_bones) {
+		if (item.track == clip.rootTransform
+			|| (item.track >= clip.boneTracks && item.track < clip.boneTracks + clip.nBoneTracks))
+			convert(item);
+	}
+}
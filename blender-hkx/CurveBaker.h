@@ -0,0 +1,79 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Same values as Blender's keyframe interpolation enum
+	enum Interpolation
+	{
+		INTERP_CONSTANT,
+		INTERP_LINEAR,
+		INTERP_BEZIER,
+	};
+
+	//A keyframe of an fcurve, with the handles of the segments on either side
+	struct CurveKey
+	{
+		float frame{ 0.0f };
+		float value{ 0.0f };
+		//interpolation towards the next key
+		Interpolation interp{ INTERP_BEZIER };
+		float left[2]{};
+		float right[2]{};
+	};
+
+	//Keys of one channel, in order of frame. Extrapolation is constant.
+	using Curve = std::vector<CurveKey>;
+
+	//Evaluate curve at frames start + i * step for i < count.
+	//An empty curve evaluates to def.
+	void bakeCurve(const Curve& curve, float def, float start, float step, int count, float* dst);
+
+	//Turns sparse keys into the dense keys that compress() expects
+	class CurveBaker
+	{
+	public:
+		//Channels are location xyz, rotation wxyz and scale xyz, in the
+		//reference frame of the track's clip
+		void add(BoneTrack* track, std::vector<Curve>&& channels);
+		//A bone-space track that is moved to object space by the rest pose of the
+		//armature rather than that of the skeleton. rest is the bone's rest pose
+		//relative to that of parent (the track of its nearest animated ancestor in
+		//the armature, nullptr if none), converted like the keys.
+		void add(BoneTrack* track, std::vector<Curve>&& channels, const hkQsTransform& rest, BoneTrack* parent);
+		void add(FloatTrack* track, Curve&& curve);
+
+		//Sample all tracks at frames start + i * step for each frame of data.
+		//Tracks of clips in bone space are moved to object space.
+		void bake(AnimationData& data, float start, float step);
+
+	public:
+		struct
+		{
+			//Bone-space keys are rotated by this (q * key * q^-1)...
+			hkQuaternion rotation{ 0.0f, 0.0f, 0.0f, 1.0f };
+			//...and their translation scaled by this
+			float lengthScale{ 1.0f };
+		} m_options;
+
+	private:
+		struct BoneCurves
+		{
+			BoneTrack* track;
+			std::vector<Curve> channels;
+			//(only if given by the armature)
+			bool hasRest{ false };
+			hkQsTransform rest;
+			BoneTrack* parent{ nullptr };
+		};
+
+		void bakeTrack(BoneTrack* track, const std::vector<Curve>& channels,
+			bool boneSpace, int frames, float start, float step);
+		void toObject(Clip& clip, int frames);
+		void restToObject(const Clip& clip, int frames);
+
+	private:
+		std::vector<BoneCurves> m_bones;
+		std::vector<std::pair<FloatTrack*, Curve>> m_floats;
+	};
+}
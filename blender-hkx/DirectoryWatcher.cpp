@@ -0,0 +1,113 @@
+#include "pch.h"
+#include "DirectoryWatcher.h"
+
+#define NOMINMAX
+#include <Windows.h>
+
+constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+using namespace iohkx;
+
+iohkx::DirectoryWatcher::DirectoryWatcher(const char* dirName) :
+	m_dir(std::filesystem::absolute(dirName)), m_buffer(BUFFER_SIZE / sizeof(unsigned long))
+{
+	assert(dirName);
+
+	HANDLE dir = CreateFileW(m_dir.wstring().c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+	if (dir == INVALID_HANDLE_VALUE)
+		throw Exception(ERR_READ_FAIL, "Failed to open directory");
+	m_handle = dir;
+
+	m_event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+	if (!m_event) {
+		CloseHandle(m_handle);
+		throw Exception(ERR_READ_FAIL, "Failed to watch directory");
+	}
+
+	OVERLAPPED* overlapped = new OVERLAPPED{};
+	overlapped->hEvent = m_event;
+	m_overlapped = overlapped;
+
+	try {
+		listen();
+	}
+	catch (...) {
+		delete overlapped;
+		CloseHandle(m_event);
+		CloseHandle(m_handle);
+		throw;
+	}
+}
+
+iohkx::DirectoryWatcher::~DirectoryWatcher()
+{
+	//The pending read writes to our buffer until it's cancelled
+	OVERLAPPED* overlapped = static_cast<OVERLAPPED*>(m_overlapped);
+	DWORD bytes;
+	CancelIo(m_handle);
+	GetOverlappedResult(m_handle, overlapped, &bytes, TRUE);
+
+	delete overlapped;
+	CloseHandle(m_event);
+	CloseHandle(m_handle);
+}
+
+bool iohkx::DirectoryWatcher::wait(int timeoutMs, std::vector<std::filesystem::path>& changed)
+{
+	OVERLAPPED* overlapped = static_cast<OVERLAPPED*>(m_overlapped);
+
+	DWORD result = WaitForSingleObject(m_event, timeoutMs < 0 ? INFINITE : static_cast<DWORD>(timeoutMs));
+	if (result == WAIT_TIMEOUT)
+		return false;
+
+	DWORD bytes = 0;
+	if (result != WAIT_OBJECT_0 || !GetOverlappedResult(m_handle, overlapped, &bytes, FALSE))
+		throw Exception(ERR_READ_FAIL, "Failed to watch directory");
+
+	size_t count = changed.size();
+	if (bytes == 0) {
+		//Too much happened to fit the buffer. We don't know what, so report everything.
+		std::error_code err;
+		for (auto&& item : std::filesystem::recursive_directory_iterator(m_dir, err)) {
+			if (item.is_regular_file(err))
+				changed.push_back(item.path());
+		}
+	}
+	else {
+		const char* p = reinterpret_cast<const char*>(m_buffer.data());
+		for (;;) {
+			const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+			if (info->Action != FILE_ACTION_REMOVED && info->Action != FILE_ACTION_RENAMED_OLD_NAME)
+				changed.push_back(m_dir / std::wstring(info->FileName, info->FileNameLength / sizeof(wchar_t)));
+
+			if (info->NextEntryOffset == 0)
+				break;
+			p += info->NextEntryOffset;
+		}
+	}
+
+	listen();
+
+	return changed.size() > count;
+}
+
+bool iohkx::DirectoryWatcher::isWriteComplete(const std::filesystem::path& fileName)
+{
+	//Fails while anyone else has it open for writing
+	HANDLE file = CreateFileW(fileName.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	CloseHandle(file);
+	return true;
+}
+
+void iohkx::DirectoryWatcher::listen()
+{
+	OVERLAPPED* overlapped = static_cast<OVERLAPPED*>(m_overlapped);
+	ResetEvent(m_event);
+
+	if (!ReadDirectoryChangesW(m_handle, m_buffer.data(), static_cast<DWORD>(m_buffer.size() * sizeof(unsigned long)), TRUE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, overlapped, nullptr))
+		throw Exception(ERR_READ_FAIL, "Failed to watch directory");
+}
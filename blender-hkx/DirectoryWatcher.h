@@ -0,0 +1,36 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Reports files that are created, written to or renamed in a directory and its
+	//subdirectories, as the file system notifies us of them
+	class DirectoryWatcher
+	{
+	public:
+		DirectoryWatcher(const char* dirName);
+		~DirectoryWatcher();
+
+		DirectoryWatcher(const DirectoryWatcher&) = delete;
+		DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+		//Wait up to timeoutMs (-1 for ever) for changes and add the full paths of
+		//the files that changed to changed. Returns false if nothing changed in time.
+		//Paths can come more than once. Removed files are not reported.
+		bool wait(int timeoutMs, std::vector<std::filesystem::path>& changed);
+
+		//True if nobody is writing to fileName anymore
+		static bool isWriteComplete(const std::filesystem::path& fileName);
+
+	private:
+		//Ask for the next batch of notifications
+		void listen();
+
+	private:
+		std::filesystem::path m_dir;
+		void* m_handle{ nullptr };
+		void* m_event{ nullptr };
+		void* m_overlapped{ nullptr };
+		std::vector<unsigned long> m_buffer;
+	};
+}
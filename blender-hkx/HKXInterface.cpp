@@ -23,16 +23,39 @@ iohkx::HKXInterface::HKXInterface()
 }
 
 hkRefPtr<hkaAnimationContainer> iohkx::HKXInterface::load(const char* fileName)
+{
+#ifdef _DEBUG
+	std::cout << "Loading " << fileName << "...\n";
+#endif
+	hkIstream file(fileName);
+	return load(file.getStreamReader());
+}
+
+hkRefPtr<hkaAnimationContainer> iohkx::HKXInterface::load(const void* data, int size)
+{
+	hkIstream file(data, size);
+	return load(file.getStreamReader());
+}
+
+hkRefPtr<hkaAnimationContainer> iohkx::HKXInterface::load(hkStreamReader* sr)
 {
 	hkRefPtr<hkaAnimationContainer> result;
 
+	hkRootLevelContainer* root = loadRoot(sr);
+	if (root) {
+		result = root->findObject<hkaAnimationContainer>();
+		delete root;
+	}
+
+	return result;
+}
+
+hkRootLevelContainer* iohkx::HKXInterface::loadRoot(hkStreamReader* sr)
+{
+	hkRootLevelContainer* root = nullptr;
+
 	hkSerializeUtil::ErrorDetails err;
-	hkIstream file(fileName);
-	hkStreamReader* sr = file.getStreamReader();
 
-#ifdef _DEBUG
-	std::cout << "Loading " << fileName << "...\n";
-#endif
 	if (hkSerializeUtil::isLoadable(sr)) {
 
 #ifdef _DEBUG
@@ -42,22 +65,50 @@ hkRefPtr<hkaAnimationContainer> iohkx::HKXInterface::load(const char* fileName)
 		std::cout << "    Version: " << format.m_version << '\n';
 #endif
 
-		hkRootLevelContainer* root = hkSerializeUtil::loadObject<hkRootLevelContainer>(sr, &err);
+		root = hkSerializeUtil::loadObject<hkRootLevelContainer>(sr, &err);
 		if (err.id != hkSerializeUtil::ErrorDetails::ERRORID_NONE)
 			throw Exception(ERR_READ_FAIL, err.defaultMessage);
-
-		result = root->findObject<hkaAnimationContainer>();
-		delete root;
 	}
 #ifdef _DEBUG
 	else
 		std::cout << "    File not loadable\n";
 #endif
 
-	return result;
+	return root;
+}
+
+bool iohkx::HKXInterface::convert(const char* inFile, const char* outFile)
+{
+	hkRootLevelContainer* root;
+	{
+		hkIstream file(inFile);
+		root = loadRoot(file.getStreamReader());
+	}
+	if (!root)
+		return false;
+
+	try {
+		saveRoot(*root, hkOstream(outFile).getStreamWriter());
+	}
+	catch (...) {
+		delete root;
+		throw;
+	}
+	delete root;
+	return true;
 }
 
 void iohkx::HKXInterface::save(hkaAnimationContainer* animCtnr, const char* fileName)
+{
+	save(animCtnr, hkOstream(fileName).getStreamWriter());
+}
+
+void iohkx::HKXInterface::save(hkaAnimationContainer* animCtnr, hkArray<char>& out)
+{
+	save(animCtnr, hkOstream(out).getStreamWriter());
+}
+
+void iohkx::HKXInterface::save(hkaAnimationContainer* animCtnr, hkStreamWriter* sw)
 {
 	if (!animCtnr)
 		return;
@@ -67,6 +118,11 @@ void iohkx::HKXInterface::save(hkaAnimationContainer* animCtnr, const char* file
 	root.m_namedVariants.pushBack(hkRootLevelContainer::NamedVariant(
 			"Merged Animation Container", animCtnr, &animCtnr->staticClass()));
 
+	saveRoot(root, sw);
+}
+
+void iohkx::HKXInterface::saveRoot(const hkRootLevelContainer& root, hkStreamWriter* sw)
+{
 	hkPackfileWriter::Options pfopts;
 	switch (m_options.layout) {
 		case LAYOUT_WIN32:
@@ -82,7 +138,7 @@ void iohkx::HKXInterface::save(hkaAnimationContainer* animCtnr, const char* file
 	hkSerializeUtil::SaveOptions opts(bits);
 
 	hkResult res = hkSerializeUtil::savePackfile(&root, root.staticClass(), 
-		hkOstream(fileName).getStreamWriter(), pfopts, HK_NULL, opts);
+		sw, pfopts, HK_NULL, opts);
 
 	if (res == HK_FAILURE)
 		throw Exception(ERR_WRITE_FAIL, "Failed to save file");
@@ -10,7 +10,16 @@ namespace iohkx
 		HKXInterface();
 		
 		hkRefPtr<hkaAnimationContainer> load(const char* fileName);
+		//Load from a file in memory
+		hkRefPtr<hkaAnimationContainer> load(const void* data, int size);
+
 		void save(hkaAnimationContainer* animCtnr, const char* fileName);
+		//Save to memory
+		void save(hkaAnimationContainer* animCtnr, hkArray<char>& out);
+
+		//Load inFile and save everything in it (not just the animation container)
+		//to outFile, in our format. Returns false if inFile isn't a Havok file.
+		bool convert(const char* inFile, const char* outFile);
 		
 	public:
 		struct
@@ -18,5 +27,12 @@ namespace iohkx
 			bool textFormat{ false };
 			FileLayout layout{ LAYOUT_AMD64 };
 		} m_options;
+
+	private:
+		hkRefPtr<hkaAnimationContainer> load(hkStreamReader* sr);
+		void save(hkaAnimationContainer* animCtnr, hkStreamWriter* sw);
+		//Null if sr isn't loadable
+		hkRootLevelContainer* loadRoot(hkStreamReader* sr);
+		void saveRoot(const hkRootLevelContainer& root, hkStreamWriter* sw);
 	};
 }
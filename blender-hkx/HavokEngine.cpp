@@ -1,5 +1,7 @@
 #include "pch.h"
 #include "HavokEngine.h"
+#include "PoolAllocator.h"
+#include "Profiler.h"
 
 #include "Common/Base/Memory/System/Util/hkMemoryInitUtil.h"
 #include "Common/Base/Memory/Allocator/Malloc/hkMallocAllocator.h"
@@ -9,15 +11,132 @@ static void HK_CALL errorReport(const char* msg, void* userArgGivenToInit)
 	std::cerr << msg << '\n';
 }
 
+iohkx::HavokAllocator iohkx::HavokEngine::s_allocator = HAVOK_MALLOC;
+bool iohkx::HavokEngine::s_countMemory = false;
+iohkx::HavokEngine* iohkx::HavokEngine::s_current = nullptr;
+iohkx::HavokMemoryStats iohkx::HavokEngine::s_lastStats;
+
 iohkx::HavokEngine::HavokEngine()
 {
+	hkMemoryAllocator* allocator = hkMallocAllocator::m_defaultMallocAllocator;
+	if (s_allocator == HAVOK_POOL) {
+		m_pool = new PoolAllocator(allocator);
+		allocator = m_pool;
+	}
+
+	//Count the blocks Havok requests, if anyone wants to know
+	if (s_countMemory || Profiler::get()) {
+		m_allocator = new CountingAllocator(allocator);
+		allocator = m_allocator;
+	}
+
 	hkMemoryRouter* memoryRouter = hkMemoryInitUtil::initDefault(
-		hkMallocAllocator::m_defaultMallocAllocator, hkMemorySystem::FrameInfo(0));
+		allocator, hkMemorySystem::FrameInfo(0));
 	hkBaseSystem::init( memoryRouter, errorReport );
+
+	s_current = this;
 }
 
 iohkx::HavokEngine::~HavokEngine()
 {
 	hkBaseSystem::quit();
 	hkMemoryInitUtil::quit();
+
+	s_lastStats = stats();
+	s_current = nullptr;
+
+	delete m_allocator;
+	delete m_pool;
+}
+
+iohkx::HavokMemoryStats iohkx::HavokEngine::memoryStats()
+{
+	return s_current ? s_current->stats() : s_lastStats;
+}
+
+iohkx::HavokMemoryStats iohkx::HavokEngine::stats() const
+{
+	HavokMemoryStats stats;
+	if (m_allocator) {
+		stats.allocations = m_allocator->allocations();
+		stats.inUse = m_allocator->inUse();
+		stats.peakInUse = m_allocator->peakInUse();
+	}
+	stats.reserved = m_pool ? m_pool->reserved() : stats.inUse;
+	return stats;
+}
+
+iohkx::HavokThread::HavokThread()
+{
+	m_router = new hkMemoryRouter;
+	hkMemorySystem::getInstance().threadInit(*m_router, "iohkx::HavokThread");
+	hkBaseSystem::initThread(m_router);
+}
+
+iohkx::HavokThread::~HavokThread()
+{
+	hkBaseSystem::quitThread();
+	hkMemorySystem::getInstance().threadQuit(*m_router);
+	delete m_router;
+}
+
+void iohkx::parallelFor(int count, int jobs, const std::function<void(int)>& fn)
+{
+	assert(count >= 0);
+
+	if (jobs <= 1 || count <= 1) {
+		for (int i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+
+	std::atomic<int> next{ 0 };
+	std::mutex mutex;
+	std::exception_ptr error;
+
+	auto work = [&]() {
+		HavokThread havok;
+		for (int i = next++; i < count; i = next++) {
+			try {
+				fn(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+				//don't start any more
+				next = count;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < std::min(jobs, count); i++)
+		threads.emplace_back(work);
+	for (auto&& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+#if _MSC_VER >= 1900
+
+//__iob_func is called from Havok, but it no longer exists.
+//The FILE struct that it returns has also changed, so it
+//won't even make sense to try to find one and return it.
+// (https://stackoverflow.com/a/34655235 for details)
+// 
+//We just provide a dummy definition to satisfy the linker and let the program
+//crash and burn if it ever gets called (fingers crossed).
+
+#ifdef __cplusplus
+extern "C"
+#endif
+FILE* __cdecl __iob_func(unsigned i) 
+{
+	assert(false);
+	return nullptr;
 }
+
+#endif
@@ -1,11 +1,77 @@
 #pragma once
 
+class hkMemoryRouter;
+
 namespace iohkx
 {
+	class CountingAllocator;
+	class PoolAllocator;
+
+	//Where Havok gets its memory from
+	enum HavokAllocator
+	{
+		//the heap, block by block
+		HAVOK_MALLOC,
+		//a PoolAllocator on the heap
+		HAVOK_POOL,
+	};
+
+	//What Havok did with its memory (only counted if asked to)
+	struct HavokMemoryStats
+	{
+		//blocks requested
+		long long allocations{ 0 };
+		//bytes requested that are (or were at most) in use
+		long long inUse{ 0 };
+		long long peakInUse{ 0 };
+		//bytes taken from the heap (as inUse without a pool)
+		long long reserved{ 0 };
+	};
+
 	class HavokEngine
 	{
 	public:
 		HavokEngine();
 		~HavokEngine();
+
+		//Allocator of the engines made from now on (HAVOK_MALLOC by default)
+		static void setAllocator(HavokAllocator allocator) { s_allocator = allocator; }
+		//Whether engines made from now on count what Havok allocates, for
+		//memoryStats() (they always do while profiling)
+		static void countMemory(bool count) { s_countMemory = count; }
+		//Of the current engine, or the last one if none exists
+		static HavokMemoryStats memoryStats();
+
+	private:
+		HavokMemoryStats stats() const;
+
+	private:
+		static HavokAllocator s_allocator;
+		static bool s_countMemory;
+		static HavokEngine* s_current;
+		static HavokMemoryStats s_lastStats;
+
+		CountingAllocator* m_allocator{ nullptr };
+		PoolAllocator* m_pool{ nullptr };
 	};
+
+	//Lets a thread other than the one that made the HavokEngine use Havok,
+	//for as long as it exists
+	class HavokThread
+	{
+	public:
+		HavokThread();
+		~HavokThread();
+
+		HavokThread(const HavokThread&) = delete;
+		HavokThread& operator=(const HavokThread&) = delete;
+
+	private:
+		hkMemoryRouter* m_router;
+	};
+
+	//Call fn(0) to fn(count - 1) on up to jobs threads that can use Havok (on
+	//this one if jobs is 1). The first exception thrown is rethrown here, once
+	//all calls have returned or been abandoned.
+	void parallelFor(int count, int jobs, const std::function<void(int)>& fn);
 }
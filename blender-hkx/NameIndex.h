@@ -0,0 +1,93 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace iohkx
+{
+	//FNV-1a
+	inline unsigned int hashName(std::string_view name)
+	{
+		unsigned int hash = 2166136261u;
+		for (char c : name) {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	//Read-only lookup by name in an array of anything with a std::string name.
+	//Open addressing with linear probing, in a table of item indices.
+	//Names are not copied, so the items must outlive the index.
+	//Iterates in item order.
+	template<typename T>
+	class NameIndex
+	{
+	public:
+		//Index count items. If names repeat, the last one is found.
+		void build(T* items, int count)
+		{
+			assert(items || count == 0);
+
+			m_items = items;
+			m_count = count;
+			m_table.assign(tableSize(count), EMPTY);
+
+			unsigned int mask = static_cast<unsigned int>(m_table.size()) - 1;
+			for (int i = 0; i < count; i++) {
+				unsigned int slot = hashName(items[i].name) & mask;
+				while (m_table[slot] != EMPTY && items[m_table[slot]].name != items[i].name)
+					slot = (slot + 1) & mask;
+				m_table[slot] = i;
+			}
+		}
+
+		//Index count items with a table made by another index of the same items
+		void build(T* items, int count, const int* table, unsigned int size)
+		{
+			assert((items || count == 0) && table && size == tableSize(count));
+
+			m_items = items;
+			m_count = count;
+			m_table.assign(table, table + size);
+		}
+
+		T* find(std::string_view name) const
+		{
+			if (m_table.empty())
+				return nullptr;
+
+			unsigned int mask = static_cast<unsigned int>(m_table.size()) - 1;
+			for (unsigned int slot = hashName(name) & mask; m_table[slot] != EMPTY; slot = (slot + 1) & mask) {
+				if (m_items[m_table[slot]].name == name)
+					return &m_items[m_table[slot]];
+			}
+			return nullptr;
+		}
+
+		bool empty() const { return m_count == 0; }
+		int size() const { return m_count; }
+		T* begin() const { return m_items; }
+		T* end() const { return m_items + m_count; }
+
+		//Item indices by slot, -1 if empty
+		const std::vector<int>& table() const { return m_table; }
+
+		//Smallest power of 2 that keeps the table at most half full
+		static unsigned int tableSize(int count)
+		{
+			unsigned int size = 2;
+			while (size < 2 * static_cast<unsigned int>(count))
+				size *= 2;
+			return size;
+		}
+
+		static constexpr int EMPTY = -1;
+
+	private:
+		T* m_items{ nullptr };
+		int m_count{ 0 };
+		std::vector<int> m_table;
+	};
+}
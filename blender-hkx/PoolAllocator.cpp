@@ -0,0 +1,224 @@
+#include "pch.h"
+#include "PoolAllocator.h"
+
+//Blocks larger than this go straight to the base
+constexpr int MAX_POOLED = 4096;
+//Blocks are carved out of chunks of this size
+constexpr int CHUNK_SIZE = 256 * 1024;
+//Bytes' worth of blocks a thread trades with the shared lists at a time
+//(at least MIN_BATCH blocks). A thread keeps up to two batches of each class.
+constexpr int BATCH_BYTES = 8 * 1024;
+constexpr int MIN_BATCH = 4;
+//Havok wants its blocks aligned to this
+constexpr int ALIGNMENT = 16;
+
+using namespace iohkx;
+
+struct iohkx::PoolAllocator::ThreadCache
+{
+	PoolAllocator* owner{ nullptr };
+	std::vector<FreeList> lists;
+
+	~ThreadCache()
+	{
+		if (owner)
+			owner->detach(this);
+	}
+};
+
+iohkx::PoolAllocator::PoolAllocator(hkMemoryAllocator* base) : m_base(base)
+{
+	assert(base);
+
+	//Every 16 bytes up to 256, then four classes for each doubling
+	for (int size = ALIGNMENT; size <= 256; size += ALIGNMENT)
+		m_sizes.push_back(size);
+	for (int step = 64; m_sizes.back() < MAX_POOLED; step *= 2) {
+		for (int i = 0; i < 4; i++)
+			m_sizes.push_back(m_sizes.back() + step);
+	}
+	assert(m_sizes.back() == MAX_POOLED);
+
+	for (int size : m_sizes)
+		m_batches.push_back(std::max(BATCH_BYTES / size, MIN_BATCH));
+
+	m_classes.resize(MAX_POOLED / ALIGNMENT + 1);
+	for (int i = 0, c = 0; i < static_cast<int>(m_classes.size()); i++) {
+		while (m_sizes[c] < i * ALIGNMENT)
+			c++;
+		m_classes[i] = c;
+	}
+
+	m_free.resize(m_sizes.size());
+}
+
+iohkx::PoolAllocator::~PoolAllocator()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	//Cached blocks are in our chunks, so they go with them
+	for (auto&& cache : m_caches) {
+		cache->owner = nullptr;
+		cache->lists.clear();
+	}
+	for (auto&& chunk : m_chunks)
+		m_base->blockFree(chunk, CHUNK_SIZE);
+}
+
+void* iohkx::PoolAllocator::blockAlloc(int numBytes)
+{
+	int c = sizeClass(numBytes);
+	if (c < 0) {
+		void* p = m_base->blockAlloc(numBytes);
+		if (p) {
+			m_reserved.fetch_add(numBytes, std::memory_order_relaxed);
+			allocated(numBytes);
+		}
+		return p;
+	}
+
+	FreeList& list = threadCache().lists[c];
+	if (!list.head) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		refill(c, list, m_batches[c]);
+		if (!list.head)
+			return nullptr;
+	}
+
+	FreeBlock* block = list.head;
+	list.head = block->next;
+	list.count--;
+	allocated(m_sizes[c]);
+	return block;
+}
+
+void iohkx::PoolAllocator::blockFree(void* p, int numBytes)
+{
+	if (!p)
+		return;
+
+	int c = sizeClass(numBytes);
+	if (c < 0) {
+		m_base->blockFree(p, numBytes);
+		m_reserved.fetch_sub(numBytes, std::memory_order_relaxed);
+		m_inUse.fetch_sub(numBytes, std::memory_order_relaxed);
+		return;
+	}
+
+	FreeList& list = threadCache().lists[c];
+	FreeBlock* block = static_cast<FreeBlock*>(p);
+	block->next = list.head;
+	list.head = block;
+	list.count++;
+	m_inUse.fetch_sub(m_sizes[c], std::memory_order_relaxed);
+
+	if (list.count > 2 * m_batches[c]) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		release(c, list, m_batches[c]);
+	}
+}
+
+void iohkx::PoolAllocator::getMemoryStatistics(MemoryStatistics& u)
+{
+	u.m_allocated = m_reserved.load(std::memory_order_relaxed);
+	u.m_inUse = m_inUse.load(std::memory_order_relaxed);
+	u.m_peakInUse = m_peakInUse.load(std::memory_order_relaxed);
+	u.m_available = std::max(u.m_allocated - u.m_inUse, static_cast<hkInt64>(0));
+	//(no limit but the base's)
+	u.m_totalAvailable = -1;
+	u.m_largestBlock = -1;
+}
+
+int iohkx::PoolAllocator::getAllocatedSize(const void* obj, int nbytes)
+{
+	int c = sizeClass(nbytes);
+	return c >= 0 ? m_sizes[c] : m_base->getAllocatedSize(obj, nbytes);
+}
+
+int iohkx::PoolAllocator::sizeClass(int numBytes) const
+{
+	if (numBytes > MAX_POOLED)
+		return -1;
+	return m_classes[(std::max(numBytes, 1) + ALIGNMENT - 1) / ALIGNMENT];
+}
+
+iohkx::PoolAllocator::ThreadCache& iohkx::PoolAllocator::threadCache()
+{
+	thread_local ThreadCache cache;
+
+	if (cache.owner != this) {
+		//(only if an allocator is used from a thread that outlived another)
+		if (cache.owner)
+			cache.owner->detach(&cache);
+
+		cache.lists.assign(m_sizes.size(), FreeList());
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_caches.push_back(&cache);
+		cache.owner = this;
+	}
+	return cache;
+}
+
+void iohkx::PoolAllocator::refill(int c, FreeList& list, int count)
+{
+	FreeList& shared = m_free[c];
+	while (list.count < count && shared.head) {
+		FreeBlock* block = shared.head;
+		shared.head = block->next;
+		shared.count--;
+		block->next = list.head;
+		list.head = block;
+		list.count++;
+	}
+
+	int size = m_sizes[c];
+	while (list.count < count) {
+		if (m_chunkEnd - m_chunkPos < size) {
+			//What's left of the old chunk is lost
+			void* chunk = m_base->blockAlloc(CHUNK_SIZE);
+			if (!chunk)
+				return;
+			m_chunks.push_back(chunk);
+			m_reserved.fetch_add(CHUNK_SIZE, std::memory_order_relaxed);
+			m_chunkPos = static_cast<char*>(chunk);
+			m_chunkEnd = m_chunkPos + CHUNK_SIZE;
+		}
+
+		FreeBlock* block = reinterpret_cast<FreeBlock*>(m_chunkPos);
+		m_chunkPos += size;
+		block->next = list.head;
+		list.head = block;
+		list.count++;
+	}
+}
+
+void iohkx::PoolAllocator::release(int c, FreeList& list, int count)
+{
+	FreeList& shared = m_free[c];
+	while (count-- > 0 && list.head) {
+		FreeBlock* block = list.head;
+		list.head = block->next;
+		list.count--;
+		block->next = shared.head;
+		shared.head = block;
+		shared.count++;
+	}
+}
+
+void iohkx::PoolAllocator::detach(ThreadCache* cache)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	for (size_t c = 0; c < cache->lists.size(); c++)
+		release(static_cast<int>(c), cache->lists[c], cache->lists[c].count);
+
+	m_caches.erase(std::remove(m_caches.begin(), m_caches.end(), cache), m_caches.end());
+	cache->owner = nullptr;
+}
+
+void iohkx::PoolAllocator::allocated(long long numBytes)
+{
+	long long inUse = m_inUse.fetch_add(numBytes, std::memory_order_relaxed) + numBytes;
+	long long peak = m_peakInUse.load(std::memory_order_relaxed);
+	while (inUse > peak && !m_peakInUse.compare_exchange_weak(peak, inUse, std::memory_order_relaxed));
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "common.h"
+
+#include "Common/Base/Memory/Allocator/hkMemoryAllocator.h"
+
+namespace iohkx
+{
+	//Serves the small blocks Havok asks for from free lists of fixed-size blocks,
+	//one per size class, carved out of large chunks of the base allocator.
+	//Each thread keeps some free blocks of each class to itself and only takes
+	//the lock to trade them with the shared lists in batches. Larger blocks go
+	//straight to the base. Chunks go back to the base when we are destroyed.
+	class PoolAllocator : public hkMemoryAllocator
+	{
+	public:
+		PoolAllocator(hkMemoryAllocator* base);
+		~PoolAllocator();
+
+		PoolAllocator(const PoolAllocator&) = delete;
+		PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+		virtual void* blockAlloc(int numBytes) override;
+		virtual void blockFree(void* p, int numBytes) override;
+		virtual void getMemoryStatistics(MemoryStatistics& u) override;
+		virtual int getAllocatedSize(const void* obj, int nbytes) override;
+
+		//Bytes taken from the base (chunks and large blocks)
+		long long reserved() const { return m_reserved.load(std::memory_order_relaxed); }
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		//Free blocks of one size class
+		struct FreeList
+		{
+			FreeBlock* head{ nullptr };
+			int count{ 0 };
+		};
+
+		struct ThreadCache;
+
+		//Size class of a block of numBytes, or -1 if it's too big to pool
+		int sizeClass(int numBytes) const;
+		ThreadCache& threadCache();
+
+		//Move up to count blocks of class c from the shared lists (carving new ones if
+		//needed) to list, or back from list to the shared lists. Take the lock first.
+		void refill(int c, FreeList& list, int count);
+		void release(int c, FreeList& list, int count);
+
+		//Take back the blocks of a thread's cache and forget it
+		void detach(ThreadCache* cache);
+		void allocated(long long numBytes);
+
+	private:
+		hkMemoryAllocator* m_base;
+
+		//block size of each class, the blocks traded at a time,
+		//and the class of each multiple of 16 bytes
+		std::vector<int> m_sizes;
+		std::vector<int> m_batches;
+		std::vector<int> m_classes;
+
+		//The shared state
+		std::mutex m_mutex;
+		std::vector<FreeList> m_free;
+		std::vector<void*> m_chunks;
+		char* m_chunkPos{ nullptr };
+		char* m_chunkEnd{ nullptr };
+		std::vector<ThreadCache*> m_caches;
+
+		std::atomic<long long> m_reserved{ 0 };
+		std::atomic<long long> m_inUse{ 0 };
+		std::atomic<long long> m_peakInUse{ 0 };
+	};
+}
@@ -0,0 +1,264 @@
+#include "pch.h"
+#include "Profiler.h"
+
+#define NOMINMAX
+#include <Windows.h>
+
+//Allocation counters, shared by the global operator new and CountingAllocator.
+//They only count while a profiler exists.
+static std::atomic<bool> g_counting{ false };
+static std::atomic<long long> g_allocs{ 0 };
+static std::atomic<long long> g_allocBytes{ 0 };
+
+static void countAlloc(size_t size)
+{
+	if (!g_counting.load(std::memory_order_relaxed))
+		return;
+	g_allocs.fetch_add(1, std::memory_order_relaxed);
+	g_allocBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+//(the Python module leaves the allocator of its host alone)
+#ifndef _USRDLL
+
+void* operator new(size_t size)
+{
+	countAlloc(size);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+#endif
+
+//Small index for the calling thread, for the trace
+static int threadIndex()
+{
+	static std::atomic<int> next{ 0 };
+	thread_local int index = next++;
+	return index;
+}
+
+//Nesting depth of stages on this thread
+thread_local int t_depth = 0;
+
+//CPU time (user + kernel) of the calling thread in microseconds
+static long long threadCPUTime()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0;
+
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	//(100 ns units)
+	return static_cast<long long>((k.QuadPart + u.QuadPart) / 10);
+}
+
+void iohkx::writeJSONString(std::ostream& out, const std::string& str)
+{
+	out << '"';
+	for (char c : str) {
+		switch (c) {
+		case '"':
+			out << "\\\"";
+			break;
+		case '\\':
+			out << "\\\\";
+			break;
+		case '\n':
+			out << "\\n";
+			break;
+		default:
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+iohkx::Profiler* iohkx::Profiler::s_current = nullptr;
+
+iohkx::Profiler::Profiler() : m_start(std::chrono::steady_clock::now())
+{
+	assert(!s_current);
+	s_current = this;
+	g_counting = true;
+}
+
+iohkx::Profiler::~Profiler()
+{
+	g_counting = false;
+	s_current = nullptr;
+}
+
+void iohkx::Profiler::writeTrace(const char* fileName) const
+{
+	std::ofstream out(fileName);
+	if (!out)
+		throw Exception(ERR_WRITE_FAIL, "Failed to open profile output");
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	out << "{\"traceEvents\":[\n";
+	for (size_t i = 0; i < m_stages.size(); i++) {
+		const Stage& s = m_stages[i];
+		out << "{\"name\":";
+		writeJSONString(out, s.name);
+		out << ",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.thread
+			<< ",\"ts\":" << s.start << ",\"dur\":" << s.wall
+			<< ",\"args\":{\"cpu_us\":" << s.cpu
+			<< ",\"bytes_in\":" << s.bytesIn
+			<< ",\"bytes_out\":" << s.bytesOut
+			<< ",\"keys\":" << s.keys
+			<< ",\"allocs\":" << s.allocs
+			<< ",\"alloc_bytes\":" << s.allocBytes << "}}";
+		out << (i + 1 < m_stages.size() ? ",\n" : "\n");
+	}
+	out << "],\"displayTimeUnit\":\"ms\"}\n";
+
+	if (!out)
+		throw Exception(ERR_WRITE_FAIL, "Failed to write profile output");
+}
+
+void iohkx::Profiler::printSummary(std::ostream& out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	//Sum stages by name, in order of first appearance
+	std::vector<Stage> totals;
+	std::vector<int> counts;
+	for (auto&& s : m_stages) {
+		auto it = std::find_if(totals.begin(), totals.end(),
+			[&s](const Stage& t) { return t.name == s.name; });
+		if (it == totals.end()) {
+			totals.push_back(s);
+			totals.back().wall = totals.back().cpu = 0;
+			totals.back().bytesIn = totals.back().bytesOut = totals.back().keys = 0;
+			totals.back().allocs = totals.back().allocBytes = 0;
+			counts.push_back(0);
+			it = totals.end() - 1;
+		}
+		it->wall += s.wall;
+		it->cpu += s.cpu;
+		it->bytesIn += s.bytesIn;
+		it->bytesOut += s.bytesOut;
+		it->keys += s.keys;
+		it->allocs += s.allocs;
+		it->allocBytes += s.allocBytes;
+		counts[it - totals.begin()]++;
+	}
+
+	char buf[256];
+	sprintf_s(buf, sizeof(buf), "%-32s %6s %10s %10s %12s %12s %12s %10s %12s\n",
+		"stage", "count", "wall ms", "cpu ms", "bytes in", "bytes out", "keys", "allocs", "alloc bytes");
+	out << buf;
+	for (size_t i = 0; i < totals.size(); i++) {
+		const Stage& t = totals[i];
+		//indent nested stages
+		std::string name = std::string(2 * t.depth, ' ') + t.name;
+		sprintf_s(buf, sizeof(buf), "%-32s %6d %10.3f %10.3f %12lld %12lld %12lld %10lld %12lld\n",
+			name.c_str(), counts[i], t.wall / 1000.0, t.cpu / 1000.0,
+			t.bytesIn, t.bytesOut, t.keys, t.allocs, t.allocBytes);
+		out << buf;
+	}
+}
+
+std::vector<iohkx::Profiler::Stage> iohkx::Profiler::stages() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stages;
+}
+
+void iohkx::Profiler::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stages.clear();
+}
+
+long long iohkx::Profiler::fileSize(const char* fileName)
+{
+	std::error_code err;
+	auto size = std::filesystem::file_size(fileName, err);
+	return err ? 0 : static_cast<long long>(size);
+}
+
+long long iohkx::Profiler::now() const
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - m_start).count();
+}
+
+void iohkx::Profiler::add(Stage&& stage)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stages.push_back(std::move(stage));
+}
+
+iohkx::ProfileScope::ProfileScope(const char* name) : m_profiler(Profiler::get())
+{
+	if (m_profiler) {
+		m_stage.name = name;
+		m_stage.thread = threadIndex();
+		m_stage.depth = t_depth++;
+		m_stage.allocs = g_allocs.load(std::memory_order_relaxed);
+		m_stage.allocBytes = g_allocBytes.load(std::memory_order_relaxed);
+		m_cpu = threadCPUTime();
+		m_stage.start = m_profiler->now();
+	}
+}
+
+iohkx::ProfileScope::~ProfileScope()
+{
+	end();
+}
+
+void iohkx::ProfileScope::end()
+{
+	if (m_profiler) {
+		m_stage.wall = m_profiler->now() - m_stage.start;
+		m_stage.cpu = threadCPUTime() - m_cpu;
+		m_stage.allocs = g_allocs.load(std::memory_order_relaxed) - m_stage.allocs;
+		m_stage.allocBytes = g_allocBytes.load(std::memory_order_relaxed) - m_stage.allocBytes;
+		t_depth--;
+
+		m_profiler->add(std::move(m_stage));
+		m_profiler = nullptr;
+	}
+}
+
+void* iohkx::CountingAllocator::blockAlloc(int numBytes)
+{
+	countAlloc(numBytes);
+	m_allocs.fetch_add(1, std::memory_order_relaxed);
+
+	long long inUse = m_inUse.fetch_add(numBytes, std::memory_order_relaxed) + numBytes;
+	long long peak = m_peakInUse.load(std::memory_order_relaxed);
+	while (inUse > peak && !m_peakInUse.compare_exchange_weak(peak, inUse, std::memory_order_relaxed));
+
+	return m_base->blockAlloc(numBytes);
+}
+
+void iohkx::CountingAllocator::blockFree(void* p, int numBytes)
+{
+	if (p)
+		m_inUse.fetch_sub(numBytes, std::memory_order_relaxed);
+	m_base->blockFree(p, numBytes);
+}
+
+void iohkx::CountingAllocator::getMemoryStatistics(MemoryStatistics& u)
+{
+	m_base->getMemoryStatistics(u);
+}
+
+int iohkx::CountingAllocator::getAllocatedSize(const void* obj, int nbytes)
+{
+	return m_base->getAllocatedSize(obj, nbytes);
+}
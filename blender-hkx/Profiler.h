@@ -0,0 +1,115 @@
+#pragma once
+#include "common.h"
+
+#include "Common/Base/Memory/Allocator/hkMemoryAllocator.h"
+
+namespace iohkx
+{
+	//Records the time and resources spent in each stage of a job.
+	//Stages are marked with a ProfileScope, which does nothing unless
+	//a Profiler exists. Only one Profiler can exist at a time.
+	class Profiler
+	{
+	public:
+		struct Stage
+		{
+			std::string name;
+			int thread{ 0 };
+			int depth{ 0 };
+			//microseconds since the profiler was created
+			long long start{ 0 };
+			long long wall{ 0 };
+			//microseconds of CPU time on the stage's thread
+			long long cpu{ 0 };
+
+			long long bytesIn{ 0 };
+			long long bytesOut{ 0 };
+			long long keys{ 0 };
+			//heap allocations made by the process during the stage
+			long long allocs{ 0 };
+			long long allocBytes{ 0 };
+		};
+
+	public:
+		Profiler();
+		~Profiler();
+
+		//The current profiler, if any
+		static Profiler* get() { return s_current; }
+
+		//Chrome trace event format (chrome://tracing, Perfetto)
+		void writeTrace(const char* fileName) const;
+		//Totals per stage name
+		void printSummary(std::ostream& out) const;
+
+		//Copy of the stages recorded so far, in the order they ended
+		std::vector<Stage> stages() const;
+		void clear();
+
+		//Size of a file, for recording bytes in/out
+		static long long fileSize(const char* fileName);
+
+	private:
+		friend class ProfileScope;
+		long long now() const;
+		void add(Stage&& stage);
+
+	private:
+		static Profiler* s_current;
+
+		std::chrono::steady_clock::time_point m_start;
+		mutable std::mutex m_mutex;
+		std::vector<Stage> m_stages;
+	};
+
+	//Write a string as a JSON string value
+	void writeJSONString(std::ostream& out, const std::string& str);
+
+	//Times the enclosing scope as a stage of the current profiler
+	class ProfileScope
+	{
+	public:
+		ProfileScope(const char* name);
+		~ProfileScope();
+
+		ProfileScope(const ProfileScope&) = delete;
+		ProfileScope& operator=(const ProfileScope&) = delete;
+
+		//Stop timing before the scope ends
+		void end();
+
+		void bytesIn(long long n) { m_stage.bytesIn += n; }
+		void bytesOut(long long n) { m_stage.bytesOut += n; }
+		void keys(long long n) { m_stage.keys += n; }
+
+	private:
+		Profiler* m_profiler;
+		Profiler::Stage m_stage;
+		long long m_cpu{ 0 };
+	};
+
+	//Forwards to another allocator, counting the blocks Havok requests.
+	//HavokEngine only puts one in while profiling or if asked to count.
+	class CountingAllocator : public hkMemoryAllocator
+	{
+	public:
+		CountingAllocator(hkMemoryAllocator* base) : m_base(base) {}
+
+		virtual void* blockAlloc(int numBytes) override;
+		virtual void blockFree(void* p, int numBytes) override;
+		virtual void getMemoryStatistics(MemoryStatistics& u) override;
+		virtual int getAllocatedSize(const void* obj, int nbytes) override;
+
+		//Blocks requested so far, and the bytes requested that are (or were at most) in use
+		long long allocations() const { return m_allocs.load(std::memory_order_relaxed); }
+		long long inUse() const { return m_inUse.load(std::memory_order_relaxed); }
+		long long peakInUse() const { return m_peakInUse.load(std::memory_order_relaxed); }
+
+	private:
+		hkMemoryAllocator* m_base;
+
+		std::atomic<long long> m_allocs{ 0 };
+		std::atomic<long long> m_inUse{ 0 };
+		std::atomic<long long> m_peakInUse{ 0 };
+	};
+}
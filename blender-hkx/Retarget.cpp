@@ -0,0 +1,193 @@
+#include "pch.h"
+#include "Retarget.h"
+#include "Profiler.h"
+#include "Rotations.h"
+#include "TrackMapper.h"
+
+//Bones closer to the origin than this don't tell us anything about scale
+constexpr float MIN_HEIGHT = 1e-4f;
+
+using namespace iohkx;
+
+//Object-space poses of every bone of a skeleton at every frame, by bone index (root last)
+using Poses = std::vector<std::vector<hkQsTransform>>;
+
+iohkx::RetargetPlan::RetargetPlan(const Skeleton& source, const Skeleton& target,
+	const std::map<std::string, std::string>& map) : m_source(source), m_target(target)
+{
+	//We look names up from the target side
+	std::map<std::string, std::string> inverse;
+	for (auto&& item : map)
+		inverse[item.second] = item.first;
+
+	for (auto&& child : m_target.rootBone->children) {
+		addBone(child, inverse, false);
+	}
+
+	m_floats.resize(m_target.nFloats, -1);
+	for (int i = 0; i < m_target.nFloats; i++) {
+		auto it = inverse.find(m_target.floats[i].name);
+		const Float* slot = m_source.floatIndex.find(it != inverse.end() ? it->second : m_target.floats[i].name);
+		if (slot)
+			m_floats[i] = slot->index;
+	}
+}
+
+void iohkx::RetargetPlan::addBone(const Bone* target, const std::map<std::string, std::string>& map, bool parentMapped)
+{
+	BonePlan plan;
+	plan.target = target;
+
+	auto it = map.find(target->name);
+	const Bone* source = m_source.boneIndex.find(it != map.end() ? it->second : target->name);
+	if (source) {
+		plan.source = source->index;
+
+		//Make the rest poses line up in object space
+		plan.correction.setInverseMul(source->refPoseObj.m_rotation, target->refPoseObj.m_rotation);
+
+		//Only the top of each chain of mapped bones moves by itself
+		plan.translate = !parentMapped;
+		if (plan.translate) {
+			float from = source->refPoseObj.m_translation.length3();
+			float to = target->refPoseObj.m_translation.length3();
+			plan.scale = from > MIN_HEIGHT ? to / from : 1.0f;
+		}
+	}
+	else
+		plan.correction.setIdentity();
+
+	m_bones.push_back(plan);
+
+	for (auto&& child : target->children) {
+		addBone(child, map, source != nullptr);
+	}
+}
+
+std::map<std::string, std::string> iohkx::RetargetPlan::readMap(const char* fileName)
+{
+	assert(fileName);
+
+	std::ifstream in(fileName);
+	if (!in)
+		throw Exception(ERR_READ_FAIL, "Failed to open bone map");
+
+	auto trim = [](const std::string& str) {
+		size_t first = str.find_first_not_of(" \t\r");
+		size_t last = str.find_last_not_of(" \t\r");
+		return first == std::string::npos ? std::string() : str.substr(first, last - first + 1);
+	};
+
+	std::map<std::string, std::string> map;
+	std::string line;
+	while (std::getline(in, line)) {
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty())
+			continue;
+
+		size_t eq = line.find('=');
+		if (eq == std::string::npos)
+			throw Exception(ERR_INVALID_INPUT, "Bones are mapped as <source>=<target>");
+		std::string source = trim(line.substr(0, eq));
+		std::string target = trim(line.substr(eq + 1));
+		if (source.empty() || target.empty())
+			throw Exception(ERR_INVALID_INPUT, "Bones are mapped as <source>=<target>");
+		map[source] = target;
+	}
+	return map;
+}
+
+void iohkx::RetargetPlan::apply(const AnimationData& src, AnimationData& dst) const
+{
+	if (src.clips.size() != 1)
+		throw Exception(ERR_INVALID_INPUT, "Can't retarget paired animations");
+	if (src.additive)
+		throw Exception(ERR_INVALID_INPUT, "Can't retarget additive animations");
+
+	const Clip& in = src.clips.front();
+	if (in.skeleton != &m_source)
+		throw Exception(ERR_INVALID_INPUT, "Animation is not of the source skeleton");
+
+	int frames = src.frames;
+	if (frames < 1)
+		throw Exception(ERR_INVALID_INPUT, "Animation has no frames");
+
+	ProfileScope stage("Retarget");
+	stage.keys(static_cast<long long>(m_target.nBones + 1) * frames);
+
+	Poses poses(m_source.nBones + 1, std::vector<hkQsTransform>(frames));
+	{
+		hkQsTransform I(hkQsTransform::IDENTITY);
+		std::vector<hkQsTransform> parent(m_source.nBones + 1);
+		std::vector<hkQsTransform> object(m_source.nBones + 1);
+		for (int f = 0; f < frames; f++) {
+			bonePoses(m_source.rootBone, in, f, I, parent, object);
+			for (int i = 0; i <= m_source.nBones; i++)
+				poses[i][f] = object[i];
+		}
+	}
+
+	dst.frames = frames;
+	dst.frameRate = src.frameRate;
+	dst.additive = false;
+
+	//Same as the interchange files make, in object space
+	Clip& clip = addClip(dst, &m_target);
+	clip.refFrame = REF_OBJECT;
+
+	BoneTrack* root = addBoneTrack(clip, ROOT_BONE);
+	root->keys.setSize(frames);
+	std::copy(poses[m_source.nBones].begin(), poses[m_source.nBones].end(), root->keys.begin());
+
+	for (auto&& plan : m_bones) {
+		BoneTrack* track = addBoneTrack(clip, plan.target->name.c_str());
+		assert(track);
+		hkArray<hkQsTransform>& keys = track->keys;
+		keys.setSize(frames);
+
+		//(parents came first)
+		const hkArray<hkQsTransform>& parent = plan.target->parent->index >= 0 ?
+			clip.boneMap[plan.target->parent->index]->keys : clip.rootTransform->keys;
+
+		if (plan.source >= 0) {
+			std::copy(poses[plan.source].begin(), poses[plan.source].end(), keys.begin());
+			multiplyRotations(keys.begin(), frames, plan.correction);
+
+			if (plan.translate) {
+				for (int f = 0; f < frames; f++)
+					keys[f].m_translation.mul4(plan.scale);
+			}
+			else {
+				//where our rest pose puts us under the parent
+				for (int f = 0; f < frames; f++) {
+					hkQsTransform rest;
+					rest.setMul(parent[f], plan.target->refPose);
+					keys[f].m_translation = rest.m_translation;
+				}
+			}
+		}
+		else {
+			for (int f = 0; f < frames; f++)
+				keys[f].setMul(parent[f], plan.target->refPose);
+		}
+	}
+
+	for (int i = 0; i < m_target.nFloats; i++) {
+		int s = m_floats[i];
+		const FloatTrack* from = s >= 0 && s < static_cast<int>(in.floatMap.size()) ? in.floatMap[s] : nullptr;
+		if (from && !from->keys.isEmpty()) {
+			FloatTrack* track = addFloatTrack(clip, m_target.floats[i].name.c_str());
+			assert(track);
+			track->keys.setSize(from->keys.getSize());
+			std::copy(from->keys.begin(), from->keys.end(), track->keys.begin());
+		}
+	}
+
+	clip.annotations = in.annotations;
+}
+
+int iohkx::RetargetPlan::mappedBones() const
+{
+	return static_cast<int>(std::count_if(m_bones.begin(), m_bones.end(),
+		[](const BonePlan& plan) { return plan.source >= 0; }));
+}
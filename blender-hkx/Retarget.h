@@ -0,0 +1,57 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//How the bones of a target skeleton follow an animation of a source skeleton.
+	//Worked out once for a pair of skeletons, then applied to any number of animations.
+	//
+	//Each target bone with a source bone takes its object-space rotation, corrected
+	//by the difference between their rest poses. The topmost of them (whose parent
+	//has no source) also take its object-space translation, scaled by the
+	//difference in height. All other bones keep their rest pose under their parent.
+	class RetargetPlan
+	{
+	public:
+		//Bones and float slots are matched by name, or by map (source name to target name)
+		RetargetPlan(const Skeleton& source, const Skeleton& target,
+			const std::map<std::string, std::string>& map = std::map<std::string, std::string>());
+
+		//Read a bone map: one <source>=<target> per line, # starts a comment
+		static std::map<std::string, std::string> readMap(const char* fileName);
+
+		//Fill dst with src (decompressed, of our source skeleton) moved to the
+		//target skeleton, in object space and ready to compress.
+		//Only single, non-additive animations can be moved.
+		void apply(const AnimationData& src, AnimationData& dst) const;
+
+		//Target bones that follow a source bone
+		int mappedBones() const;
+		const Skeleton& target() const { return m_target; }
+
+	private:
+		struct BonePlan
+		{
+			const Bone* target{ nullptr };
+			//index of the source bone, or -1 if none
+			int source{ -1 };
+			//object-space rotation = that of the source * correction
+			hkQuaternion correction;
+			//take the source's object-space translation (times scale)
+			bool translate{ false };
+			float scale{ 1.0f };
+		};
+
+	private:
+		void addBone(const Bone* target, const std::map<std::string, std::string>& map, bool parentMapped);
+
+	private:
+		const Skeleton& m_source;
+		const Skeleton& m_target;
+
+		//Every target bone, parents first
+		std::vector<BonePlan> m_bones;
+		//source float slot of each target float slot (-1 if none)
+		std::vector<int> m_floats;
+	};
+}
@@ -0,0 +1,250 @@
+#include "pch.h"
+#include "Rotations.h"
+
+#include <xmmintrin.h>
+
+using namespace iohkx;
+
+constexpr unsigned int S = 0x80000000u;
+
+//Sign bits that flip the lanes set in a 4-bit mask (as made by _mm_movemask_ps)
+alignas(16) static const unsigned int SIGN_MASKS[16][4]{
+	{ 0, 0, 0, 0 }, { S, 0, 0, 0 }, { 0, S, 0, 0 }, { S, S, 0, 0 },
+	{ 0, 0, S, 0 }, { S, 0, S, 0 }, { 0, S, S, 0 }, { S, S, S, 0 },
+	{ 0, 0, 0, S }, { S, 0, 0, S }, { 0, S, 0, S }, { S, S, 0, S },
+	{ 0, 0, S, S }, { S, 0, S, S }, { 0, S, S, S }, { S, S, S, S },
+};
+
+static float* rotation(hkQsTransform& key)
+{
+	return reinterpret_cast<float*>(&key.m_rotation.m_vec);
+}
+
+static const float* rotation(const hkQsTransform& key)
+{
+	return reinterpret_cast<const float*>(&key.m_rotation.m_vec);
+}
+
+//Four rotations, one component per register
+struct Quat4
+{
+	__m128 x, y, z, w;
+};
+
+//Rotations of 4 consecutive keys
+static Quat4 load(const hkQsTransform* keys)
+{
+	Quat4 q{
+		_mm_load_ps(rotation(keys[0])),
+		_mm_load_ps(rotation(keys[1])),
+		_mm_load_ps(rotation(keys[2])),
+		_mm_load_ps(rotation(keys[3])) };
+	_MM_TRANSPOSE4_PS(q.x, q.y, q.z, q.w);
+	return q;
+}
+
+static void store(hkQsTransform* keys, Quat4 q)
+{
+	_MM_TRANSPOSE4_PS(q.x, q.y, q.z, q.w);
+	_mm_store_ps(rotation(keys[0]), q.x);
+	_mm_store_ps(rotation(keys[1]), q.y);
+	_mm_store_ps(rotation(keys[2]), q.z);
+	_mm_store_ps(rotation(keys[3]), q.w);
+}
+
+static __m128 dot(const Quat4& a, const Quat4& b)
+{
+	__m128 d = _mm_mul_ps(a.x, b.x);
+	d = _mm_add_ps(d, _mm_mul_ps(a.y, b.y));
+	d = _mm_add_ps(d, _mm_mul_ps(a.z, b.z));
+	return _mm_add_ps(d, _mm_mul_ps(a.w, b.w));
+}
+
+static void normalise(Quat4& q)
+{
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 len2 = dot(q, q);
+	//(also catches NaN)
+	__m128 zero = _mm_cmpngt_ps(len2, _mm_setzero_ps());
+	__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+
+	q.x = _mm_andnot_ps(zero, _mm_mul_ps(q.x, inv));
+	q.y = _mm_andnot_ps(zero, _mm_mul_ps(q.y, inv));
+	q.z = _mm_andnot_ps(zero, _mm_mul_ps(q.z, inv));
+	q.w = _mm_or_ps(_mm_and_ps(zero, one), _mm_andnot_ps(zero, _mm_mul_ps(q.w, inv)));
+}
+
+static void flip(Quat4& q, int mask)
+{
+	__m128 sign = _mm_load_ps(reinterpret_cast<const float*>(SIGN_MASKS[mask]));
+	q.x = _mm_xor_ps(q.x, sign);
+	q.y = _mm_xor_ps(q.y, sign);
+	q.z = _mm_xor_ps(q.z, sign);
+	q.w = _mm_xor_ps(q.w, sign);
+}
+
+//(last[3], v[0], v[1], v[2])
+static __m128 shiftIn(__m128 v, __m128 last)
+{
+	__m128 t = _mm_shuffle_ps(last, v, _MM_SHUFFLE(0, 0, 3, 3));
+	return _mm_shuffle_ps(t, v, _MM_SHUFFLE(2, 1, 2, 0));
+}
+
+//a * b of each pair
+static Quat4 mul(const Quat4& a, const Quat4& b)
+{
+	Quat4 r;
+	r.x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.w, b.x), _mm_mul_ps(a.x, b.w)),
+		_mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y)));
+	r.y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.w, b.y), _mm_mul_ps(a.y, b.w)),
+		_mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z)));
+	r.z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.w, b.z), _mm_mul_ps(a.z, b.w)),
+		_mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x)));
+	r.w = _mm_sub_ps(_mm_mul_ps(a.w, b.w),
+		_mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z)));
+	return r;
+}
+
+//Scalar versions for what's left over
+static void normalise(float* q)
+{
+	float len2 = q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3];
+	if (len2 > 0.0f) {
+		float inv = 1.0f / std::sqrt(len2);
+		for (int c = 0; c < 4; c++)
+			q[c] *= inv;
+	}
+	else {
+		q[0] = q[1] = q[2] = 0.0f;
+		q[3] = 1.0f;
+	}
+}
+
+static void mul(float* a, const float* b)
+{
+	float r[4]{
+		a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1],
+		a[3] * b[1] + a[1] * b[3] + a[2] * b[0] - a[0] * b[2],
+		a[3] * b[2] + a[2] * b[3] + a[0] * b[1] - a[1] * b[0],
+		a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2] };
+	std::memcpy(a, r, sizeof(r));
+}
+
+static float dot(const float* a, const float* b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+}
+
+static void negate(float* q)
+{
+	for (int c = 0; c < 4; c++)
+		q[c] = -q[c];
+}
+
+void iohkx::normaliseTrackRotations(hkQsTransform* keys, int count, const hkQuaternion* prev)
+{
+	assert(keys || count == 0);
+
+	//Whether a key flips depends on whether the one before it did, which makes
+	//a chain through the track. But the dot product of two keys only changes
+	//sign if one of them flips, so we can take the dot products of the
+	//unflipped keys four at a time and then follow the chain on their signs.
+
+	//The unflipped key before the current one (a zero dot product never flips)
+	alignas(16) float last[4]{ 0.0f, 0.0f, 0.0f, 0.0f };
+	if (prev)
+		std::memcpy(last, &prev->m_vec, sizeof(last));
+	//and whether it was flipped (prev is finished, so it counts as unflipped)
+	bool lastNeg = false;
+
+	int i = 0;
+	if (count >= 4) {
+		Quat4 p{ _mm_set1_ps(last[0]), _mm_set1_ps(last[1]), _mm_set1_ps(last[2]), _mm_set1_ps(last[3]) };
+		for (; i + 4 <= count; i += 4) {
+			Quat4 q = load(&keys[i]);
+			normalise(q);
+
+			//each key's predecessor
+			Quat4 pq{ shiftIn(q.x, p.x), shiftIn(q.y, p.y), shiftIn(q.z, p.z), shiftIn(q.w, p.w) };
+			__m128 d = dot(q, pq);
+			int negBits = _mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()));
+			int posBits = _mm_movemask_ps(_mm_cmpgt_ps(d, _mm_setzero_ps()));
+
+			int mask = 0;
+			for (int k = 0; k < 4; k++) {
+				bool neg = (negBits >> k & 1) ? !lastNeg : (posBits >> k & 1) ? lastNeg : false;
+				mask |= static_cast<int>(neg) << k;
+				lastNeg = neg;
+			}
+			p = q;
+
+			flip(q, mask);
+			store(&keys[i], q);
+		}
+
+		alignas(16) float lane[4];
+		_mm_store_ps(lane, p.x);
+		last[0] = lane[3];
+		_mm_store_ps(lane, p.y);
+		last[1] = lane[3];
+		_mm_store_ps(lane, p.z);
+		last[2] = lane[3];
+		_mm_store_ps(lane, p.w);
+		last[3] = lane[3];
+	}
+
+	for (; i < count; i++) {
+		float* q = rotation(keys[i]);
+		normalise(q);
+
+		float d = dot(q, last);
+		bool neg = d < 0.0f ? !lastNeg : d > 0.0f ? lastNeg : false;
+		std::memcpy(last, q, sizeof(last));
+		lastNeg = neg;
+
+		if (neg)
+			negate(q);
+	}
+}
+
+void iohkx::normaliseFrameRotations(hkQsTransform* keys, int count, const hkQsTransform* prev)
+{
+	assert(keys || count == 0);
+
+	//No chain here, the previous frame is already finished
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		Quat4 q = load(&keys[i]);
+		normalise(q);
+
+		if (prev)
+			flip(q, _mm_movemask_ps(_mm_cmplt_ps(dot(q, load(&prev[i])), _mm_setzero_ps())));
+
+		store(&keys[i], q);
+	}
+
+	for (; i < count; i++) {
+		float* q = rotation(keys[i]);
+		normalise(q);
+		if (prev && dot(q, rotation(prev[i])) < 0.0f)
+			negate(q);
+	}
+}
+
+void iohkx::multiplyRotations(hkQsTransform* keys, int count, const hkQuaternion& q)
+{
+	assert(keys || count == 0);
+
+	alignas(16) float b[4];
+	std::memcpy(b, &q.m_vec, sizeof(b));
+
+	int i = 0;
+	Quat4 q4{ _mm_set1_ps(b[0]), _mm_set1_ps(b[1]), _mm_set1_ps(b[2]), _mm_set1_ps(b[3]) };
+	for (; i + 4 <= count; i += 4) {
+		store(&keys[i], mul(load(&keys[i]), q4));
+	}
+
+	for (; i < count; i++) {
+		mul(rotation(keys[i]), b);
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Kernels that normalise the rotations of runs of keys and flip their signs so
+	//that consecutive keys of a track are in the same hemisphere (rotate the
+	//short way). Both take 4 keys at a time with SSE.
+	//A rotation of length 0 becomes the identity.
+
+	//count consecutive keys of one track. prev is the (finished) key before the first, if any.
+	void normaliseTrackRotations(hkQsTransform* keys, int count, const hkQuaternion* prev = nullptr);
+
+	//count tracks of one frame, as laid out in an interleaved animation.
+	//prev is the (finished) previous frame of the same tracks, if any.
+	void normaliseFrameRotations(hkQsTransform* keys, int count, const hkQsTransform* prev = nullptr);
+
+	//Multiply the rotations of count keys by q, on the right (rotation = rotation * q)
+	void multiplyRotations(hkQsTransform* keys, int count, const hkQuaternion& q);
+}
@@ -0,0 +1,307 @@
+#include "pch.h"
+#include "SkeletonCache.h"
+
+#define NOMINMAX
+#include <Windows.h>
+
+using namespace iohkx;
+
+constexpr char CACHE_MAGIC[4]{ 'S', 'K', 'C', '1' };
+constexpr unsigned int CACHE_VERSION = 1;
+constexpr size_t HASH_SIZE = 64;
+
+//File layout. Offsets are from the start of the file, sections are 16-byte aligned.
+struct CacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	//hex digest of the source file
+	char sourceHash[HASH_SIZE];
+
+	unsigned int nBones;
+	unsigned int nFloats;
+	//size of each name table, as NameIndex makes them
+	unsigned int boneSlots;
+	unsigned int floatSlots;
+
+	unsigned int bones;
+	unsigned int floats;
+	unsigned int boneTable;
+	unsigned int floatTable;
+	//zero-terminated strings, the skeleton name first
+	unsigned int names;
+	unsigned int namesSize;
+
+	unsigned int pad[2];
+};
+
+struct BoneRecord
+{
+	hkQsTransform refPose;
+	hkQsTransform refPoseInv;
+	hkQsTransform refPoseObj;
+	//-1 for the root
+	int parent;
+	unsigned int name;
+	unsigned int nameSize;
+	unsigned int pad;
+};
+
+struct FloatRecord
+{
+	unsigned int name;
+	unsigned int nameSize;
+	float refValue;
+	unsigned int pad;
+};
+
+static size_t align16(size_t offset)
+{
+	return (offset + 15) & ~static_cast<size_t>(15);
+}
+
+//Every entry of a name table is empty or an item index, and at least one
+//is empty (lookups probe until they find an empty slot)
+static bool validTable(const int* table, unsigned int size, unsigned int count)
+{
+	if (count >= size)
+		return false;
+
+	bool hasEmpty = false;
+	for (unsigned int i = 0; i < size; i++) {
+		if (table[i] < -1 || table[i] >= static_cast<int>(count))
+			return false;
+		if (table[i] == -1)
+			hasEmpty = true;
+	}
+	return hasEmpty;
+}
+
+iohkx::SkeletonCache::~SkeletonCache()
+{
+	close();
+}
+
+bool iohkx::SkeletonCache::open(const char* fileName, const std::string& sourceHash)
+{
+	assert(fileName);
+	close();
+
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	m_file = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart < static_cast<long long>(sizeof(CacheHeader))) {
+		close();
+		return false;
+	}
+	m_size = static_cast<size_t>(size.QuadPart);
+
+	m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping)
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_data) {
+		close();
+		return false;
+	}
+
+	//Make sure it's ours, up to date, and that everything is where it claims to be
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(m_data);
+	bool valid = std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+		&& header->version == CACHE_VERSION
+		&& sourceHash.size() == HASH_SIZE
+		&& std::memcmp(header->sourceHash, sourceHash.data(), HASH_SIZE) == 0;
+
+	auto fits = [this](size_t offset, size_t count, size_t size)
+	{
+		return offset % 16 == 0 && offset <= m_size && count <= (m_size - offset) / size;
+	};
+	valid = valid
+		&& fits(header->bones, header->nBones, sizeof(BoneRecord))
+		&& fits(header->floats, header->nFloats, sizeof(FloatRecord))
+		&& fits(header->boneTable, header->boneSlots, sizeof(int))
+		&& fits(header->floatTable, header->floatSlots, sizeof(int))
+		&& fits(header->names, header->namesSize, 1)
+		&& header->namesSize > 0 && m_data[header->names + header->namesSize - 1] == '\0'
+		&& header->boneSlots == NameIndex<Bone>::tableSize(header->nBones)
+		&& header->floatSlots == NameIndex<Float>::tableSize(header->nFloats)
+		&& validTable(reinterpret_cast<const int*>(m_data + header->boneTable), header->boneSlots, header->nBones)
+		&& validTable(reinterpret_cast<const int*>(m_data + header->floatTable), header->floatSlots, header->nFloats);
+
+	if (valid) {
+		const BoneRecord* bones = reinterpret_cast<const BoneRecord*>(m_data + header->bones);
+		for (unsigned int i = 0; i < header->nBones && valid; i++) {
+			valid = bones[i].parent >= -1 && bones[i].parent < static_cast<int>(header->nBones)
+				&& bones[i].name < header->namesSize && bones[i].nameSize < header->namesSize - bones[i].name;
+		}
+		const FloatRecord* floats = reinterpret_cast<const FloatRecord*>(m_data + header->floats);
+		for (unsigned int i = 0; i < header->nFloats && valid; i++) {
+			valid = floats[i].name < header->namesSize && floats[i].nameSize < header->namesSize - floats[i].name;
+		}
+	}
+
+	if (!valid)
+		close();
+	return valid;
+}
+
+Skeleton* iohkx::SkeletonCache::read() const
+{
+	assert(m_data);
+
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(m_data);
+	const BoneRecord* bones = reinterpret_cast<const BoneRecord*>(m_data + header->bones);
+	const FloatRecord* floats = reinterpret_cast<const FloatRecord*>(m_data + header->floats);
+	const char* names = m_data + header->names;
+
+	int nBones = static_cast<int>(header->nBones);
+	int nFloats = static_cast<int>(header->nFloats);
+
+	Skeleton* skeleton = new Skeleton;
+	skeleton->name = names;
+
+	//Same structure as SkeletonLoader makes, root bone last
+	skeleton->nBones = nBones;
+	skeleton->bones = new Bone[nBones + 1];
+
+	skeleton->rootBone = &skeleton->bones[nBones];
+	skeleton->rootBone->index = -1;
+	skeleton->rootBone->name = ROOT_BONE;
+	skeleton->rootBone->refPose.setIdentity();
+	skeleton->rootBone->refPoseInv.setIdentity();
+	skeleton->rootBone->refPoseObj.setIdentity();
+
+	for (int i = 0; i < nBones; i++) {
+		Bone& bone = skeleton->bones[i];
+		bone.index = i;
+		bone.name.assign(names + bones[i].name, bones[i].nameSize);
+		bone.refPose = bones[i].refPose;
+		bone.refPoseInv = bones[i].refPoseInv;
+		bone.refPoseObj = bones[i].refPoseObj;
+
+		bone.parent = bones[i].parent == -1 ? skeleton->rootBone : &skeleton->bones[bones[i].parent];
+		bone.parent->children.push_back(&bone);
+	}
+
+	skeleton->nFloats = nFloats;
+	skeleton->floats = new Float[nFloats];
+
+	for (int i = 0; i < nFloats; i++) {
+		skeleton->floats[i].index = i;
+		skeleton->floats[i].name.assign(names + floats[i].name, floats[i].nameSize);
+		skeleton->floats[i].refValue = floats[i].refValue;
+	}
+
+	//Names are hashed already
+	skeleton->boneIndex.build(skeleton->bones, nBones,
+		reinterpret_cast<const int*>(m_data + header->boneTable), header->boneSlots);
+	skeleton->floatIndex.build(skeleton->floats, nFloats,
+		reinterpret_cast<const int*>(m_data + header->floatTable), header->floatSlots);
+
+	return skeleton;
+}
+
+void iohkx::SkeletonCache::write(const char* fileName, const Skeleton& skeleton, const std::string& sourceHash)
+{
+	assert(fileName && sourceHash.size() == HASH_SIZE);
+
+	//Strings first, so we know where to find them
+	std::string names = skeleton.name;
+	names.push_back('\0');
+
+	std::vector<std::pair<unsigned int, unsigned int>> boneNames(skeleton.nBones);
+	for (int i = 0; i < skeleton.nBones; i++) {
+		const std::string& name = skeleton.bones[i].name;
+		boneNames[i] = { static_cast<unsigned int>(names.size()), static_cast<unsigned int>(name.size()) };
+		names.append(name);
+		names.push_back('\0');
+	}
+	std::vector<std::pair<unsigned int, unsigned int>> floatNames(skeleton.nFloats);
+	for (int i = 0; i < skeleton.nFloats; i++) {
+		const std::string& name = skeleton.floats[i].name;
+		floatNames[i] = { static_cast<unsigned int>(names.size()), static_cast<unsigned int>(name.size()) };
+		names.append(name);
+		names.push_back('\0');
+	}
+
+	CacheHeader header{};
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	std::memcpy(header.sourceHash, sourceHash.data(), HASH_SIZE);
+	header.nBones = skeleton.nBones;
+	header.nFloats = skeleton.nFloats;
+	header.boneSlots = static_cast<unsigned int>(skeleton.boneIndex.table().size());
+	header.floatSlots = static_cast<unsigned int>(skeleton.floatIndex.table().size());
+
+	size_t offset = align16(sizeof(CacheHeader));
+	header.bones = static_cast<unsigned int>(offset);
+	offset = align16(offset + header.nBones * sizeof(BoneRecord));
+	header.floats = static_cast<unsigned int>(offset);
+	offset = align16(offset + header.nFloats * sizeof(FloatRecord));
+	header.boneTable = static_cast<unsigned int>(offset);
+	offset = align16(offset + header.boneSlots * sizeof(int));
+	header.floatTable = static_cast<unsigned int>(offset);
+	offset = align16(offset + header.floatSlots * sizeof(int));
+	header.names = static_cast<unsigned int>(offset);
+	header.namesSize = static_cast<unsigned int>(names.size());
+
+	std::vector<char> buf(offset + names.size());
+	std::memcpy(buf.data(), &header, sizeof(header));
+
+	BoneRecord* bones = reinterpret_cast<BoneRecord*>(buf.data() + header.bones);
+	for (int i = 0; i < skeleton.nBones; i++) {
+		const Bone& bone = skeleton.bones[i];
+		bones[i].refPose = bone.refPose;
+		bones[i].refPoseInv = bone.refPoseInv;
+		bones[i].refPoseObj = bone.refPoseObj;
+		bones[i].parent = bone.parent && bone.parent != skeleton.rootBone ? bone.parent->index : -1;
+		bones[i].name = boneNames[i].first;
+		bones[i].nameSize = boneNames[i].second;
+		bones[i].pad = 0;
+	}
+
+	FloatRecord* floats = reinterpret_cast<FloatRecord*>(buf.data() + header.floats);
+	for (int i = 0; i < skeleton.nFloats; i++) {
+		floats[i].name = floatNames[i].first;
+		floats[i].nameSize = floatNames[i].second;
+		floats[i].refValue = skeleton.floats[i].refValue;
+		floats[i].pad = 0;
+	}
+
+	std::memcpy(buf.data() + header.boneTable, skeleton.boneIndex.table().data(), header.boneSlots * sizeof(int));
+	std::memcpy(buf.data() + header.floatTable, skeleton.floatIndex.table().data(), header.floatSlots * sizeof(int));
+
+	std::memcpy(buf.data() + header.names, names.data(), names.size());
+
+	//Write to a temp name first, so that nobody maps half a file
+	std::filesystem::path path(fileName);
+	std::filesystem::path tmp = path;
+	tmp += ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if (!out.write(buf.data(), buf.size()))
+			throw Exception(ERR_WRITE_FAIL, "Failed to write skeleton cache");
+	}
+	std::error_code err;
+	std::filesystem::rename(tmp, path, err);
+	if (err) {
+		std::filesystem::remove(tmp, err);
+		throw Exception(ERR_WRITE_FAIL, "Failed to write skeleton cache");
+	}
+}
+
+void iohkx::SkeletonCache::close()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file)
+		CloseHandle(m_file);
+	m_data = nullptr;
+	m_mapping = nullptr;
+	m_file = nullptr;
+	m_size = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//Preprocessed copy of a skeleton file, with everything SkeletonLoader would
+	//otherwise compute: bones, parent indices, rest poses in all three spaces,
+	//float slots and a name hash table. Made from (and only valid for) a source
+	//file with a particular hash. It is read by mapping it into memory.
+	class SkeletonCache
+	{
+	public:
+		SkeletonCache() {}
+		~SkeletonCache();
+
+		SkeletonCache(const SkeletonCache&) = delete;
+		SkeletonCache& operator=(const SkeletonCache&) = delete;
+
+		//Map fileName and return true if it's a valid cache of a source with this hash.
+		//Missing, stale or damaged caches return false.
+		bool open(const char* fileName, const std::string& sourceHash);
+
+		//New skeleton from the mapped file. Everything but the paired tables is set.
+		Skeleton* read() const;
+
+		//Cache skeleton as fileName, replacing any existing cache
+		static void write(const char* fileName, const Skeleton& skeleton, const std::string& sourceHash);
+
+		//Where we look for the cache of sourceFile
+		static std::string nameFor(const char* sourceFile) { return std::string(sourceFile) + ".skc"; }
+
+	private:
+		void close();
+
+	private:
+		void* m_file{ nullptr };
+		void* m_mapping{ nullptr };
+		const char* m_data{ nullptr };
+		size_t m_size{ 0 };
+	};
+}
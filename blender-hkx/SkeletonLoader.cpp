@@ -1,5 +1,10 @@
 #include "pch.h"
 #include "SkeletonLoader.h"
+#include "ContentHash.h"
+#include "HKXInterface.h"
+#include "Profiler.h"
+#include "SkeletonCache.h"
+#include "TrackMapper.h"
 
 iohkx::SkeletonLoader::SkeletonLoader()
 {
@@ -7,6 +12,9 @@ iohkx::SkeletonLoader::SkeletonLoader()
 
 iohkx::SkeletonLoader::~SkeletonLoader()
 {
+	for (unsigned int i = 0; i < m_pairs.size(); i++) {
+		delete m_pairs[i];
+	}
 	for (unsigned int i = 0; i < m_skeletons.size(); i++) {
 		delete[] m_skeletons[i]->bones;
 		delete[] m_skeletons[i]->floats;
@@ -25,7 +33,6 @@ void iohkx::SkeletonLoader::load(hkaAnimationContainer* animCtnr)
 	hkaSkeleton* src = animCtnr->m_skeletons[0];
 
 	Skeleton* skeleton = new Skeleton;
-	m_skeletons.push_back(skeleton);
 
 	//Convenience vars
 	int nBones = src->m_bones.getSize();
@@ -88,14 +95,84 @@ void iohkx::SkeletonLoader::load(hkaAnimationContainer* animCtnr)
 		skeleton->floats[i].name = src->m_floatSlots[i].cString();
 		skeleton->floats[i].refValue = src->m_referenceFloats[i];
 	}
-	
-	//Map the bones
-	for (int i = 0; i < nBones; i++) {
-		skeleton->boneIndex[skeleton->bones[i].name] = &skeleton->bones[i];
+
+	//Map the names
+	skeleton->boneIndex.build(skeleton->bones, nBones);
+	skeleton->floatIndex.build(skeleton->floats, nFloats);
+
+	add(skeleton);
+}
+
+void iohkx::SkeletonLoader::load(const char* fileName, HKXInterface& hkx)
+{
+	assert(fileName);
+
+	std::string cacheName = SkeletonCache::nameFor(fileName);
+	bool hasCache = std::filesystem::exists(cacheName);
+
+	std::string hash;
+	if (hasCache || m_options.writeCache) {
+		ContentHash hasher;
+		hasher.addFile(fileName);
+		hash = hasher.hex();
 	}
 
-	//Map the floats
-	for (int i = 0; i < nFloats; i++) {
-		skeleton->floatIndex[skeleton->floats[i].name] = &skeleton->floats[i];
+	if (hasCache) {
+		ProfileScope stage("Skeleton cache");
+		stage.bytesIn(Profiler::fileSize(cacheName.c_str()));
+
+		SkeletonCache cache;
+		if (cache.open(cacheName.c_str(), hash)) {
+			add(cache.read());
+			return;
+		}
+	}
+
+	ProfileScope loadStage("Havok load");
+	loadStage.bytesIn(Profiler::fileSize(fileName));
+	hkRefPtr<hkaAnimationContainer> res = hkx.load(fileName);
+	loadStage.end();
+
+	if (res && !res->m_skeletons.isEmpty()) {
+		ProfileScope buildStage("Skeleton build");
+		load(res.val());
+		buildStage.end();
+
+		if (hasCache || m_options.writeCache) {
+			ProfileScope stage("Skeleton cache write");
+			try {
+				SkeletonCache::write(cacheName.c_str(), *m_skeletons.back(), hash);
+				stage.bytesOut(Profiler::fileSize(cacheName.c_str()));
+			}
+			catch (const Exception&) {
+				//The cache is only an optimisation, carry on without it
+				std::cerr << "Failed to write skeleton cache\n";
+			}
+		}
 	}
 }
+
+void iohkx::SkeletonLoader::add(Skeleton* skeleton)
+{
+	assert(skeleton);
+
+	m_skeletons.push_back(skeleton);
+
+	//Prepare for paired animations with any of the skeletons we have (including itself)
+	for (unsigned int i = 0; i < m_skeletons.size(); i++) {
+		addPair(m_skeletons[i], skeleton);
+		if (m_skeletons[i] != skeleton)
+			addPair(skeleton, m_skeletons[i]);
+	}
+}
+
+void iohkx::SkeletonLoader::addPair(Skeleton* primary, Skeleton* secondary)
+{
+	assert(primary && secondary);
+
+	PairedTable* table = new PairedTable;
+	m_pairs.push_back(table);
+
+	table->build(primary, secondary);
+	primary->pairedTables[secondary] = table;
+}
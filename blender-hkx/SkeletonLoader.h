@@ -4,19 +4,39 @@
 
 namespace iohkx
 {
+	class HKXInterface;
+
 	class SkeletonLoader
 	{
+	public:
+		struct Options
+		{
+			//(re)write the cache of skeleton files we load, even if they don't have one
+			bool writeCache{ false };
+		};
+
 	public:
 		SkeletonLoader();
 		~SkeletonLoader();
 
 		void load(hkaAnimationContainer* animCtnr);
+		//Load the skeleton file fileName, from its cache if it has an up-to-date one.
+		//A stale cache is replaced.
+		void load(const char* fileName, HKXInterface& hkx);
 
 		const Skeleton* operator[](int i) const { return m_skeletons[i]; }
 		bool empty() const { return m_skeletons.empty(); }
 		const std::vector<Skeleton*>& get() const { return m_skeletons; }
 
+		Options m_options;
+
+	private:
+		//Pair up and take ownership of skeleton
+		void add(Skeleton* skeleton);
+		void addPair(Skeleton* primary, Skeleton* secondary);
+
 	private:
 		std::vector<Skeleton*> m_skeletons;
+		std::vector<PairedTable*> m_pairs;
 	};
 }
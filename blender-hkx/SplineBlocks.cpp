@@ -0,0 +1,180 @@
+#include "pch.h"
+#include "SplineBlocks.h"
+#include "Profiler.h"
+
+//Block data is aligned to this
+constexpr int BLOCK_ALIGNMENT = 16;
+
+using namespace iohkx;
+using TrackCompressionParams = hkaSplineCompressedAnimation::TrackCompressionParams;
+using AnimationCompressionParams = hkaSplineCompressedAnimation::AnimationCompressionParams;
+
+//Everything an animation has for one block. The offsets are from the start of the block.
+struct Block
+{
+	std::vector<hkUint8> data;
+	hkUint32 floatOffset;
+	std::vector<hkUint32> transformOffsets;
+	std::vector<hkUint32> floatOffsets;
+};
+
+static Block getBlock(const hkaSplineCompressedAnimation& anim, int b)
+{
+	int nTransforms = anim.m_numberOfTransformTracks;
+	int nFloats = anim.m_numberOfFloatTracks;
+
+	hkUint32 begin = anim.m_blockOffsets[b];
+	hkUint32 end = b + 1 < anim.m_numBlocks ? anim.m_blockOffsets[b + 1] : anim.m_data.getSize();
+	assert(begin <= end && end <= static_cast<hkUint32>(anim.m_data.getSize()));
+
+	Block block;
+	block.data.assign(anim.m_data.begin() + begin, anim.m_data.begin() + end);
+	block.floatOffset = anim.m_floatBlockOffsets[b];
+	//(only there if it was made to sample single tracks)
+	if (!anim.m_transformOffsets.isEmpty())
+		block.transformOffsets.assign(anim.m_transformOffsets.begin() + b * nTransforms,
+			anim.m_transformOffsets.begin() + (b + 1) * nTransforms);
+	if (!anim.m_floatOffsets.isEmpty())
+		block.floatOffsets.assign(anim.m_floatOffsets.begin() + b * nFloats,
+			anim.m_floatOffsets.begin() + (b + 1) * nFloats);
+	return block;
+}
+
+//Are the keys further apart than the tolerances allow? A block is only kept if
+//it's within them at every frame, so an unchanged block that quantisation took
+//a little past them is compressed again.
+static bool differ(const hkQsTransform& a, const hkQsTransform& b, const TrackCompressionParams& tcp)
+{
+	if (a.m_translation.distanceTo3(b.m_translation) > tcp.m_translationTolerance)
+		return true;
+	if (a.m_scale.distanceTo3(b.m_scale) > tcp.m_scaleTolerance)
+		return true;
+
+	//distance between unit quaternions, whichever sign they have
+	float dot = std::abs(static_cast<float>(a.m_rotation.m_vec.dot4(b.m_rotation.m_vec)));
+	float d = std::sqrt(std::max(2.0f - 2.0f * dot, 0.0f));
+	return d > tcp.m_rotationTolerance;
+}
+
+//Frames that base doesn't reproduce
+static std::vector<bool> findChangedFrames(const hkaSplineCompressedAnimation& base,
+	const hkaInterleavedUncompressedAnimation& raw, const TrackCompressionParams& tcp)
+{
+	int nTransforms = raw.m_numberOfTransformTracks;
+	int nFloats = raw.m_numberOfFloatTracks;
+	int frames = base.m_numFrames;
+
+	hkArray<hkQsTransform> transforms(std::max(nTransforms, 1));
+	hkArray<hkReal> floats(std::max(nFloats, 1));
+
+	std::vector<bool> changed(frames, false);
+	for (int f = 0; f < frames; f++) {
+		hkReal time = std::min(f * base.m_frameDuration, base.m_duration);
+		base.sampleTracks(time, transforms.begin(), floats.begin(), HK_NULL);
+
+		for (int i = 0; i < nTransforms && !changed[f]; i++) {
+			changed[f] = differ(transforms[i], raw.m_transforms[f * nTransforms + i], tcp);
+		}
+		for (int i = 0; i < nFloats && !changed[f]; i++) {
+			changed[f] = std::abs(floats[i] - raw.m_floats[f * nFloats + i]) > tcp.m_floatingTolerance;
+		}
+	}
+	return changed;
+}
+
+int iohkx::reencodeChangedBlocks(hkaSplineCompressedAnimation* base, const hkaInterleavedUncompressedAnimation& raw,
+	const TrackCompressionParams& tcp, const AnimationCompressionParams& acp)
+{
+	assert(base);
+
+	int nTransforms = raw.m_numberOfTransformTracks;
+	int nFloats = raw.m_numberOfFloatTracks;
+	int frames = nTransforms > 0 ? raw.m_transforms.getSize() / nTransforms : raw.m_floats.getSize() / std::max(nFloats, 1);
+
+	//Same shape, same blocks?
+	int framesPerBlock = base->m_maxFramesPerBlock;
+	if (base->m_numberOfTransformTracks != nTransforms || base->m_numberOfFloatTracks != nFloats
+		|| base->m_numFrames != frames || frames < 2 || framesPerBlock < 2
+		|| framesPerBlock != acp.m_maxFramesPerBlock
+		|| std::abs(base->m_duration - raw.m_duration) > base->m_frameDuration * 0.5f
+		|| base->m_transformOffsets.isEmpty() == static_cast<bool>(acp.m_enableSampleSingleTracks))
+		return -1;
+
+	int stride = framesPerBlock - 1;
+	int nBlocks = (frames - 2) / stride + 1;
+	if (base->m_numBlocks != nBlocks || base->m_blockOffsets.getSize() != nBlocks
+		|| base->m_floatBlockOffsets.getSize() != nBlocks
+		|| (!base->m_transformOffsets.isEmpty() && base->m_transformOffsets.getSize() != nBlocks * nTransforms)
+		|| (!base->m_floatOffsets.isEmpty() && base->m_floatOffsets.getSize() != nBlocks * nFloats))
+		return -1;
+
+	ProfileScope findStage("Find changed blocks");
+	findStage.keys(static_cast<long long>(nTransforms + nFloats) * frames);
+	std::vector<bool> changedFrames = findChangedFrames(*base, raw, tcp);
+	findStage.end();
+
+	//Encode the changed blocks by themselves before we touch base
+	std::vector<Block> blocks(nBlocks);
+	std::vector<bool> reencoded(nBlocks, false);
+	int count = 0;
+
+	ProfileScope compressStage("Spline compression (changed blocks)");
+	for (int b = 0; b < nBlocks; b++) {
+		int first = b * stride;
+		int last = std::min(first + stride, frames - 1);
+		if (std::none_of(changedFrames.begin() + first, changedFrames.begin() + last + 1, [](bool c) { return c; }))
+			continue;
+
+		int n = last - first + 1;
+		hkRefPtr<hkaInterleavedUncompressedAnimation> sub = new hkaInterleavedUncompressedAnimation;
+		sub->removeReference();
+		sub->m_duration = (n - 1) * base->m_frameDuration;
+		sub->m_numberOfTransformTracks = nTransforms;
+		sub->m_numberOfFloatTracks = nFloats;
+		sub->m_transforms.setSize(nTransforms * n);
+		sub->m_floats.setSize(nFloats * n);
+		std::copy(raw.m_transforms.begin() + first * nTransforms, raw.m_transforms.begin() + (last + 1) * nTransforms,
+			sub->m_transforms.begin());
+		std::copy(raw.m_floats.begin() + first * nFloats, raw.m_floats.begin() + (last + 1) * nFloats,
+			sub->m_floats.begin());
+
+		compressStage.keys(static_cast<long long>(nTransforms + nFloats) * n);
+		hkRefPtr<hkaSplineCompressedAnimation> encoded = new hkaSplineCompressedAnimation(*sub, tcp, acp);
+		encoded->removeReference();
+
+		if (encoded->m_numBlocks != 1 || encoded->m_endian != base->m_endian
+			|| encoded->m_maskAndQuantizationSize != base->m_maskAndQuantizationSize)
+			return -1;
+
+		blocks[b] = getBlock(*encoded, 0);
+		reencoded[b] = true;
+		count++;
+	}
+	compressStage.end();
+
+	if (count == 0)
+		return 0;
+
+	//Put the blocks back together
+	for (int b = 0; b < nBlocks; b++) {
+		if (!reencoded[b])
+			blocks[b] = getBlock(*base, b);
+	}
+
+	std::vector<hkUint8> data;
+	for (int b = 0; b < nBlocks; b++) {
+		data.resize((data.size() + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT, 0);
+		base->m_blockOffsets[b] = static_cast<hkUint32>(data.size());
+		base->m_floatBlockOffsets[b] = blocks[b].floatOffset;
+		data.insert(data.end(), blocks[b].data.begin(), blocks[b].data.end());
+
+		std::copy(blocks[b].transformOffsets.begin(), blocks[b].transformOffsets.end(),
+			base->m_transformOffsets.begin() + b * nTransforms);
+		std::copy(blocks[b].floatOffsets.begin(), blocks[b].floatOffsets.end(),
+			base->m_floatOffsets.begin() + b * nFloats);
+	}
+	base->m_data.setSize(static_cast<int>(data.size()));
+	std::copy(data.begin(), data.end(), base->m_data.begin());
+
+	return count;
+}
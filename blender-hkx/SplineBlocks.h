@@ -0,0 +1,17 @@
+#pragma once
+#include "common.h"
+
+namespace iohkx
+{
+	//A spline-compressed animation is made of blocks of frames that are encoded
+	//independently (neighbouring blocks share their first and last frame).
+	//Update base in place to the keys of raw, re-encoding only the blocks that
+	//no longer reproduce them within tolerance and keeping the rest byte for byte.
+	//base must have the same tracks and frames as raw and have been made with the
+	//same parameters, which the caller has to make sure of (only the block layout
+	//is checked here). Returns the number of blocks re-encoded, or -1 if base
+	//doesn't fit raw (and is left as it was).
+	int reencodeChangedBlocks(hkaSplineCompressedAnimation* base, const hkaInterleavedUncompressedAnimation& raw,
+		const hkaSplineCompressedAnimation::TrackCompressionParams& tcp,
+		const hkaSplineCompressedAnimation::AnimationCompressionParams& acp);
+}
@@ -3,6 +3,105 @@
 
 using namespace iohkx;
 
+Clip& iohkx::addClip(AnimationData& data, const std::vector<Skeleton*>& skeletons)
+{
+	assert(!skeletons.empty());
+	return addClip(data, data.clips.empty() ? skeletons.front() : skeletons.back());
+}
+
+Clip& iohkx::addClip(AnimationData& data, const Skeleton* skeleton)
+{
+	assert(skeleton);
+
+	data.clips.push_back(Clip());
+	Clip& clip = data.clips.back();
+	clip.skeleton = skeleton;
+
+	//Reserve memory for tracks
+	clip.rootTransform = new BoneTrack;
+	clip.boneTracks = new BoneTrack[clip.skeleton->nBones];
+	clip.floatTracks = new FloatTrack[clip.skeleton->nFloats];
+	clip.boneMap.resize(clip.skeleton->nBones, nullptr);
+	clip.floatMap.resize(clip.skeleton->nFloats, nullptr);
+
+	return clip;
+}
+
+BoneTrack* iohkx::addBoneTrack(Clip& clip, const char* name)
+{
+	assert(clip.skeleton && name);
+
+	BoneTrack* track = nullptr;
+	if (strcmp(name, ROOT_BONE) == 0) {
+		//this is the root bone
+		track = clip.rootTransform;
+		track->target = clip.skeleton->rootBone;
+	}
+	else {
+		//look for this bone in the skeleton
+		const Bone* bone = clip.skeleton->boneIndex.find(name);
+		if (bone) {
+			//This bone is driven by Havok. Use the next available track for it.
+			track = &clip.boneTracks[clip.nBoneTracks];
+			track->target = bone;
+			clip.boneMap[bone->index] = track;
+
+			clip.nBoneTracks++;
+		}
+		//else ignore
+	}
+
+	return track;
+}
+
+FloatTrack* iohkx::addFloatTrack(Clip& clip, const char* name)
+{
+	assert(clip.skeleton && name);
+
+	FloatTrack* track = nullptr;
+
+	//look for this float in the skeleton
+	const Float* slot = clip.skeleton->floatIndex.find(name);
+	if (slot) {
+		track = &clip.floatTracks[clip.nFloatTracks];
+		track->target = slot;
+		clip.floatMap[slot->index] = track;
+
+		clip.nFloatTracks++;
+	}
+	//else ignore
+
+	return track;
+}
+
+const BoneTrack* iohkx::trackOf(const Clip& clip, const Bone* bone)
+{
+	if (bone->index < 0)
+		return clip.rootTransform;
+	return bone->index < static_cast<int>(clip.boneMap.size()) ? clip.boneMap[bone->index] : nullptr;
+}
+
+hkQsTransform iohkx::boneKey(const BoneTrack* track, int f)
+{
+	if (!track || track->keys.isEmpty())
+		return hkQsTransform(hkQsTransform::IDENTITY);
+	return track->keys[std::min(f, track->keys.getSize() - 1)];
+}
+
+void iohkx::bonePoses(const Bone* bone, const Clip& clip, int f, const hkQsTransform& T,
+	std::vector<hkQsTransform>& parent, std::vector<hkQsTransform>& object)
+{
+	int i = bone->index >= 0 ? bone->index : clip.skeleton->nBones;
+
+	hkQsTransform key = boneKey(trackOf(clip, bone), f);
+	parent[i].setMul(bone->refPose, key);
+	object[i].setMul(T, parent[i]);
+
+	for (auto&& child : bone->children) {
+		bonePoses(child, clip, f, object[i], parent, object);
+	}
+}
+
 //Is this skeleton a HORSE?
 static bool isHorse(const Skeleton* skeleton)
 {
@@ -17,77 +116,16 @@ static bool isHorse(const Skeleton* skeleton)
 	return false;
 }
 
-//Find the (clip index, bone) from an annotation name
-static std::pair<int, Bone*> findBone(const char* name, const std::vector<Clip>& clips)
+//Find the cached table for this pair of skeletons, or build it in tmp
+static const PairedTable& getPairedTable(
+	const Skeleton* primary, const Skeleton* secondary, PairedTable& tmp)
 {
-	//This is made a lot harder than it should be, because of horses. Thanks, horses.
-
-	if (std::strcmp(name, "PairedRoot") == 0) {
-		//This is not an actual track (?)
-		return { -1, nullptr };
-	}
-
-	//Drop the "2_" prefix, if any, and pick out special cases
-	int clip;//clip index
-
-	if (std::strncmp(name, "2_", 2) == 0) {
-		//Look in secondary skeleton, without the prefix
-		name += 2;
-		clip = 1;
-
-		//If "2_" is the full name, this is a special case
-		if (*name == '\0') {
-			//this name seems to have multiple possible meanings
-			//if this is a HORSE, this is "NPC Root [Root]"
-			//else it is the root bone
-
-			if (isHorse(clips[clip].skeleton)) {
-				//find "NPC Root [Root]". Should be the first bone.
-				for (int i = 0; i < clips[clip].skeleton->nBones; i++) {
-					if (clips[clip].skeleton->bones[i].name == "NPC Root [Root]") {
-						return { clip, &clips[clip].skeleton->bones[i] };
-					}
-				}
-				//unexpected
-				return { -1, nullptr };
-			}
-			else {
-				return { clip, clips[clip].skeleton->rootBone };
-			}
-		}
-		//Also, the name "2_Horse" is unusual
-		else if (std::strcmp(name, "Horse") == 0) {
-			//Horses are stupid?
-			//This is the root bone
-			return { clip, clips[clip].skeleton->rootBone };
-		}
-	}
-	else if (std::strcmp(name, "SaddleBone") == 0) {
-		//Another special case? This belongs to secondary actor (a HORSE)
-		clip = 1;
-	}
-	else {
-		//Look in primary skeleton
-		clip = 0;
-
-		if (std::strcmp(name, "NPC") == 0) {
-			//Root bone
-			return { clip, clips[clip].skeleton->rootBone };
-		}
-	}
-	//Regular case, search skeleton
-	auto it = clips[clip].skeleton->boneIndex.find(name);
-	if (it != clips[clip].skeleton->boneIndex.end()) {
-		return { clip, it->second };
-	}
-	else {
-		//This bone is not in the skeleton.
-		//I would have considered this evidence of a mismatched skeleton,
-		//but it seems horses are weird.
-		return { clip, nullptr };
-	}
+	auto it = primary->pairedTables.find(secondary);
+	if (it != primary->pairedTables.end())
+		return *it->second;
 
-	return { -1, nullptr };
+	tmp.build(primary, secondary);
+	return tmp;
 }
 
 static bool mapBonesIfMissing(int n, const Clip& clip, hkArray<hkInt16>& target)
@@ -130,32 +168,74 @@ static bool mapFloatsIfMissing(int n, const Clip& clip, hkArray<hkInt16>& target
 	return result;
 }
 
-//Set the appropriate annotation name, depending on the type of actor
-static void setSecondaryName(
-	const std::string& name,
-	const Skeleton* skeleton,
-	hkaAnnotationTrack& annotation)
+void iohkx::PairedTable::build(const Skeleton* primary, const Skeleton* secondary)
 {
-	if (name == "NPC Root [Root]" && isHorse(skeleton)) {
-		annotation.m_trackName = "2_";
+	assert(primary && secondary);
+
+	//This is made a lot harder than it should be, because of horses. Thanks, horses.
+	bool horse = isHorse(secondary);
+
+	tracks.clear();
+
+	//Annotation names, depending on the type of actor
+	names[0].resize(primary->nBones + 1);
+	for (int i = 0; i < primary->nBones; i++) {
+		names[0][i] = primary->bones[i].name;
 	}
-	else {
-		annotation.m_trackName.printf("2_%s", name.c_str());
+	names[0][primary->nBones] = ROOT_BONE;
+
+	names[1].resize(secondary->nBones + 1);
+	m_keys.resize(secondary->nBones);
+	for (int i = 0; i < secondary->nBones; i++) {
+		m_keys[i] = "2_" + secondary->bones[i].name;
+		if (horse && secondary->bones[i].name == "NPC Root [Root]")
+			names[1][i] = "2_";
+		else
+			names[1][i] = m_keys[i];
 	}
-}
+	names[1][secondary->nBones] = horse ? "2_Horse" : "2_";
 
-//Set the appropriate annotation name, depending on the type of actor
-static void setSecondaryRootName(
-	const std::string& name,
-	const Skeleton* skeleton,
-	hkaAnnotationTrack& annotation)
-{
-	if (isHorse(skeleton)) {
-		annotation.m_trackName = "2_Horse";
+	//Then the lookup. With duplicate bone names the last one wins, like in 
+	//NameIndex. Special cases go last, since they replace bone names.
+	//"PairedRoot" is not an actual track (?), so we leave it out.
+
+	//Secondary actor, with the "2_" prefix
+	for (int i = 0; i < secondary->nBones; i++) {
+		tracks[m_keys[i]] = std::make_pair(1, i);
+
+		//Another special case? This belongs to secondary actor (a HORSE), without prefix
+		if (secondary->bones[i].name == "SaddleBone")
+			tracks["SaddleBone"] = std::make_pair(1, i);
+	}
+
+	//Primary actor
+	for (int i = 0; i < primary->nBones; i++) {
+		const std::string& name = primary->bones[i].name;
+		//these names would have been looked up in the secondary skeleton
+		if (std::strncmp(name.c_str(), "2_", 2) != 0 && name != "SaddleBone")
+			tracks[name] = std::make_pair(0, i);
+	}
+	tracks[ROOT_BONE] = std::make_pair(0, -1);
+
+	//If "2_" is the full name, this is a special case.
+	//If this is a HORSE, it is "NPC Root [Root]", else it is the root bone.
+	if (horse) {
+		tracks.erase("2_");
+		for (int i = secondary->nBones - 1; i >= 0; i--) {
+			if (secondary->bones[i].name == "NPC Root [Root]") {
+				tracks["2_"] = std::make_pair(1, i);
+				break;
+			}
+		}
 	}
 	else {
-		annotation.m_trackName = "2_";
+		tracks["2_"] = std::make_pair(1, -1);
 	}
+	//Also, the name "2_Horse" is unusual. Horses are stupid? This is the root bone.
+	tracks["2_Horse"] = std::make_pair(1, -1);
+
+	//Any other name is not in the skeleton. I would have considered this evidence 
+	//of a mismatched skeleton, but it seems horses are weird.
 }
 
 bool iohkx::TrackPacker::map(const AnimationData& data, 
@@ -203,6 +283,9 @@ bool iohkx::TrackPacker::paired(const AnimationData& data,
 	animation->m_annotationTracks.setSize(nBones);
 	auto&& annotations = animation->m_annotationTracks;
 
+	PairedTable tmp;
+	const PairedTable& table = getPairedTable(primary.skeleton, secondary.skeleton, tmp);
+
 	//Bones and annotations
 
 	//PairedRoot (has neither track nor bone)
@@ -216,7 +299,7 @@ bool iohkx::TrackPacker::paired(const AnimationData& data,
 	// root
 	m_bones[1].first = primary.rootTransform;
 	m_bones[1].second = primary.skeleton->rootBone;
-	annotations[1].m_trackName = ROOT_BONE;
+	annotations[1].m_trackName = table.names[0][primary.skeleton->nBones].c_str();
 	int current = 2;
 	//annotations go to bone 0
 	m_annotationTracks[0] = current;
@@ -224,7 +307,7 @@ bool iohkx::TrackPacker::paired(const AnimationData& data,
 	for (int i = 0; i < primary.skeleton->nBones; i++) {
 		m_bones[current].first = primary.boneMap[i];
 		m_bones[current].second = &primary.skeleton->bones[i];
-		annotations[current].m_trackName = m_bones[current].second->name.c_str();
+		annotations[current].m_trackName = table.names[0][i].c_str();
 		++current;
 	}
 	// addenda
@@ -239,8 +322,7 @@ bool iohkx::TrackPacker::paired(const AnimationData& data,
 	// root
 	m_bones[current].first = secondary.rootTransform;
 	m_bones[current].second = secondary.skeleton->rootBone;
-	setSecondaryRootName(secondary.skeleton->rootBone->name,
-		secondary.skeleton, annotations[current]);
+	annotations[current].m_trackName = table.names[1][secondary.skeleton->nBones].c_str();
 	++current;
 	//annotations go to bone 0
 	m_annotationTracks[1] = current;
@@ -248,8 +330,7 @@ bool iohkx::TrackPacker::paired(const AnimationData& data,
 	for (int i = 0; i < secondary.skeleton->nBones; i++) {
 		m_bones[current].first = secondary.boneMap[i];
 		m_bones[current].second = &secondary.skeleton->bones[i];
-		setSecondaryName(secondary.skeleton->bones[i].name,
-			secondary.skeleton, annotations[current]);
+		annotations[current].m_trackName = table.names[1][i].c_str();
 		++current;
 	}
 	// addenda
@@ -372,64 +453,47 @@ bool iohkx::TrackUnpacker::paired(AnimationData& data, const std::vector<Skeleto
 
 	//Identify target bone by annotations
 	//We'll do bone name lookup to map track index to a bone
+	PairedTable tmp;
+	const PairedTable& table = getPairedTable(primary.skeleton, secondary.skeleton, tmp);
+
 	std::vector<std::pair<int, Bone*>> maps[2];//(track, bone)
 	maps[0].reserve(animation->m_numberOfTransformTracks);
 	maps[1].reserve(animation->m_numberOfTransformTracks);
 
-	std::pair<int, Bone*> roots[2]{ { -1, nullptr }, { -1, nullptr } };
+	for (int i = 0; i < animation->m_numberOfTransformTracks; i++) {
+		//get (clip index, bone index) by name
+		const char* name = animation->m_annotationTracks[i].m_trackName.cString();
+		if (!name)
+			continue;
+
+		auto it = table.tracks.find(name);
+		if (it == table.tracks.end())
+			//Either not an actual track, or a bone that is not in the skeleton.
+			//Horse anims will get here. What to do? Do we create this bone?
+			//Ignore it for now.
+			continue;
+
+		Clip& clip = data.clips[it->second.first];
+		const Bone* target = it->second.second == -1 ? 
+			clip.skeleton->rootBone : &clip.skeleton->bones[it->second.second];
+		//the annotations are in bone 0 of the primary skeleton (?)
+		if (target == &primary.skeleton->bones[0]) {
+			m_annotationClip = 0;
+			m_annotationTrack = i;
+		}
 
-	//std::vector<std::pair<int, Bone*>> addenda[2];
+		if (!included(target->name))
+			continue;
 
-	for (int i = 0; i < animation->m_numberOfTransformTracks; i++) {
-		//get (clip index, bone) by name
-		auto&& name = animation->m_annotationTracks[i].m_trackName;
-		auto pair = findBone(name.cString(), data.clips);
-
-		if (pair.first == 0 || pair.first == 1) {
-			Clip& clip = data.clips[pair.first];
-			if (pair.second) {
-				//We found a bone
-				if (pair.second == clip.skeleton->rootBone) {
-
-					//store the root immediately
-					assert(!clip.rootTransform);
-					clip.rootTransform = new BoneTrack;
-					clip.rootTransform->target = clip.skeleton->rootBone;
-					m_bones[i] = clip.rootTransform;
-				}
-				else {
-					maps[pair.first].push_back({ i, pair.second });
-
-					//the annotations are in bone 0 of the primary skeleton (?)
-					if (pair.second == &primary.skeleton->bones[0]) {
-						m_annotationClip = 0;
-						m_annotationTrack = i;
-					}
-				}
-			}
-			else {
-				//This has been assigned to one of the clips, but it has no bone.
-				//Horse anims will get here. What to do? Do we create this bone?
-				//Ignore it?
-
-				//Create an addendum to the skeleton
-				//auto&& addenda = m_data.clips[pair.first].addenda;
-				//addenda.push_back(Addendum());
-				//addenda.back().bone = std::make_unique<Bone>();
-				//get rid of the prefix
-				//const char* p = name.cString();
-				//if (std::strncmp(name, "2_", 2) == 0) {
-				//	p += 2;
-				//}
-				//addenda.back().bone->name = p;
-				//addenda.back().bone->refPose.setIdentity();
-				//addenda.back().bone->refPoseObj.setIdentity();
-
-				//addenda.back().track = std::make_unique<BoneTrack>();
-				//addenda.back().track->target = addenda.back().bone.get();
-
-				//bones[i] = addenda.back().track.get();
-			}
+		if (it->second.second == -1) {
+			//store the root immediately
+			assert(!clip.rootTransform);
+			clip.rootTransform = new BoneTrack;
+			clip.rootTransform->target = clip.skeleton->rootBone;
+			m_bones[i] = clip.rootTransform;
+		}
+		else {
+			maps[it->second.first].push_back({ i, &clip.skeleton->bones[it->second.second] });
 		}
 	}
 
@@ -481,7 +545,7 @@ bool iohkx::TrackUnpacker::paired(AnimationData& data, const std::vector<Skeleto
 	}
 
 	if (validFloats) {
-		primary.nFloatTracks = nFloats;
+		primary.nFloatTracks = 0;
 		primary.floatTracks = new FloatTrack[nFloats];
 		primary.floatMap.resize(primary.skeleton->nFloats, nullptr);
 
@@ -489,9 +553,13 @@ bool iohkx::TrackUnpacker::paired(AnimationData& data, const std::vector<Skeleto
 		for (int i = 0; i < nFloats; i++) {
 			int index = missingFloats ? binding->m_floatTrackToFloatSlotIndices[i] : i;
 
-			primary.floatTracks[i].target = &primary.skeleton->floats[index];
+			Float* target = &primary.skeleton->floats[index];
+			if (included(target->name)) {
+				FloatTrack* track = &primary.floatTracks[primary.nFloatTracks++];
+				track->target = target;
 
-			m_floats[i] = &primary.floatTracks[i];
+				m_floats[i] = track;
+			}
 		}
 	}
 
@@ -521,63 +589,45 @@ bool iohkx::TrackUnpacker::single(AnimationData& data, const std::vector<Skeleto
 	//Point it to its skeleton
 	clip.skeleton = skeletons[0];
 
-	//Allocate the tracks
-	clip.nBoneTracks = m_bones.size();
-	clip.boneTracks = new BoneTrack[clip.nBoneTracks];
+	//Allocate the tracks (we may not need all of them)
+	clip.nBoneTracks = 0;
+	clip.boneTracks = new BoneTrack[m_bones.size()];
 	//we don't need this map here
 	//clip.boneMap.resize(clip.skeleton->nBones, nullptr);
 
-	clip.nFloatTracks = m_floats.size();
-	clip.floatTracks = new FloatTrack[clip.nFloatTracks];
+	clip.nFloatTracks = 0;
+	clip.floatTracks = new FloatTrack[m_floats.size()];
 	//clip.floatMap.resize(clip.skeleton->nFloats, nullptr);
 
-	//Assign the track targets
-	if (binding->m_transformTrackToBoneIndices.isEmpty()) {
-		//The tracks should map 1:1 with the skeleton
-		for (int i = 0; i < clip.nBoneTracks; i++) {
-			clip.boneTracks[i].target = &skeletons[0]->bones[i];
-			//clip.boneMap[i] = &clip.boneTracks[i];
-		}
-		//The annotations should be in track 0
-		m_annotationTrack = 0;
-	}
-	else {
-		//Map from the binding
-		for (int i = 0; i < clip.nBoneTracks; i++) {
-			int index = binding->m_transformTrackToBoneIndices[i];
-			Bone* bone = &skeletons[0]->bones[index];
-			clip.boneTracks[i].target = bone;
-			//clip.boneMap[bone->index] = &clip.boneTracks[i];
-
-			//if we run into bone 0, we know where the annotations are
-			if (bone->index == 0) {
-				m_annotationTrack = i;
-			}
-		}
-	}
-	if (binding->m_floatTrackToFloatSlotIndices.isEmpty()) {
-		//The tracks should map 1:1 with the skeleton
-		for (int i = 0; i < clip.nFloatTracks; i++) {
-			clip.floatTracks[i].target = &skeletons[0]->floats[i];
-			//clip.floatMap[i] = &clip.floatTracks[i];
+	//Assign the track targets and do the final mapping.
+	//If there is no binding, the tracks should map 1:1 with the skeleton.
+	bool mapBones = !binding->m_transformTrackToBoneIndices.isEmpty();
+	for (int i = 0; i < (int)m_bones.size(); i++) {
+		int index = mapBones ? binding->m_transformTrackToBoneIndices[i] : i;
+		Bone* bone = &skeletons[0]->bones[index];
+
+		//if we run into bone 0, we know where the annotations are
+		if (bone->index == 0) {
+			m_annotationTrack = i;
 		}
-	}
-	else {
-		//Map from the binding
-		for (int i = 0; i < clip.nFloatTracks; i++) {
-			int index = binding->m_floatTrackToFloatSlotIndices[i];
-			Float* flt = &skeletons[0]->floats[index];
-			clip.floatTracks[i].target = &skeletons[0]->floats[index];
-			//clip.floatMap[flt->index] = &clip.floatTracks[i];
+
+		if (included(bone->name)) {
+			BoneTrack* track = &clip.boneTracks[clip.nBoneTracks++];
+			track->target = bone;
+			m_bones[i] = track;
 		}
 	}
 
-	//Do the final mapping (in this case just a copy of the track list)
-	for (int i = 0; i < clip.nBoneTracks; i++) {
-		m_bones[i] = &clip.boneTracks[i];
-	}
-	for (int i = 0; i < clip.nFloatTracks; i++) {
-		m_floats[i] = &clip.floatTracks[i];
+	bool mapFloats = !binding->m_floatTrackToFloatSlotIndices.isEmpty();
+	for (int i = 0; i < (int)m_floats.size(); i++) {
+		int index = mapFloats ? binding->m_floatTrackToFloatSlotIndices[i] : i;
+		Float* flt = &skeletons[0]->floats[index];
+
+		if (included(flt->name)) {
+			FloatTrack* track = &clip.floatTracks[clip.nFloatTracks++];
+			track->target = flt;
+			m_floats[i] = track;
+		}
 	}
 
 	return true;
@@ -1,10 +1,53 @@
 #pragma once
+#include <set>
 #include <utility>
 #include <vector>
 #include "common.h"
 
 namespace iohkx
 {
+	//Everything we need to map the tracks of a paired animation to a pair of 
+	//skeletons, resolved once per pair so that mapping involves no string work.
+	//Holds views into its own strings, so it can't be copied.
+	struct PairedTable
+	{
+		PairedTable() {}
+		PairedTable(const PairedTable&) = delete;
+		PairedTable& operator=(const PairedTable&) = delete;
+
+		void build(const Skeleton* primary, const Skeleton* secondary);
+
+		//annotation name -> (clip index, bone index), where -1 is the root bone
+		std::unordered_map<std::string_view, std::pair<int, int>> tracks;
+		//annotation names to write for each clip, by bone index (root bone last)
+		std::vector<std::string> names[2];
+
+	private:
+		//lookup keys of the secondary bones, if they differ from their names
+		std::vector<std::string> m_keys;
+	};
+
+	//Add a clip for the next animation in data. Tracks can then be added to it by name.
+	//We don't have any real policy for skeleton names, so the first clip gets 
+	//the first skeleton and the second clip gets the last skeleton.
+	Clip& addClip(AnimationData& data, const std::vector<Skeleton*>& skeletons);
+	//Add a clip of skeleton to data
+	Clip& addClip(AnimationData& data, const Skeleton* skeleton);
+	//Add a track to the named bone (or the root bone), or return null if there is none
+	BoneTrack* addBoneTrack(Clip& clip, const char* name);
+	//Add a track to the named float slot, or return null if there is none
+	FloatTrack* addFloatTrack(Clip& clip, const char* name);
+
+	//The track of bone in clip, or null if it has none
+	const BoneTrack* trackOf(const Clip& clip, const Bone* bone);
+	//Key of a bone-space track at frame f (tracks that never change only keep one key)
+	hkQsTransform boneKey(const BoneTrack* track, int f);
+	//Parent- and object-space poses of bone and its descendants at frame f, from the
+	//bone-space keys of clip. T is the object-space pose of the parent. The poses are
+	//by bone index, with the root last.
+	void bonePoses(const Bone* bone, const Clip& clip, int f, const hkQsTransform& T,
+		std::vector<hkQsTransform>& parent, std::vector<hkQsTransform>& object);
+
 	//Gather all the logic for sorting out animation tracks here, so the decoder
 	//doesn't need to worry about that.
 	class TrackPacker
@@ -36,6 +79,9 @@ namespace iohkx
 		int m_annotationClip{ -1 };
 		int m_annotationTrack{ -1 };
 
+		//If not empty, only the tracks of these bones and floats will be mapped
+		std::set<std::string> m_include;
+
 	public:
 		bool map(AnimationData& data, const std::vector<Skeleton*>& skeletons,
 			const hkaAnimation* animation, const hkaAnimationBinding* binding);
@@ -45,5 +91,10 @@ namespace iohkx
 			const hkaAnimation* animation, const hkaAnimationBinding* binding);
 		bool single(AnimationData& data, const std::vector<Skeleton*>& skeletons,
 			const hkaAnimation* animation, const hkaAnimationBinding* binding);
+
+		bool included(const std::string& name) const
+		{
+			return m_include.empty() || m_include.find(name) != m_include.end();
+		}
 	};
 }
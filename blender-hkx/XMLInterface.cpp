@@ -1,5 +1,7 @@
 #include "pch.h"
 #include "XMLInterface.h"
+#include "Profiler.h"
+#include "TrackMapper.h"
 
 #define DATA_VERSION 1
 
@@ -81,113 +83,27 @@ static const char* reads(pugi::xml_node node, const char* name)
 	return "";
 }
 
-static void readFloatTrack(pugi::xml_node node, iohkx::AnimationData& data)
-{
-	Clip& clip = data.clips.back();
-
-	assert(clip.skeleton);
-
-	FloatTrack* track = nullptr;
-
-	//look for this float in the skeleton
-	auto it = clip.skeleton->floatIndex.find(node.attribute("name").value());
-	if (it != clip.skeleton->floatIndex.end()) {
-		track = &clip.floatTracks[clip.nFloatTracks];
-		track->target = it->second;
-		clip.floatMap[it->second->index] = track;
-
-		clip.nFloatTracks++;
-	}
-	//else ignore
-
-	if (track) {
-		//Add keys
-		track->keys.reserve(data.frames);
-		for (xml_node key = node.child(TYPE_FLOAT); key; key = key.next_sibling(TYPE_FLOAT)) {
-			track->keys.pushBack(key.first_child().text().as_float(track->target->refValue));
-		}
-	}
-}
-
-static void readTransformTrack(pugi::xml_node node, iohkx::AnimationData& data)
-{
-	Clip& clip = data.clips.back();
-
-	assert(clip.skeleton);
-
-	BoneTrack* track = nullptr;
-	if (strcmp(node.attribute("name").value(), ROOT_BONE) == 0) {
-		//this is the root bone
-		track = clip.rootTransform;
-		track->target = clip.skeleton->rootBone;
-	}
-	else {
-		//look for this bone in the skeleton
-		auto it = clip.skeleton->boneIndex.find(node.attribute("name").value());
-		if (it != clip.skeleton->boneIndex.end()) {
-			//This bone is driven by Havok. Use the next available track for it.
-			track = &clip.boneTracks[clip.nBoneTracks];
-			track->target = it->second;
-			clip.boneMap[it->second->index] = track;
-
-			clip.nBoneTracks++;
-		}
-		//else ignore
-	}
-
-	if (track) {
-		//Add keys
-		track->keys.reserve(data.frames);
-		for (xml_node key = node.child(TYPE_TRANSFORM); key; key = key.next_sibling(TYPE_TRANSFORM)) {
-
-			float raw[10];
-			strToVec<10>(key.child_value(), raw);
-
-			//This transform is in object space
-			hkVector4 loc(raw[0], raw[1], raw[2]);
-			hkQuaternion rot(raw[4], raw[5], raw[6], raw[3]);
-			hkVector4 scl(raw[7], raw[8], raw[9]);
-
-			//Convert to parent space:
-			//left multiply by the inverse of the parent bone's current pose
-
-			//Which means that we must either do this in Blender, or have Blender
-			//ensure that the bones are exported in descending order (which we don't!).
-
-			//Or do it in a separate loop after this one. <- this
-
-			track->keys.pushBack(hkQsTransform(loc, rot, scl));
-		}
-	}
-}
-
 static void readAnimation(
 	pugi::xml_node node,
 	const std::vector<Skeleton*>& skeletons,
-	iohkx::AnimationData& data)
+	iohkx::AnimationData& data,
+	std::unordered_map<const void*, pugi::xml_node>& tracks)
 {
-	//We don't have any real policy for skeleton names. 
-	//Just do: first clip->first skeleton, second clip->last skeleton
-	data.clips.push_back(Clip());
-	Clip& clip = data.clips.back();
-	clip.skeleton = data.clips.size() == 1 ? skeletons.front() : skeletons.back();
-
-	//Reserve memory for tracks
-	clip.rootTransform = new BoneTrack;
-	clip.boneTracks = new BoneTrack[clip.skeleton->nBones];
-	clip.floatTracks = new FloatTrack[clip.skeleton->nFloats];
-	clip.boneMap.resize(clip.skeleton->nBones, nullptr);
-	clip.floatMap.resize(clip.skeleton->nFloats, nullptr);
+	Clip& clip = addClip(data, skeletons);
 
 	//read tracks
 	for (xml_node t = node.child(NODE_TRACK); t; t = t.next_sibling(NODE_TRACK)) {
 		xml_attribute type = t.attribute("type");
+		const void* track = nullptr;
 		if (strcmp(type.value(), TYPE_TRANSFORM) == 0) {
-			readTransformTrack(t, data);
+			track = addBoneTrack(clip, t.attribute("name").value());
 		}
 		else if (strcmp(type.value(), TYPE_FLOAT) == 0) {
-			readFloatTrack(t, data);
+			track = addFloatTrack(clip, t.attribute("name").value());
 		}
+		//remember where the keys are
+		if (track)
+			tracks[track] = t;
 	}
 
 	//read annotations
@@ -312,13 +228,40 @@ void iohkx::XMLInterface::read(
 	const std::vector<Skeleton*>& skeletons,
 	AnimationData& data)
 {
-	xml_document doc;
-	xml_parse_result result = doc.load_file(fileName);
+	open(fileName, skeletons, data);
+
+	//Add keys
+	ProfileScope stage("XML keys");
+	for (auto&& clip : data.clips) {
+		auto readAll = [this, &data](auto* track) {
+			track->keys.setSize(data.frames);
+			track->keys.setSize(readKeys(track, track->keys.begin(), 1, data.frames));
+		};
+
+		if (m_tracks.find(clip.rootTransform) != m_tracks.end())
+			readAll(clip.rootTransform);
+		for (int i = 0; i < clip.nBoneTracks; i++)
+			readAll(&clip.boneTracks[i]);
+		for (int i = 0; i < clip.nFloatTracks; i++)
+			readAll(&clip.floatTracks[i]);
+	}
+}
+
+void iohkx::XMLInterface::open(
+	const char* fileName,
+	const std::vector<Skeleton*>& skeletons,
+	AnimationData& data)
+{
+	m_tracks.clear();
+
+	ProfileScope stage("XML parse");
+	stage.bytesIn(Profiler::fileSize(fileName));
+	xml_parse_result result = m_doc.load_file(fileName);
 	if (result.status != status_ok) {
 		throw Exception(ERR_INVALID_INPUT, "Failed to load XML");
 	}
 
-	xml_node root = doc.child(NODE_FILE);
+	xml_node root = m_doc.child(NODE_FILE);
 	if (root) {
 		if (root.attribute("version").as_int(-1) == 1) {
 			data.frames = readi(root, ATTR_FRAMES);
@@ -328,7 +271,7 @@ void iohkx::XMLInterface::read(
 			for (xml_node clip = root.child(NODE_ANIMATION);
 				clip;
 				clip = clip.next_sibling(NODE_ANIMATION)) {
-				readAnimation(clip, skeletons, data);
+				readAnimation(clip, skeletons, data, m_tracks);
 			}
 		}
 		else
@@ -336,19 +279,75 @@ void iohkx::XMLInterface::read(
 	}
 }
 
-void iohkx::XMLInterface::write(
-	const AnimationData& data, const char* fileName)
+std::vector<std::vector<Annotation>> iohkx::XMLInterface::readAnnotations(const char* fileName)
 {
+	assert(fileName);
+
+	ProfileScope stage("XML parse");
+	stage.bytesIn(Profiler::fileSize(fileName));
+
 	xml_document doc;
-	//Add declaration
-	xml_node decl = doc.append_child(node_declaration);
-	decl.append_attribute("version").set_value("1.0");
-	decl.append_attribute("encoding").set_value("UTF-8");
+	if (doc.load_file(fileName).status != status_ok)
+		throw Exception(ERR_INVALID_INPUT, "Failed to load XML");
 
-	//Add root element
-	xml_node root = doc.append_child(NODE_FILE);
-	root.append_attribute("version").set_value(DATA_VERSION);
+	std::vector<std::vector<Annotation>> result;
+	xml_node root = doc.child(NODE_FILE);
+	if (root) {
+		if (root.attribute("version").as_int(-1) != 1)
+			throw Exception(ERR_INVALID_INPUT, "Unknown version");
+
+		for (xml_node clip = root.child(NODE_ANIMATION); clip; clip = clip.next_sibling(NODE_ANIMATION)) {
+			result.emplace_back();
+			for (xml_node a = clip.child(NODE_ANNOTATION); a; a = a.next_sibling(NODE_ANNOTATION)) {
+				result.back().push_back({ readi(a, ATTR_FRAME), reads(a, ATTR_TEXT) });
+			}
+		}
+	}
+	return result;
+}
 
+int iohkx::XMLInterface::readKeys(const BoneTrack* track, hkQsTransform* dst, int stride, int count)
+{
+	auto it = m_tracks.find(track);
+	if (it == m_tracks.end())
+		return 0;
+
+	int n = 0;
+	for (xml_node key = it->second.child(TYPE_TRANSFORM);
+		key && n < count;
+		key = key.next_sibling(TYPE_TRANSFORM)) {
+
+		float raw[10];
+		strToVec<10>(key.child_value(), raw);
+
+		//This transform is in object space.
+		//It will be converted to parent space once all tracks have been read.
+		hkQsTransform& T = dst[n++ * stride];
+		T.m_translation.set(raw[0], raw[1], raw[2]);
+		T.m_rotation.m_vec.set(raw[4], raw[5], raw[6], raw[3]);
+		T.m_scale.set(raw[7], raw[8], raw[9]);
+	}
+	return n;
+}
+
+int iohkx::XMLInterface::readKeys(const FloatTrack* track, hkReal* dst, int stride, int count)
+{
+	auto it = m_tracks.find(track);
+	if (it == m_tracks.end())
+		return 0;
+
+	int n = 0;
+	for (xml_node key = it->second.child(TYPE_FLOAT);
+		key && n < count;
+		key = key.next_sibling(TYPE_FLOAT)) {
+		dst[n++ * stride] = key.first_child().text().as_float(track->target->refValue);
+	}
+	return n;
+}
+
+//Add the shared attributes and skeleton elements
+static void appendShared(pugi::xml_node root, const AnimationData& data)
+{
 	//Add shared attributes
 	appendi(root, ATTR_FRAMES, data.frames);
 	appendi(root, ATTR_FRAMERATE, data.frameRate);
@@ -384,20 +383,45 @@ void iohkx::XMLInterface::write(
 			appendFloatSlot(skeleton, &data.clips[i].skeleton->floats[slot]);
 		}
 	}
+}
+
+//Add an animation element, without any tracks or annotations
+static pugi::xml_node appendAnimation(pugi::xml_node root, const Clip& clip, int index)
+{
+	//Insert animation element
+	xml_node anim = root.append_child(NODE_ANIMATION);
+	//Set name attribute to animation index
+	char buf[8];
+	sprintf_s(buf, sizeof(buf), "%d", index);
+	anim.append_attribute("name").set_value(buf);
+
+	appends(anim, ATTR_SKELETON, clip.skeleton->name.c_str());
+	appends(anim, ATTR_REFERENCE_FRAME, REF_INDEX[clip.refFrame]);
+
+	return anim;
+}
+
+void iohkx::XMLInterface::write(
+	const AnimationData& data, const char* fileName)
+{
+	ProfileScope buildStage("XML build");
+	xml_document doc;
+	//Add declaration
+	xml_node decl = doc.append_child(node_declaration);
+	decl.append_attribute("version").set_value("1.0");
+	decl.append_attribute("encoding").set_value("UTF-8");
+
+	//Add root element
+	xml_node root = doc.append_child(NODE_FILE);
+	root.append_attribute("version").set_value(DATA_VERSION);
+
+	appendShared(root, data);
 
 	//Animations
 	for (unsigned int i = 0; i < data.clips.size(); i++) {
 		const Clip& clip = data.clips[i];
 
-		//Insert animation element
-		xml_node anim = root.append_child(NODE_ANIMATION);
-		//Set name attribute to animation index
-		char buf[8];
-		sprintf_s(buf, sizeof(buf), "%d", i);
-		anim.append_attribute("name").set_value(buf);
-
-		appends(anim, ATTR_SKELETON, clip.skeleton->name.c_str());
-		appends(anim, ATTR_REFERENCE_FRAME, REF_INDEX[clip.refFrame]);
+		xml_node anim = appendAnimation(root, clip, i);
 
 		//Bone tracks
 		if (clip.rootTransform) {
@@ -421,5 +445,307 @@ void iohkx::XMLInterface::write(
 		}
 	}
 
+	buildStage.end();
+
+	ProfileScope writeStage("XML write");
 	doc.save_file(fileName);
+	writeStage.bytesOut(Profiler::fileSize(fileName));
+}
+
+//Floats per key in the temp store
+constexpr int TRANSFORM_SIZE = 10;
+
+//Write a string as an XML attribute value
+static void writeEscaped(FILE* file, const char* str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+		case '&':
+			fputs("&amp;", file);
+			break;
+		case '<':
+			fputs("&lt;", file);
+			break;
+		case '>':
+			fputs("&gt;", file);
+			break;
+		case '"':
+			fputs("&quot;", file);
+			break;
+		default:
+			fputc(*str, file);
+		}
+	}
+}
+
+iohkx::XMLStreamWriter::XMLStreamWriter(const char* fileName) : 
+	m_fileName(fileName), m_tmpName(m_fileName + ".keys")
+{
+}
+
+iohkx::XMLStreamWriter::~XMLStreamWriter()
+{
+	stopSpilling();
+	if (m_tmp) {
+		fclose(m_tmp);
+		std::remove(m_tmpName.c_str());
+	}
+}
+
+void iohkx::XMLStreamWriter::begin(const AnimationData& data)
+{
+	//Keep the tracks in the order we will write them
+	m_transforms.clear();
+	m_floats.clear();
+	for (auto&& clip : data.clips) {
+		if (clip.rootTransform)
+			m_transforms.push_back(clip.rootTransform);
+		for (int t = 0; t < clip.nBoneTracks; t++)
+			m_transforms.push_back(&clip.boneTracks[t]);
+		for (int t = 0; t < clip.nFloatTracks; t++)
+			m_floats.push_back(&clip.floatTracks[t]);
+	}
+	m_blockSize = 0;
+	m_blocks.clear();
+	m_blockEnd = 0;
+	m_first.assign(m_transforms.size() * TRANSFORM_SIZE + m_floats.size(), 0.0f);
+	m_constant.assign(m_transforms.size() + m_floats.size(), true);
+	//(root tracks are always written in full, like the decoder does)
+	for (unsigned int t = 0; t < m_transforms.size(); t++) {
+		if (std::any_of(data.clips.begin(), data.clips.end(), 
+			[&](const Clip& clip) { return m_transforms[t] == clip.rootTransform; }))
+			m_constant[t] = false;
+	}
+
+	//Blocks go to a temp file as soon as we have them, while the next one is decoded
+	if (fopen_s(&m_tmp, m_tmpName.c_str(), "w+b") != 0 || !m_tmp)
+		throw Exception(ERR_WRITE_FAIL, "Failed to create temp file");
+
+	m_done = false;
+	m_failed = false;
+	m_thread = std::thread(&XMLStreamWriter::spill, this);
+}
+
+void iohkx::XMLStreamWriter::writeBlock(int first, int count)
+{
+	assert(count > 0);
+
+	//Stage the keys in the order they will be stored
+	std::vector<float> block;
+	block.reserve(count * (m_transforms.size() * TRANSFORM_SIZE + m_floats.size()));
+	for (unsigned int t = 0; t < m_transforms.size(); t++) {
+		for (int f = 0; f < count; f++) {
+			const hkQsTransform& key = m_transforms[t]->keys[f];
+
+			hkVector4 v = key.getTranslation();
+			block.push_back(v(0));
+			block.push_back(v(1));
+			block.push_back(v(2));
+
+			//store Blender format
+			hkQuaternion q = key.getRotation();
+			block.push_back(q(3));
+			block.push_back(q(0));
+			block.push_back(q(1));
+			block.push_back(q(2));
+
+			v = key.getScale();
+			block.push_back(v(0));
+			block.push_back(v(1));
+			block.push_back(v(2));
+
+			//If all keys are equal, we'll keep only one
+			float* k = &block[block.size() - TRANSFORM_SIZE];
+			float* first = &m_first[t * TRANSFORM_SIZE];
+			if (m_blockEnd == 0 && f == 0)
+				std::copy(k, k + TRANSFORM_SIZE, first);
+			else if (m_constant[t] && !std::equal(k, k + TRANSFORM_SIZE, first))
+				m_constant[t] = false;
+		}
+	}
+	for (unsigned int t = 0; t < m_floats.size(); t++) {
+		int index = m_transforms.size() + t;
+		float& first = m_first[m_transforms.size() * TRANSFORM_SIZE + t];
+		for (int f = 0; f < count; f++) {
+			float k = m_floats[t]->keys[f];
+			block.push_back(k);
+
+			if (m_blockEnd == 0 && f == 0)
+				first = k;
+			else if (m_constant[index] && k != first)
+				m_constant[index] = false;
+		}
+	}
+
+	assert(first == m_blockEnd);
+	m_blockEnd += count;
+	if (m_blockSize == 0)
+		m_blockSize = count;
+
+	m_blocks.push_back({ m_blocks.empty() ? 0 : 
+		m_blocks.back().first + m_blocks.back().second * 
+		(long long)(m_transforms.size() * TRANSFORM_SIZE + m_floats.size()) * sizeof(float), count });
+
+	//Wait for room in the queue. Two blocks is enough to keep the writer busy.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cv.wait(lock, [this]() { return m_queue.size() < 2 || m_failed; });
+	if (m_failed)
+		throw Exception(ERR_WRITE_FAIL, "Failed to write temp file");
+
+	m_queue.push_back(std::move(block));
+	m_cv.notify_all();
+}
+
+void iohkx::XMLStreamWriter::end(const AnimationData& data)
+{
+	stopSpilling();
+	if (m_failed || fflush(m_tmp) != 0)
+		throw Exception(ERR_WRITE_FAIL, "Failed to write temp file");
+
+	ProfileScope stage("XML write");
+
+	FILE* file;
+	if (fopen_s(&file, m_fileName.c_str(), "wb") != 0 || !file)
+		throw Exception(ERR_WRITE_FAIL, "Failed to open output file");
+
+	xml_writer_file writer(file);
+
+	//We want the same output as XMLInterface::write, so the small parts are
+	//built and formatted by pugixml. Only the keys are formatted by us.
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", file);
+	fprintf(file, "<%s version=\"%d\">\n", NODE_FILE, DATA_VERSION);
+
+	xml_document doc;
+	xml_node root = doc.append_child(NODE_FILE);
+	appendShared(root, data);
+	for (xml_node n = root.first_child(); n; n = n.next_sibling()) {
+		n.print(writer, "\t", format_default, encoding_auto, 1);
+	}
+
+	std::vector<float> buf(m_blockSize * TRANSFORM_SIZE);
+	unsigned int transform = 0;
+	unsigned int flt = 0;
+	for (unsigned int i = 0; i < data.clips.size(); i++) {
+		const Clip& clip = data.clips[i];
+
+		xml_node anim = appendAnimation(root, clip, i);
+		fprintf(file, "\t<%s name=\"%d\">\n", NODE_ANIMATION, i);
+		for (xml_node n = anim.first_child(); n; n = n.next_sibling()) {
+			n.print(writer, "\t", format_default, encoding_auto, 2);
+		}
+
+		//Bone tracks (root first, in the order we stored them)
+		int nTransforms = clip.nBoneTracks + (clip.rootTransform ? 1 : 0);
+		for (int t = 0; t < nTransforms; t++, transform++) {
+			fprintf(file, "\t\t<%s name=\"", NODE_TRACK);
+			writeEscaped(file, m_transforms[transform]->target->name.c_str());
+			fprintf(file, "\" type=\"%s\">\n", TYPE_TRANSFORM);
+
+			int frame = 0;
+			for (auto&& block : m_blocks) {
+				int count = m_constant[transform] ? 1 : block.second;
+				readBack(block.first + 
+					(long long)transform * block.second * TRANSFORM_SIZE * sizeof(float),
+					buf.data(), count * TRANSFORM_SIZE);
+
+				for (int f = 0; f < count; f++, frame++) {
+					const float* k = &buf[f * TRANSFORM_SIZE];
+					fprintf(file, "\t\t\t<%s name=\"%d\">%g %g %g %g %g %g %g %g %g %g</%s>\n",
+						TYPE_TRANSFORM, frame, 
+						k[0], k[1], k[2], k[3], k[4], k[5], k[6], k[7], k[8], k[9], 
+						TYPE_TRANSFORM);
+				}
+				if (m_constant[transform])
+					break;
+			}
+
+			fprintf(file, "\t\t</%s>\n", NODE_TRACK);
+		}
+
+		//Float tracks
+		for (int t = 0; t < clip.nFloatTracks; t++, flt++) {
+			fprintf(file, "\t\t<%s name=\"", NODE_TRACK);
+			writeEscaped(file, m_floats[flt]->target->name.c_str());
+			fprintf(file, "\" type=\"%s\">\n", TYPE_FLOAT);
+
+			int index = m_transforms.size() + flt;
+			int frame = 0;
+			for (auto&& block : m_blocks) {
+				int count = m_constant[index] ? 1 : block.second;
+				readBack(block.first + ((long long)m_transforms.size() * TRANSFORM_SIZE + flt) *
+					block.second * sizeof(float), buf.data(), count);
+
+				for (int f = 0; f < count; f++, frame++) {
+					fprintf(file, "\t\t\t<%s name=\"%d\">%g</%s>\n", 
+						TYPE_FLOAT, frame, buf[f], TYPE_FLOAT);
+				}
+				if (m_constant[index])
+					break;
+			}
+
+			fprintf(file, "\t\t</%s>\n", NODE_TRACK);
+		}
+
+		//Annotations
+		for (auto&& anno : clip.annotations) {
+			appendAnnotation(anim, anno);
+		}
+		for (xml_node n = anim.child(NODE_ANNOTATION); n; n = n.next_sibling(NODE_ANNOTATION)) {
+			n.print(writer, "\t", format_default, encoding_auto, 2);
+		}
+
+		fprintf(file, "\t</%s>\n", NODE_ANIMATION);
+	}
+
+	fprintf(file, "</%s>\n", NODE_FILE);
+
+	bool failed = ferror(file) != 0;
+	fclose(file);
+	if (failed)
+		throw Exception(ERR_WRITE_FAIL, "Failed to write output file");
+
+	stage.bytesOut(Profiler::fileSize(m_fileName.c_str()));
+}
+
+void iohkx::XMLStreamWriter::spill()
+{
+	while (true) {
+		std::vector<float> block;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return !m_queue.empty() || m_done; });
+			if (m_queue.empty())
+				return;
+
+			block = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		//(the lock is released while we write)
+		bool ok = fwrite(block.data(), sizeof(float), block.size(), m_tmp) == block.size();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!ok)
+			m_failed = true;
+		m_cv.notify_all();
+	}
+}
+
+void iohkx::XMLStreamWriter::stopSpilling()
+{
+	if (m_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done = true;
+			m_cv.notify_all();
+		}
+		m_thread.join();
+	}
+}
+
+void iohkx::XMLStreamWriter::readBack(long long offset, float* dst, int count)
+{
+	if (_fseeki64(m_tmp, offset, SEEK_SET) != 0 
+		|| fread(dst, sizeof(float), count, m_tmp) != (size_t)count)
+		throw Exception(ERR_READ_FAIL, "Failed to read temp file");
 }
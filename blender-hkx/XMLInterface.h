@@ -3,12 +3,71 @@
 
 namespace iohkx
 {
-	class XMLInterface
+	class XMLInterface : public KeySource
 	{
 	public:
 		XMLInterface() {}
 
 		void read(const char* fileName, const std::vector<Skeleton*>& skeletons, AnimationData& data);
 		void write(const AnimationData& data, const char* fileName);
+
+		//Read everything but the keys. The file stays open until the next call
+		//to open or read, so that the keys can be read later.
+		void open(const char* fileName, const std::vector<Skeleton*>& skeletons, AnimationData& data);
+
+		//Only the annotations of each animation in a file. Needs no skeleton.
+		static std::vector<std::vector<Annotation>> readAnnotations(const char* fileName);
+
+		virtual int readKeys(const BoneTrack* track, hkQsTransform* dst, int stride, int count) override;
+		virtual int readKeys(const FloatTrack* track, hkReal* dst, int stride, int count) override;
+
+	private:
+		pugi::xml_document m_doc;
+		//the element of each track we have read
+		std::unordered_map<const void*, pugi::xml_node> m_tracks;
+	};
+
+	//Writes the same format as XMLInterface, but receives the keys a block of
+	//frames at a time. Blocks are kept in a temp file until all keys are in,
+	//then each track is written in turn.
+	class XMLStreamWriter : public KeySink
+	{
+	public:
+		XMLStreamWriter(const char* fileName);
+		~XMLStreamWriter();
+
+		virtual void begin(const AnimationData& data) override;
+		virtual void writeBlock(int first, int count) override;
+		virtual void end(const AnimationData& data) override;
+
+	private:
+		//runs on a separate thread, writing queued blocks to the temp file
+		void spill();
+		void stopSpilling();
+		void readBack(long long offset, float* dst, int count);
+
+	private:
+		std::string m_fileName;
+		std::string m_tmpName;
+		FILE* m_tmp{ nullptr };
+
+		std::vector<const BoneTrack*> m_transforms;
+		std::vector<const FloatTrack*> m_floats;
+
+		//first key of each track, and whether all keys so far are equal to it
+		std::vector<float> m_first;
+		std::vector<bool> m_constant;
+
+		//(offset in temp file, frames) of each block
+		std::vector<std::pair<long long, int>> m_blocks;
+		int m_blockSize{ 0 };
+		int m_blockEnd{ 0 };
+
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		std::deque<std::vector<float>> m_queue;
+		bool m_done{ false };
+		bool m_failed{ false };
 	};
 }
@@ -2,7 +2,15 @@
 
 #include "common.h"
 #include "AnimationDecoder.h"
+#include "AnimationDiff.h"
+#include "AnnotationPatch.h"
+#include "Bench.h"
+#include "ContentHash.h"
+#include "ConversionCache.h"
+#include "DirectoryWatcher.h"
 #include "HKXInterface.h"
+#include "Profiler.h"
+#include "Retarget.h"
 #include "SkeletonLoader.h"
 #include "XMLInterface.h"
 
@@ -10,6 +18,66 @@ using namespace iohkx;
 
 constexpr const char* VERSION_STR = "0.1.0";
 
+//Options are given as "--name" or "--name=value" anywhere after the command.
+//Anything else is a positional argument.
+struct Options
+{
+	std::vector<char*> args;
+	std::multimap<std::string, std::string> values;
+
+	Options(int argc, char* const* argv)
+	{
+		for (int i = 0; i < argc; i++) {
+			if (std::strncmp(argv[i], "--", 2) == 0) {
+				const char* name = argv[i] + 2;
+				const char* eq = std::strchr(name, '=');
+				if (eq)
+					values.insert({ std::string(name, eq), std::string(eq + 1) });
+				else
+					values.insert({ std::string(name), std::string() });
+			}
+			else
+				args.push_back(argv[i]);
+		}
+	}
+
+	bool has(const char* name) const { return values.find(name) != values.end(); }
+
+	const char* get(const char* name, const char* def = nullptr) const
+	{
+		auto it = values.find(name);
+		return it != values.end() ? it->second.c_str() : def;
+	}
+
+	//Every value of an option that can be given more than once, in order
+	std::vector<std::string> getAll(const char* name) const
+	{
+		std::vector<std::string> result;
+		auto range = values.equal_range(name);
+		for (auto it = range.first; it != range.second; ++it)
+			result.push_back(it->second);
+		return result;
+	}
+};
+
+//Split a comma-separated list
+static std::vector<std::string> splitList(const char* str)
+{
+	std::vector<std::string> result;
+	if (str) {
+		for (const char* p = str; ; p++) {
+			if (*p == ',' || *p == '\0') {
+				if (p != str)
+					result.push_back(std::string(str, p));
+				if (*p == '\0')
+					break;
+				str = p + 1;
+			}
+		}
+	}
+	return result;
+}
+
 void about()
 {
 	std::cout << '\n';
@@ -28,12 +96,134 @@ Havok software is Copyright 2020 Microsoft. All rights reserved.\n\n";
 pugixml is Copyright 2006-2019 Arseny Kapoulkine.\n";
 }
 
-void unpack(int argc, char* const* argv)
+//Set the output format of hkx from a format specifier (WIN32, AMD64 or XML)
+static void setFormat(HKXInterface& hkx, const char* format)
+{
+	if (_stricmp(format, "WIN32") == 0) {
+		hkx.m_options.layout = LAYOUT_WIN32;
+	}
+	else if (_stricmp(format, "XML") == 0) {
+		hkx.m_options.textFormat = true;
+	}
+	else {
+		hkx.m_options.layout = LAYOUT_AMD64;
+	}
+}
+
+//Number of threads to use, from --jobs (default: one per core)
+static int jobCount(const Options& opts)
+{
+	int jobs = opts.has("jobs") ? std::atoi(opts.get("jobs")) : static_cast<int>(std::thread::hardware_concurrency());
+	if (opts.has("jobs") && jobs < 1)
+		throw Exception(ERR_INVALID_ARGS, "Invalid number of jobs");
+	return std::max(jobs, 1);
+}
+
+//Outputs are written to this file next to them first, so that they are never
+//left half written and can also be the input
+static std::filesystem::path tempName(const std::filesystem::path& output)
+{
+	std::filesystem::path tmp = output;
+	tmp += ".tmp";
+	return tmp;
+}
+
+//Replace output with tmp
+static void moveIntoPlace(const std::filesystem::path& tmp, const std::filesystem::path& output)
+{
+	std::error_code err;
+	std::filesystem::rename(tmp, output, err);
+	if (err) {
+		std::filesystem::remove(tmp, err);
+		throw Exception(ERR_WRITE_FAIL, "Failed to write output file");
+	}
+}
+
+//Save anim to output by way of its temp file
+static void saveAtomically(HKXInterface& hkx, hkaAnimationContainer* anim, const std::filesystem::path& output)
+{
+	std::filesystem::path tmp = tempName(output);
+	ProfileScope saveStage("Havok save");
+	hkx.save(anim, tmp.string().c_str());
+	saveStage.bytesOut(Profiler::fileSize(tmp.string().c_str()));
+	saveStage.end();
+
+	moveIntoPlace(tmp, output);
+}
+
+//Print the messages of the files that failed (empty for those that didn't),
+//then throw code with msg if there were any
+static void reportFailures(const std::vector<std::string>& failed, ErrorCode code, const char* msg)
+{
+	bool any = false;
+	for (auto&& item : failed) {
+		if (!item.empty()) {
+			std::cerr << "Failed: " << item << '\n';
+			any = true;
+		}
+	}
+	if (any)
+		throw Exception(code, msg);
+}
+
+//<stem>_<i><ext> of fileName
+static std::string numberedName(const char* fileName, int i)
+{
+	std::filesystem::path path(fileName);
+	std::filesystem::path result = path.parent_path() / path.stem();
+	result += "_" + std::to_string(i);
+	result += path.extension();
+	return result.string();
+}
+
+//Decompress one animation of anim to fileName, as given by the unpack options
+static void unpackAnimation(const Options& opts, hkaAnimationContainer* anim,
+	const SkeletonLoader& skeletons, int binding, const char* fileName)
+{
+	AnimationDecoder animation;
+	animation.m_options.binding = binding;
+	for (auto&& name : splitList(opts.get("bones"))) {
+		animation.m_options.tracks.insert(name);
+	}
+	if (opts.has("frames")) {
+		std::vector<std::string> range = splitList(opts.get("frames"));
+		if (range.size() != 2)
+			throw Exception(ERR_INVALID_ARGS, "Invalid frame range");
+		animation.m_options.firstFrame = std::atoi(range[0].c_str());
+		animation.m_options.lastFrame = std::atoi(range[1].c_str());
+	}
+
+	if (opts.has("stream")) {
+		//keep only a block of frames in memory at a time
+		const char* block = opts.get("stream");
+		if (*block)
+			animation.m_options.blockSize = std::atoi(block);
+
+		XMLStreamWriter writer(fileName);
+		animation.decompress(anim, skeletons.get(), &writer);
+	}
+	else {
+		animation.decompress(anim, skeletons.get());
+
+		XMLInterface xml;
+		xml.write(animation.get(), fileName);
+	}
+}
+
+void unpack(const Options& opts)
 {
 	//args
 	//1. hkx file name
 	//2. output xml
 	//3+. skeleton(s)
+	//options
+	//--bones=<name>,<name>...	only output these bones (and float slots)
+	//--frames=<first>,<last>	only output this frame range (counting from 0)
+	//--stream[=<frames>]		decode and write this many frames at a time (default 64)
+	//--all				unpack every animation in the file, the nth to <output>_<n>.xml
+	//--jobs=<n>			unpack this many animations at a time (default one per core)
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
 	if (argc >= 3) {
 		HavokEngine engine;
 		HKXInterface hkx;
@@ -41,78 +231,1196 @@ void unpack(int argc, char* const* argv)
 		SkeletonLoader skeletons;
 
 		for (int i = 0; i < argc - 2; i++) {
-			hkRefPtr<hkaAnimationContainer> res = hkx.load(argv[i + 2]);
-			if (res)
-				skeletons.load(res.val());
+			skeletons.load(argv[i + 2], hkx);
 		}
 		if (skeletons.empty())
 			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
 
+		ProfileScope loadStage("Havok load");
+		loadStage.bytesIn(Profiler::fileSize(argv[0]));
 		hkRefPtr<hkaAnimationContainer> anim = hkx.load(argv[0]);
+		loadStage.end();
 
-		AnimationDecoder animation;
-		animation.decompress(anim, skeletons.get());
+		if (opts.has("all")) {
+			//The animations share the file and skeletons, but nothing else
+			int count = anim ? anim->m_bindings.getSize() : 0;
+			if (count == 0)
+				throw Exception(ERR_INVALID_INPUT, "No animation found");
 
-		XMLInterface xml;
-		xml.write(animation.get(), argv[1]);
+			parallelFor(count, jobCount(opts), [&](int i) {
+				unpackAnimation(opts, anim, skeletons, i, numberedName(argv[1], i).c_str());
+			});
+		}
+		else
+			unpackAnimation(opts, anim, skeletons, 0, argv[1]);
 	}
 	else
 		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
 }
 
-void pack(int argc, char* const* argv)
+//Compression settings from the encoding options of pack and watch:
+//--encoding=<name>		spline (default), interleaved (uncompressed), delta or wavelet
+//--tolerance=<t>,<r>,<s>,<f>	largest error of translations, rotations, scales and floats
+//--block=<frames>		frames per block
+//--quantisation=<t>,<r>,<s>,<f>	spline: bits of translations, scales and floats (8 or 16)
+//				and rotations (24, 32 (polar), 40, 48, 16 (straight) or 128 (none))
+//--degree=<n>			spline: degree of the curves
+//--single-tracks		spline: allow sampling tracks one at a time
+//--quantisation=<bits>		delta and wavelet: bits per coefficient
+//--preserve=<n>, --truncation=<p>	wavelet: coefficients kept and the share truncated
+//--filter=<name>		smooth the keys first: lowpass or savgol (Savitzky-Golay)
+//--filter-radius=<frames>	frames on either side a key is smoothed over (default 2)
+//--filter-degree=<n>		savgol: degree of the polynomial (default 2)
+//--filter-cap=<t>,<r>,<s>,<f>	furthest smoothing may move a key (default half the tolerances).
+//				The encoder gets what's left of the tolerances.
+static CompressionSettings compressionOptions(const Options& opts)
+{
+	using Rotation = CompressionSettings::RotationQuantization;
+	using Scalar = CompressionSettings::ScalarQuantization;
+
+	CompressionSettings settings;
+
+	if (opts.has("encoding")) {
+		const char* encoding = opts.get("encoding");
+		if (_stricmp(encoding, "spline") == 0)
+			settings.encoding = ENCODING_SPLINE;
+		else if (_stricmp(encoding, "interleaved") == 0)
+			settings.encoding = ENCODING_INTERLEAVED;
+		else if (_stricmp(encoding, "delta") == 0)
+			settings.encoding = ENCODING_DELTA;
+		else if (_stricmp(encoding, "wavelet") == 0)
+			settings.encoding = ENCODING_WAVELET;
+		else
+			throw Exception(ERR_INVALID_ARGS, "Unknown encoding");
+	}
+
+	if (opts.has("tolerance")) {
+		std::vector<std::string> values = splitList(opts.get("tolerance"));
+		if (values.size() != 4)
+			throw Exception(ERR_INVALID_ARGS, "Tolerances are given as <t>,<r>,<s>,<f>");
+		settings.translationTolerance = static_cast<float>(std::atof(values[0].c_str()));
+		settings.rotationTolerance = static_cast<float>(std::atof(values[1].c_str()));
+		settings.scaleTolerance = static_cast<float>(std::atof(values[2].c_str()));
+		settings.floatTolerance = static_cast<float>(std::atof(values[3].c_str()));
+		if (settings.translationTolerance < 0.0f || settings.rotationTolerance < 0.0f
+			|| settings.scaleTolerance < 0.0f || settings.floatTolerance < 0.0f)
+			throw Exception(ERR_INVALID_ARGS, "Invalid tolerance");
+	}
+
+	if (opts.has("block")) {
+		settings.framesPerBlock = std::atoi(opts.get("block"));
+		if (settings.framesPerBlock < 1 || settings.framesPerBlock > 0xffff)
+			throw Exception(ERR_INVALID_ARGS, "Invalid block size");
+	}
+
+	if (opts.has("quantisation")) {
+		std::vector<std::string> values = splitList(opts.get("quantisation"));
+		if (settings.encoding == ENCODING_SPLINE) {
+			if (values.size() != 4)
+				throw Exception(ERR_INVALID_ARGS, "Spline quantisation is given as <t>,<r>,<s>,<f>");
+
+			auto scalar = [](const std::string& bits) {
+				if (bits == "8")
+					return Scalar::BITS8;
+				else if (bits == "16")
+					return Scalar::BITS16;
+				else
+					throw Exception(ERR_INVALID_ARGS, "Invalid quantisation");
+			};
+			settings.translationQuantization = scalar(values[0]);
+			settings.scaleQuantization = scalar(values[2]);
+			settings.floatQuantization = scalar(values[3]);
+
+			static const std::map<std::string, Rotation> ROTATIONS{
+				{ "24", Rotation::THREECOMP24 },
+				{ "32", Rotation::POLAR32 },
+				{ "40", Rotation::THREECOMP40 },
+				{ "48", Rotation::THREECOMP48 },
+				{ "16", Rotation::STRAIGHT16 },
+				{ "128", Rotation::UNCOMPRESSED } };
+			auto it = ROTATIONS.find(values[1]);
+			if (it == ROTATIONS.end())
+				throw Exception(ERR_INVALID_ARGS, "Invalid quantisation");
+			settings.rotationQuantization = it->second;
+		}
+		else {
+			if (values.size() != 1)
+				throw Exception(ERR_INVALID_ARGS, "Quantisation is given as <bits>");
+			settings.quantizationBits = std::atoi(values[0].c_str());
+			if (settings.quantizationBits < 1 || settings.quantizationBits > 16)
+				throw Exception(ERR_INVALID_ARGS, "Invalid quantisation");
+		}
+	}
+
+	if (opts.has("degree")) {
+		settings.degree = std::atoi(opts.get("degree"));
+		if (settings.degree < 1)
+			throw Exception(ERR_INVALID_ARGS, "Invalid degree");
+	}
+	settings.sampleSingleTracks = opts.has("single-tracks");
+
+	if (opts.has("preserve")) {
+		settings.preserve = std::atoi(opts.get("preserve"));
+		if (settings.preserve < 0)
+			throw Exception(ERR_INVALID_ARGS, "Invalid number of coefficients to preserve");
+	}
+	if (opts.has("truncation")) {
+		settings.truncation = static_cast<float>(std::atof(opts.get("truncation")));
+		if (settings.truncation < 0.0f || settings.truncation > 1.0f)
+			throw Exception(ERR_INVALID_ARGS, "Invalid truncation");
+	}
+
+	if (opts.has("filter")) {
+		const char* filter = opts.get("filter");
+		if (_stricmp(filter, "lowpass") == 0)
+			settings.filter = FILTER_LOWPASS;
+		else if (_stricmp(filter, "savgol") == 0)
+			settings.filter = FILTER_SAVITZKY_GOLAY;
+		else
+			throw Exception(ERR_INVALID_ARGS, "Unknown filter");
+	}
+	if (opts.has("filter-radius")) {
+		settings.filterRadius = std::atoi(opts.get("filter-radius"));
+		if (settings.filterRadius < 1)
+			throw Exception(ERR_INVALID_ARGS, "Invalid filter radius");
+	}
+	if (opts.has("filter-degree")) {
+		settings.filterDegree = std::atoi(opts.get("filter-degree"));
+		if (settings.filterDegree < 0)
+			throw Exception(ERR_INVALID_ARGS, "Invalid filter degree");
+	}
+	if (settings.filter == FILTER_SAVITZKY_GOLAY && settings.filterDegree >= 2 * settings.filterRadius)
+		throw Exception(ERR_INVALID_ARGS, "Filter degree must be less than twice the radius");
+	if (opts.has("filter-cap")) {
+		std::vector<std::string> values = splitList(opts.get("filter-cap"));
+		if (values.size() != 4)
+			throw Exception(ERR_INVALID_ARGS, "Filter caps are given as <t>,<r>,<s>,<f>");
+		settings.translationCap = static_cast<float>(std::atof(values[0].c_str()));
+		settings.rotationCap = static_cast<float>(std::atof(values[1].c_str()));
+		settings.scaleCap = static_cast<float>(std::atof(values[2].c_str()));
+		settings.floatCap = static_cast<float>(std::atof(values[3].c_str()));
+		if (settings.translationCap < 0.0f || settings.rotationCap < 0.0f
+			|| settings.scaleCap < 0.0f || settings.floatCap < 0.0f)
+			throw Exception(ERR_INVALID_ARGS, "Invalid filter cap");
+		if (settings.translationCap > settings.translationTolerance || settings.rotationCap > settings.rotationTolerance
+			|| settings.scaleCap > settings.scaleTolerance || settings.floatCap > settings.floatTolerance)
+			throw Exception(ERR_INVALID_ARGS, "Filter caps can't be larger than the tolerances");
+	}
+
+	return settings;
+}
+
+//Compress the animation(s) of an interchange file, starting from base if given.
+//reused is set to the number of blocks of the base that were kept (-1 if none),
+//unfiltered to the size it would have been without smoothing (-1 if not smoothed).
+static hkRefPtr<hkaAnimationContainer> compressFile(const char* fileName, const SkeletonLoader& skeletons,
+	const CompressionSettings& settings, hkaAnimationBinding* base = nullptr, int* reused = nullptr,
+	int* unfiltered = nullptr)
+{
+	AnimationDecoder animation;
+	animation.m_options.compression = settings;
+	animation.m_options.base = base;
+	animation.m_options.measureFilter = unfiltered != nullptr;
+
+	//Only read the structure of the file first, then let the decoder
+	//read the keys straight into the raw animation
+	XMLInterface xml;
+	xml.open(fileName, skeletons.get(), animation.get());
+
+	hkRefPtr<hkaAnimationContainer> result = animation.compress(&xml);
+	if (reused)
+		*reused = animation.reusedBlocks();
+	if (unfiltered)
+		*unfiltered = animation.unfilteredSize();
+	return result;
+}
+
+//The settings an output was compressed with are kept next to it, since they
+//can't be told from the animation
+static std::string settingsFileName(const std::string& output)
+{
+	return output + ".settings";
+}
+
+static void saveSettings(const std::string& output, const CompressionSettings& settings)
+{
+	std::ofstream out(settingsFileName(output), std::ios::trunc);
+	out << settings.describe() << '\n';
+	if (!out)
+		throw Exception(ERR_WRITE_FAIL, "Failed to write settings file");
+}
+
+//The container of an earlier output to start from, if there is one and it was
+//compressed with the same settings
+static hkRefPtr<hkaAnimationContainer> loadBase(HKXInterface& hkx, const char* fileName,
+	const CompressionSettings& settings)
+{
+	std::error_code err;
+	if (!std::filesystem::is_regular_file(fileName, err))
+		return hkRefPtr<hkaAnimationContainer>();
+
+	std::string made;
+	std::ifstream in(settingsFileName(fileName));
+	std::getline(in, made);
+	if (made != settings.describe()) {
+		if (made.empty())
+			std::cerr << fileName << ": settings unknown, not used as a base\n";
+		else
+			std::cerr << fileName << ": made with other settings (" << made << "), not used as a base\n";
+		return hkRefPtr<hkaAnimationContainer>();
+	}
+
+	ProfileScope loadStage("Havok load (base)");
+	loadStage.bytesIn(Profiler::fileSize(fileName));
+	return hkx.load(fileName);
+}
+
+void pack(const Options& opts)
 {
 	//args
 	//1. format specifier
 	//2. input xml
 	//3. output file name
 	//4+. skeleton(s)
+	//options
+	//--cache=<dir>		reuse the output of a previous run with identical inputs
+	//--cache-size=<MB>	evict least recently used outputs past this size (default 1024)
+	//--inputs=<xml>,<xml>...	more input xml, packed into the same file as the first
+	//--separate		pack each input to its own file instead, the nth to <output>_<n>.hkx
+	//--jobs=<n>		compress this many inputs at a time (default one per core)
+	//--base[=<hkx>]	update an earlier output (default the output file itself), only
+	//			compressing the spline blocks whose keys have changed. The base
+	//			must have been made with the same settings, as its .settings file says.
+	//--report		also time sampling each new animation
+	//and the encoding options of compressionOptions.
+	//The size of each new animation is printed (and, if smoothed, the size it would
+	//have had without). With --base, the settings go to <output>.settings.
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
 	if (argc >= 4) {
+		const char* layout = _stricmp(argv[0], "WIN32") == 0 ? "WIN32" :
+			_stricmp(argv[0], "XML") == 0 ? "XML" : "AMD64";
+
+		CompressionSettings settings = compressionOptions(opts);
+
+		std::vector<std::string> inputs{ argv[1] };
+		for (auto&& input : splitList(opts.get("inputs"))) {
+			inputs.push_back(input);
+		}
+		int nInputs = static_cast<int>(inputs.size());
+
+		//Each output gets the inputs in [first, last)
+		struct Output
+		{
+			std::string fileName;
+			int first;
+			int last;
+			std::string key;
+			bool done{ false };
+		};
+		std::vector<Output> outputs;
+		if (opts.has("separate")) {
+			for (int i = 0; i < nInputs; i++)
+				outputs.push_back({ numberedName(argv[2], i), i, i + 1 });
+		}
+		else
+			outputs.push_back({ argv[2], 0, nInputs });
+
+		//Look for previous outputs before we start up Havok
+		std::unique_ptr<ConversionCache> cache;
+		if (opts.has("cache")) {
+			long long size = std::atoll(opts.get("cache-size", "1024"));
+			if (!*opts.get("cache") || size <= 0)
+				throw Exception(ERR_INVALID_ARGS, "Invalid cache options");
+			cache = std::make_unique<ConversionCache>(opts.get("cache"), size * 1024 * 1024);
+
+			for (auto&& output : outputs) {
+				ProfileScope hashStage("Hash inputs");
+				ContentHash hash;
+				hash.add(VERSION_STR);
+				hash.add(layout);
+				hash.add(settings.describe());
+				for (int i = output.first; i < output.last; i++)
+					hash.addFile(inputs[i].c_str());
+				//(the output may come out slightly different if we start from a base)
+				if (opts.has("base")) {
+					const char* base = *opts.get("base") ? opts.get("base") : output.fileName.c_str();
+					std::error_code err;
+					if (std::filesystem::is_regular_file(base, err))
+						hash.addFile(base);
+					if (std::filesystem::is_regular_file(settingsFileName(base), err))
+						hash.addFile(settingsFileName(base).c_str());
+				}
+				//(output name is not an input)
+				for (int i = 3; i < argc; i++)
+					hash.addFile(argv[i]);
+				output.key = hash.hex();
+				hashStage.end();
+
+				output.done = cache->fetch(output.key, output.fileName.c_str());
+				if (output.done && opts.has("base"))
+					saveSettings(output.fileName, settings);
+			}
+			if (std::all_of(outputs.begin(), outputs.end(), [](const Output& o) { return o.done; })) {
+				cache->printStats(std::cout);
+				return;
+			}
+		}
+
 		HavokEngine engine;
 		HKXInterface hkx;
 
 		SkeletonLoader skeleton;
 
 		for (int i = 0; i < argc - 3; i++) {
-			hkRefPtr<hkaAnimationContainer> res = hkx.load(argv[i + 3]);
-			if (res)
-				skeleton.load(res.val());
+			skeleton.load(argv[i + 3], hkx);
 		}
 		if (skeleton.empty())
 			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
 
-		AnimationDecoder animation;
+		//(the cache isn't safe to share between threads)
+		std::mutex cacheMutex;
 
-		XMLInterface xml;
-		xml.read(argv[1], skeleton.get(), animation.get());
+		auto save = [&](hkaAnimationContainer* anim, const Output& output) {
+			HKXInterface writer;
+			setFormat(writer, layout);
+			ProfileScope saveStage("Havok save");
+			writer.save(anim, output.fileName.c_str());
+			saveStage.bytesOut(Profiler::fileSize(output.fileName.c_str()));
+			saveStage.end();
+			if (opts.has("base"))
+				saveSettings(output.fileName, settings);
 
-		hkRefPtr<hkaAnimationContainer> anim = animation.compress();
+			if (cache) {
+				std::lock_guard<std::mutex> lock(cacheMutex);
+				cache->store(output.key, output.fileName.c_str());
+			}
+		};
 
-		if (_stricmp(argv[0], "WIN32") == 0) {
-			hkx.m_options.layout = LAYOUT_WIN32;
+		//Compress the inputs we still need concurrently. Separate outputs are
+		//saved as soon as they are done, the rest are merged and saved once.
+		std::vector<int> todo;
+		for (auto&& output : outputs) {
+			for (int i = output.first; !output.done && i < output.last; i++)
+				todo.push_back(i);
 		}
-		else if (_stricmp(argv[0], "XML") == 0) {
-			hkx.m_options.textFormat = true;
+		std::vector<hkRefPtr<hkaAnimationContainer>> anims(nInputs);
+
+		//Earlier outputs to start from, and which of their bindings each input gets
+		std::vector<hkRefPtr<hkaAnimationContainer>> bases(outputs.size());
+		std::vector<hkaAnimationBinding*> baseBindings(nInputs, nullptr);
+		std::vector<int> reused(nInputs, -1);
+		std::vector<int> unfiltered(nInputs, -1);
+		if (opts.has("base")) {
+			if (*opts.get("base") && outputs.size() > 1)
+				throw Exception(ERR_INVALID_ARGS, "Can't give a base for more than one output");
+
+			for (size_t o = 0; o < outputs.size(); o++) {
+				if (outputs[o].done)
+					continue;
+				bases[o] = loadBase(hkx, *opts.get("base") ? opts.get("base") : outputs[o].fileName.c_str(), settings);
+				for (int i = outputs[o].first; bases[o] && i < outputs[o].last; i++) {
+					if (i - outputs[o].first < bases[o]->m_bindings.getSize())
+						baseBindings[i] = bases[o]->m_bindings[i - outputs[o].first];
+				}
+			}
+		}
+
+		parallelFor(static_cast<int>(todo.size()), jobCount(opts), [&](int job) {
+			int i = todo[job];
+			hkRefPtr<hkaAnimationContainer> anim = compressFile(inputs[i].c_str(), skeleton, settings,
+				baseBindings[i], &reused[i], settings.filter != FILTER_NONE ? &unfiltered[i] : nullptr);
+
+			if (opts.has("separate"))
+				save(anim.val(), outputs[i]);
+			anims[i] = anim;
+		});
+
+		//One at a time, so that the timings don't compete
+		for (int i = 0; i < nInputs; i++) {
+			if (!anims[i])
+				continue;
+			for (auto&& binding : anims[i]->m_bindings) {
+				std::cout << inputs[i] << ": " << settings.describe() << ", "
+					<< binding->m_animation->getSizeInBytes() << " bytes";
+				if (opts.has("report"))
+					std::cout << ", " << timeSampling(binding->m_animation) << " ns per sample";
+				if (reused[i] >= 0)
+					std::cout << ", kept " << reused[i] << " blocks of the base";
+				if (unfiltered[i] > 0) {
+					int size = binding->m_animation->getSizeInBytes();
+					std::cout << ", " << unfiltered[i] << " bytes unsmoothed ("
+						<< std::showpos << std::round(1000.0 * (size - unfiltered[i]) / unfiltered[i]) / 10.0
+						<< std::noshowpos << "%)";
+				}
+				std::cout << '\n';
+			}
+		}
+
+		if (!opts.has("separate") && !outputs.front().done) {
+			//Everything goes in the first container
+			hkRefPtr<hkaAnimationContainer> anim;
+			for (auto&& item : anims) {
+				if (!item)
+					continue;
+				if (!anim)
+					anim = item;
+				else {
+					for (auto&& binding : item->m_bindings)
+						anim->m_bindings.pushBack(binding);
+					for (auto&& a : item->m_animations)
+						anim->m_animations.pushBack(a);
+				}
+			}
+			save(anim.val(), outputs.front());
+		}
+
+		if (cache)
+			cache->printStats(std::cout);
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+void patch(const Options& opts)
+{
+	//args
+	//1. format specifier
+	//2+. hkx file(s), patched in place
+	//options
+	//--output=<file>		write here instead of in place (one file only)
+	//--binding=<n>		patch this animation of each file (default 0)
+	//--clear			remove all annotations first
+	//--remove=<text>		remove annotations with this text (repeatable)
+	//--add=<frame>:<text>	add an annotation (repeatable)
+	//--from=<xml>		replace the annotations with those of the first animation in an interchange file
+	//--jobs=<n>		patch this many files at a time (default one per core)
+	//Only the annotations change. The compressed tracks are written back as they were.
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 2) {
+		const char* layout = argv[0];
+		if (opts.has("output") && argc != 2)
+			throw Exception(ERR_INVALID_ARGS, "Can't give an output for more than one file");
+
+		AnnotationPatch edit;
+		edit.clear = opts.has("clear");
+		for (auto&& text : opts.getAll("remove")) {
+			edit.remove.insert(text);
+		}
+		if (opts.has("from")) {
+			std::vector<std::vector<Annotation>> clips = XMLInterface::readAnnotations(opts.get("from"));
+			edit.clear = true;
+			if (!clips.empty())
+				edit.add = std::move(clips.front());
+		}
+		for (auto&& item : opts.getAll("add")) {
+			size_t colon = item.find(':');
+			if (colon == std::string::npos || colon == 0)
+				throw Exception(ERR_INVALID_ARGS, "Annotations are given as <frame>:<text>");
+			edit.add.push_back({ std::atoi(item.substr(0, colon).c_str()), item.substr(colon + 1) });
+		}
+		int binding = std::atoi(opts.get("binding", "0"));
+
+		HavokEngine engine;
+
+		parallelFor(argc - 1, jobCount(opts), [&](int i) {
+			const char* input = argv[i + 1];
+			std::string output = opts.has("output") ? opts.get("output") : input;
+
+			HKXInterface hkx;
+			setFormat(hkx, layout);
+
+			ProfileScope loadStage("Havok load");
+			loadStage.bytesIn(Profiler::fileSize(input));
+			hkRefPtr<hkaAnimationContainer> anim = hkx.load(input);
+			loadStage.end();
+			if (!anim)
+				throw Exception(ERR_INVALID_INPUT, "No animation found");
+
+			edit.apply(anim.val(), binding);
+			saveAtomically(hkx, anim.val(), output);
+		});
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+//Files given as paths that are either files or directories (searched for files
+//with extension, including subdirectories). Returns each file with its path
+//relative to the directory it was found in.
+static std::vector<std::pair<std::filesystem::path, std::filesystem::path>> findFiles(
+	char* const* paths, int count, const char* extension)
+{
+	namespace fs = std::filesystem;
+
+	std::vector<std::pair<fs::path, fs::path>> files;
+	for (int i = 0; i < count; i++) {
+		fs::path input(paths[i]);
+		std::error_code err;
+		if (fs::is_directory(input, err)) {
+			for (auto&& item : fs::recursive_directory_iterator(input, err)) {
+				if (item.is_regular_file(err) && _stricmp(item.path().extension().string().c_str(), extension) == 0)
+					files.push_back({ item.path(), fs::relative(item.path(), input, err) });
+			}
+		}
+		else if (fs::is_regular_file(input, err))
+			files.push_back({ input, input.filename() });
+		else
+			throw Exception(ERR_READ_FAIL, "Input not found");
+	}
+	return files;
+}
+
+void convert(const Options& opts)
+{
+	//args
+	//1. format specifier
+	//2+. hkx files or directories (searched for .hkx files, including subdirectories)
+	//options
+	//--output=<dir>	write here, with the same paths relative to each input directory (default in place)
+	//--jobs=<n>		convert this many files at a time (default one per core)
+	//Everything in each file is saved again in the new format, as it was loaded.
+	//Nothing is decompressed.
+	namespace fs = std::filesystem;
+
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 2) {
+		const char* format = argv[0];
+
+		//(input, output) of each file
+		std::vector<std::pair<fs::path, fs::path>> files = findFiles(argv + 1, argc - 1, ".hkx");
+		if (opts.has("output")) {
+			fs::path outDir(opts.get("output"));
+			for (auto&& file : files)
+				file.second = outDir / file.second;
 		}
 		else {
-			hkx.m_options.layout = LAYOUT_AMD64;
+			for (auto&& file : files)
+				file.second = file.first;
 		}
-		hkx.save(anim.val(), argv[2]);
+
+		HavokEngine engine;
+
+		//Carry on past files that fail, and report them at the end
+		std::mutex mutex;
+		std::vector<std::string> failed;
+		std::atomic<int> skipped{ 0 };
+
+		parallelFor(static_cast<int>(files.size()), jobCount(opts), [&](int i) {
+			const fs::path& input = files[i].first;
+			const fs::path& output = files[i].second;
+			try {
+				std::error_code err;
+				if (output.has_parent_path())
+					fs::create_directories(output.parent_path(), err);
+
+				HKXInterface hkx;
+				setFormat(hkx, format);
+
+				fs::path tmp = tempName(output);
+
+				ProfileScope stage("Convert");
+				stage.bytesIn(Profiler::fileSize(input.string().c_str()));
+				if (!hkx.convert(input.string().c_str(), tmp.string().c_str())) {
+					fs::remove(tmp, err);
+					skipped++;
+					return;
+				}
+				stage.bytesOut(Profiler::fileSize(tmp.string().c_str()));
+				stage.end();
+
+				moveIntoPlace(tmp, output);
+			}
+			catch (const Exception& e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				failed.push_back(input.string() + ": " + e.msg);
+			}
+			catch (const std::exception& e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				failed.push_back(input.string() + ": " + e.what());
+			}
+		});
+
+		std::cout << "Converted " << files.size() - failed.size() - skipped << " of " << files.size() << " files";
+		if (skipped)
+			std::cout << " (" << skipped << " not Havok files)";
+		std::cout << '\n';
+		reportFailures(failed, ERR_WRITE_FAIL, "Some files failed to convert");
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+void watch(const Options& opts)
+{
+	//args
+	//1. format specifier
+	//2. directory to watch (including subdirectories)
+	//3+. skeleton(s)
+	//options
+	//--output=<dir>	write here, with the same paths relative to the watched directory (default next to each input)
+	//--debounce=<ms>	wait until a file has not changed for this long (default 300)
+	//--incremental		update the existing output, only compressing the spline blocks that changed
+	//			(if it was made with the same settings, as its .settings file says)
+	//and the encoding options of compressionOptions
+	//Every .xml file that is written to is packed to a .hkx of the same name, until stopped.
+	namespace fs = std::filesystem;
+	using Clock = std::chrono::steady_clock;
+
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 3) {
+		const char* format = argv[0];
+		fs::path dir = fs::absolute(argv[1]);
+		fs::path outDir = opts.has("output") ? fs::absolute(opts.get("output")) : fs::path();
+
+		int debounceMs = std::atoi(opts.get("debounce", "300"));
+		if (debounceMs < 0)
+			throw Exception(ERR_INVALID_ARGS, "Invalid debounce time");
+		auto debounce = std::chrono::milliseconds(debounceMs);
+		CompressionSettings settings = compressionOptions(opts);
+
+		std::error_code err;
+		if (!fs::is_directory(dir, err))
+			throw Exception(ERR_READ_FAIL, "Directory not found");
+
+		//Everything we need stays loaded between files
+		HavokEngine engine;
+		HKXInterface hkx;
+		setFormat(hkx, format);
+
+		SkeletonLoader skeletons;
+		for (int i = 2; i < argc; i++) {
+			skeletons.load(argv[i], hkx);
+		}
+		if (skeletons.empty())
+			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
+
+		DirectoryWatcher watcher(dir.string().c_str());
+		std::cout << "Watching " << dir.string() << std::endl;
+
+		//Files that have changed but not been packed yet
+		struct Pending
+		{
+			//last notification
+			Clock::time_point changed;
+			//when to look at it again
+			Clock::time_point due;
+		};
+		std::map<fs::path, Pending> pending;
+
+		for (;;) {
+			int timeout = -1;
+			if (!pending.empty()) {
+				Clock::time_point next = Clock::time_point::max();
+				for (auto&& item : pending)
+					next = std::min(next, item.second.due);
+				auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+				timeout = static_cast<int>(std::max<long long>(wait, 0));
+			}
+
+			std::vector<fs::path> changed;
+			if (watcher.wait(timeout, changed)) {
+				Clock::time_point now = Clock::now();
+				for (auto&& path : changed) {
+					if (_stricmp(path.extension().string().c_str(), ".xml") == 0)
+						pending[path] = { now, now + debounce };
+				}
+			}
+
+			Clock::time_point now = Clock::now();
+			for (auto it = pending.begin(); it != pending.end();) {
+				if (now < it->second.due) {
+					++it;
+					continue;
+				}
+				if (!fs::is_regular_file(it->first, err)) {
+					it = pending.erase(it);
+					continue;
+				}
+				//Still being written without us being told, try again later
+				if (!DirectoryWatcher::isWriteComplete(it->first)) {
+					it->second.due = now + debounce;
+					++it;
+					continue;
+				}
+
+				fs::path input = it->first;
+				Clock::time_point changedAt = it->second.changed;
+				it = pending.erase(it);
+
+				fs::path output = outDir.empty() ? input : outDir / fs::relative(input, dir, err);
+				output.replace_extension(".hkx");
+
+				try {
+					Clock::time_point start = Clock::now();
+
+					hkRefPtr<hkaAnimationContainer> base;
+					if (opts.has("incremental"))
+						base = loadBase(hkx, output.string().c_str(), settings);
+
+					int reused = -1;
+					hkRefPtr<hkaAnimationContainer> anim = compressFile(input.string().c_str(), skeletons, settings,
+						base && !base->m_bindings.isEmpty() ? base->m_bindings[0].val() : nullptr, &reused);
+
+					if (output.has_parent_path())
+						fs::create_directories(output.parent_path(), err);
+
+					//Whatever loads the output should never see half a file
+					saveAtomically(hkx, anim.val(), output);
+					if (opts.has("incremental"))
+						saveSettings(output.string(), settings);
+
+					Clock::time_point end = Clock::now();
+					auto ms = [](Clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+					std::cout << fs::relative(input, dir, err).string() << " -> " << output.string()
+						<< ": packed in " << ms(end - start) << " ms, "
+						<< ms(end - changedAt) << " ms after the last change";
+					if (reused >= 0)
+						std::cout << ", kept " << reused << " blocks";
+					std::cout << std::endl;
+				}
+				catch (const Exception& e) {
+					//Keep watching, the next save may fix it
+					std::cerr << input.string() << ": " << e.msg << std::endl;
+				}
+				catch (const std::exception& e) {
+					std::cerr << input.string() << ": " << e.what() << std::endl;
+				}
+			}
+		}
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+void diff(const Options& opts)
+{
+	//args
+	//1. hkx file or directory
+	//2. hkx file or directory to compare it to (files in directories are paired by relative path)
+	//3+. skeleton(s)
+	//options
+	//--binding=<n>		compare this animation of each file (default 0)
+	//--max-translation=<d>	largest difference that passes (default 0.01)
+	//--max-rotation=<rad>	(default 0.01)
+	//--max-scale=<d>	(default 0.01)
+	//--max-float=<d>	(default 0.01)
+	//--jobs=<n>		compare this many pairs at a time (default one per core)
+	//--output=<file>	write results to file instead of stdout
+	//Writes one JSON object per line for each pair, and fails if any pair doesn't pass.
+	namespace fs = std::filesystem;
+
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 3) {
+		//Pair the files of a with those of b
+		std::vector<std::pair<fs::path, fs::path>> pairs;
+		std::error_code err;
+		if (fs::is_directory(argv[0], err)) {
+			for (auto&& file : findFiles(argv, 1, ".hkx"))
+				pairs.push_back({ file.first, fs::path(argv[1]) / file.second });
+		}
+		else
+			pairs.push_back({ argv[0], argv[1] });
+
+		DiffThresholds thresholds;
+		thresholds.translation = static_cast<float>(std::atof(opts.get("max-translation", "0.01")));
+		thresholds.rotation = static_cast<float>(std::atof(opts.get("max-rotation", "0.01")));
+		thresholds.scale = static_cast<float>(std::atof(opts.get("max-scale", "0.01")));
+		thresholds.value = static_cast<float>(std::atof(opts.get("max-float", "0.01")));
+		if (thresholds.translation < 0.0f || thresholds.rotation < 0.0f
+			|| thresholds.scale < 0.0f || thresholds.value < 0.0f)
+			throw Exception(ERR_INVALID_ARGS, "Invalid threshold");
+		int binding = std::atoi(opts.get("binding", "0"));
+
+		std::ofstream file;
+		if (opts.has("output")) {
+			file.open(opts.get("output"));
+			if (!file)
+				throw Exception(ERR_WRITE_FAIL, "Failed to open output file");
+		}
+		std::ostream& out = file.is_open() ? file : std::cout;
+
+		HavokEngine engine;
+		HKXInterface hkx;
+
+		SkeletonLoader skeletons;
+		for (int i = 2; i < argc; i++) {
+			skeletons.load(argv[i], hkx);
+		}
+		if (skeletons.empty())
+			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
+
+		//Results are written in pair order when we're done
+		std::vector<std::string> results(pairs.size());
+		std::vector<std::string> failed(pairs.size());
+		std::atomic<int> mismatched{ 0 };
+
+		parallelFor(static_cast<int>(pairs.size()), jobCount(opts), [&](int i) {
+			std::string names[2]{ pairs[i].first.string(), pairs[i].second.string() };
+			try {
+				AnimationDecoder animations[2];
+				for (int side : { 0, 1 }) {
+					HKXInterface reader;
+					ProfileScope loadStage("Havok load");
+					loadStage.bytesIn(Profiler::fileSize(names[side].c_str()));
+					hkRefPtr<hkaAnimationContainer> anim = reader.load(names[side].c_str());
+					loadStage.end();
+					if (!anim)
+						throw Exception(ERR_INVALID_INPUT, "No animation found");
+
+					animations[side].m_options.binding = binding;
+					animations[side].decompress(anim, skeletons.get());
+				}
+
+				AnimationDiff diff;
+				diff.compare(animations[0].get(), animations[1].get());
+				if (!diff.passes(thresholds))
+					mismatched++;
+
+				std::ostringstream result;
+				diff.write(result, names[0], names[1], thresholds);
+				results[i] = result.str();
+			}
+			catch (const Exception& e) {
+				failed[i] = names[0] + ": " + e.msg;
+			}
+			catch (const std::exception& e) {
+				failed[i] = names[0] + ": " + e.what();
+			}
+		});
+
+		for (auto&& result : results) {
+			if (!result.empty())
+				out << result << '\n';
+		}
+		reportFailures(failed, ERR_READ_FAIL, "Some files could not be compared");
+		if (mismatched)
+			throw Exception(ERR_MISMATCH, "Animations differ");
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+void retarget(const Options& opts)
+{
+	//args
+	//1. format specifier
+	//2. hkx file or directory (searched for .hkx files, including subdirectories)
+	//3. output file, or directory (with the same paths relative to the input directory)
+	//4. skeleton the animations are of
+	//5. skeleton to move them to
+	//options
+	//--map=<file>		bones and floats with different names, one <source>=<target> per line
+	//--binding=<n>		retarget this animation of each file (default 0)
+	//--jobs=<n>		retarget this many files at a time (default one per core)
+	//and the encoding options of compressionOptions.
+	//The plan of which target bone follows which source bone is worked out once
+	//and used for every file.
+	namespace fs = std::filesystem;
+
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 5) {
+		const char* format = argv[0];
+		CompressionSettings settings = compressionOptions(opts);
+		int binding = std::atoi(opts.get("binding", "0"));
+
+		std::map<std::string, std::string> map;
+		if (opts.has("map"))
+			map = RetargetPlan::readMap(opts.get("map"));
+
+		//(input, output) of each file
+		std::vector<std::pair<fs::path, fs::path>> files = findFiles(argv + 1, 1, ".hkx");
+		std::error_code err;
+		if (fs::is_directory(argv[1], err)) {
+			for (auto&& file : files)
+				file.second = fs::path(argv[2]) / file.second;
+		}
+		else {
+			for (auto&& file : files)
+				file.second = argv[2];
+		}
+
+		HavokEngine engine;
+		HKXInterface hkx;
+
+		SkeletonLoader sources;
+		sources.load(argv[3], hkx);
+		SkeletonLoader targets;
+		targets.load(argv[4], hkx);
+		if (sources.empty() || targets.empty())
+			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
+
+		ProfileScope planStage("Retarget plan");
+		RetargetPlan plan(*sources[0], *targets[0], map);
+		planStage.end();
+		std::cout << plan.mappedBones() << " of " << plan.target().nBones << " bones mapped\n";
+
+		std::mutex mutex;
+		std::vector<std::string> failed;
+
+		parallelFor(static_cast<int>(files.size()), jobCount(opts), [&](int i) {
+			const fs::path& input = files[i].first;
+			const fs::path& output = files[i].second;
+			try {
+				HKXInterface reader;
+				ProfileScope loadStage("Havok load");
+				loadStage.bytesIn(Profiler::fileSize(input.string().c_str()));
+				hkRefPtr<hkaAnimationContainer> anim = reader.load(input.string().c_str());
+				loadStage.end();
+				if (!anim)
+					throw Exception(ERR_INVALID_INPUT, "No animation found");
+
+				AnimationDecoder source;
+				source.m_options.binding = binding;
+				source.decompress(anim, sources.get());
+
+				AnimationDecoder target;
+				target.m_options.compression = settings;
+				plan.apply(source.get(), target.get());
+				hkRefPtr<hkaAnimationContainer> result = target.compress();
+
+				std::error_code err;
+				if (output.has_parent_path())
+					fs::create_directories(output.parent_path(), err);
+
+				HKXInterface writer;
+				setFormat(writer, format);
+				saveAtomically(writer, result.val(), output);
+			}
+			catch (const Exception& e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				failed.push_back(input.string() + ": " + e.msg);
+			}
+			catch (const std::exception& e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				failed.push_back(input.string() + ": " + e.what());
+			}
+		});
+
+		std::cout << "Retargeted " << files.size() - failed.size() << " of " << files.size() << " files\n";
+		reportFailures(failed, ERR_WRITE_FAIL, "Some files failed to retarget");
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+void cacheSkeleton(const Options& opts)
+{
+	//args
+	//1+. skeleton(s)
+	//Writes <skeleton>.skc next to each, which unpack and pack then use instead
+	//of the skeleton for as long as it's unchanged
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 1) {
+		HavokEngine engine;
+		HKXInterface hkx;
+
+		SkeletonLoader skeletons;
+		skeletons.m_options.writeCache = true;
+
+		for (int i = 0; i < argc; i++) {
+			skeletons.load(argv[i], hkx);
+		}
+		if (skeletons.empty())
+			throw Exception(ERR_INVALID_INPUT, "No skeleton found");
 	}
 	else
 		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
 }
 
+void bench(const Options& opts)
+{
+	//options
+	//--bones=<n>,<n>...	bone counts to run (default 100)
+	//--depth=<n>		longest chain of bones (default 8)
+	//--floats=<n>		float slots (default 4)
+	//--frames=<n>,<n>...	frame counts to run (default 300)
+	//--paired		two actors
+	//--additive		additive blending
+	//--runs=<n>		runs of each configuration (default 5)
+	//--allocators=<a>,<a>...	Havok allocators to run each configuration with, malloc or pool
+	//			(default pool with --pool, otherwise malloc)
+	//--output=<file>	write results to file instead of stdout
+	//
+	//To see whether --pool pays off, compare them on large packs and unpacks, e.g.
+	//	bench --bones=100,500 --frames=300,3000 --allocators=malloc,pool --output=alloc.jsonl
+	//and compare wall_us_median of the pack and unpack phases, and peak_bytes and
+	//reserved_bytes of havok-memory, between lines that differ only in allocator.
+	BenchConfig config;
+	config.depth = std::atoi(opts.get("depth", "8"));
+	config.floats = std::atoi(opts.get("floats", "4"));
+	config.paired = opts.has("paired");
+	config.additive = opts.has("additive");
+	int runs = std::atoi(opts.get("runs", "5"));
+
+	std::vector<std::string> bones = splitList(opts.get("bones", "100"));
+	std::vector<std::string> frames = splitList(opts.get("frames", "300"));
+
+	std::vector<HavokAllocator> allocators;
+	for (auto&& a : splitList(opts.get("allocators", opts.has("pool") ? "pool" : "malloc"))) {
+		if (a == "malloc")
+			allocators.push_back(HAVOK_MALLOC);
+		else if (a == "pool")
+			allocators.push_back(HAVOK_POOL);
+		else
+			throw Exception(ERR_INVALID_ARGS, "Unknown allocator");
+	}
+
+	std::ofstream file;
+	if (opts.has("output")) {
+		file.open(opts.get("output"));
+		if (!file)
+			throw Exception(ERR_WRITE_FAIL, "Failed to open output file");
+	}
+	std::ostream& out = file.is_open() ? file : std::cout;
+
+	//each configuration makes its own engine
+	for (auto&& b : bones) {
+		for (auto&& f : frames) {
+			for (HavokAllocator a : allocators) {
+				config.bones = std::atoi(b.c_str());
+				config.frames = std::atoi(f.c_str());
+				config.allocator = a;
+				runBenchmark(config, runs, VERSION_STR, out);
+			}
+		}
+	}
+}
+
+void benchSample(const Options& opts)
+{
+	//args
+	//1+. hkx files or directories (searched for .hkx files, including subdirectories)
+	//options
+	//--samples=<n>		samples per measurement (default 1000, a tenth of that with cold caches)
+	//--tracks=<n>		tracks to sample in the partial measurements (default a quarter of the bones)
+	//--jobs=<n>		measure this many files at a time (default one per core).
+	//			Files measured together compete for the caches, so use 1 for the steadiest numbers.
+	//--output=<file>	write results to file instead of stdout
+	namespace fs = std::filesystem;
+
+	int argc = opts.args.size();
+	char* const* argv = opts.args.data();
+	if (argc >= 1) {
+		std::vector<std::pair<fs::path, fs::path>> files = findFiles(argv, argc, ".hkx");
+		int samples = std::atoi(opts.get("samples", "1000"));
+		int tracks = opts.has("tracks") ? std::atoi(opts.get("tracks")) : -1;
+		if (samples < 1 || (opts.has("tracks") && tracks < 1))
+			throw Exception(ERR_INVALID_ARGS, "Invalid sampling options");
+
+		std::ofstream file;
+		if (opts.has("output")) {
+			file.open(opts.get("output"));
+			if (!file)
+				throw Exception(ERR_WRITE_FAIL, "Failed to open output file");
+		}
+		std::ostream& out = file.is_open() ? file : std::cout;
+
+		HavokEngine engine;
+
+		//Results are written in file order when we're done
+		std::vector<std::string> results(files.size());
+		std::vector<std::string> failed(files.size());
+
+		parallelFor(static_cast<int>(files.size()), jobCount(opts), [&](int i) {
+			std::string name = files[i].first.string();
+			try {
+				HKXInterface hkx;
+				hkRefPtr<hkaAnimationContainer> anim = hkx.load(name.c_str());
+				if (!anim)
+					throw Exception(ERR_INVALID_INPUT, "No animation found");
+
+				std::ostringstream result;
+				runSampleBenchmark(anim.val(), name.c_str(), samples, tracks, result);
+				results[i] = result.str();
+			}
+			catch (const Exception& e) {
+				failed[i] = name + ": " + e.msg;
+			}
+			catch (const std::exception& e) {
+				failed[i] = name + ": " + e.what();
+			}
+		});
+
+		for (auto&& result : results) {
+			out << result;
+		}
+		reportFailures(failed, ERR_READ_FAIL, "Some files could not be measured");
+	}
+	else
+		throw Exception(ERR_INVALID_ARGS, "Missing arguments");
+}
+
+static void run(const char* command, const Options& opts)
+{
+	if (std::strcmp(command, "unpack") == 0)
+		unpack(opts);
+	else if (std::strcmp(command, "pack") == 0)
+		pack(opts);
+	else if (std::strcmp(command, "convert") == 0)
+		convert(opts);
+	else if (std::strcmp(command, "patch") == 0)
+		patch(opts);
+	else if (std::strcmp(command, "diff") == 0)
+		diff(opts);
+	else if (std::strcmp(command, "watch") == 0)
+		watch(opts);
+	else if (std::strcmp(command, "retarget") == 0)
+		retarget(opts);
+	else if (std::strcmp(command, "cache-skeleton") == 0)
+		cacheSkeleton(opts);
+	else if (std::strcmp(command, "bench") == 0)
+		bench(opts);
+	else if (std::strcmp(command, "bench-sample") == 0)
+		benchSample(opts);
+	else
+		about();
+}
+
 int _tmain(int argc, _TCHAR** argv)
 {
 	try {
 		if (argc > 1) {
-			if (std::strcmp(argv[1], "unpack") == 0)
-				unpack(argc - 2, argv + 2);
-			else if (std::strcmp(argv[1], "pack") == 0)
-				pack(argc - 2, argv + 2);
+			Options opts(argc - 2, argv + 2);
+
+			//--pool	give Havok a pooled, thread-caching allocator instead of the heap
+			//		(bench --allocators=malloc,pool compares the two)
+			if (opts.has("pool"))
+				HavokEngine::setAllocator(HAVOK_POOL);
+			//--memory	print what Havok did with its memory
+			if (opts.has("memory"))
+				HavokEngine::countMemory(true);
+
+			if (opts.has("profile")) {
+				//--profile=<file>	write a trace of each stage to file and a summary to stdout
+				const char* traceFile = opts.get("profile");
+				if (!*traceFile)
+					throw Exception(ERR_INVALID_ARGS, "Missing profile output file");
+
+				Profiler profiler;
+				{
+					ProfileScope stage(argv[1]);
+					run(argv[1], opts);
+				}
+				profiler.writeTrace(traceFile);
+				profiler.printSummary(std::cout);
+			}
 			else
-				about();
+				run(argv[1], opts);
+
+			if (opts.has("memory")) {
+				HavokMemoryStats stats = HavokEngine::memoryStats();
+				std::cout << "Havok memory: " << stats.allocations << " allocations, "
+					<< stats.peakInUse << " bytes peak, "
+					<< stats.inUse << " bytes in use at exit, "
+					<< stats.reserved << " bytes held at exit\n";
+			}
 		}
 		else {
 			about();
@@ -122,26 +1430,10 @@ int _tmain(int argc, _TCHAR** argv)
 		std::cerr << e.msg << std::endl;
 		return e.code;
 	}
+	catch (const std::exception& e) {
+		//(from the standard library, like a file system error)
+		std::cerr << e.what() << std::endl;
+		return ERR_INVALID_INPUT;
+	}
 	return 0;
 }
-
-#if _MSC_VER >= 1900
-
-//__iob_func is called from Havok, but it no longer exists.
-//The FILE struct that it returns has also changed, so it
-//won't even make sense to try to find one and return it.
-// (https://stackoverflow.com/a/34655235 for details)
-// 
-//We just provide a dummy definition to satisfy the linker and let the program
-//crash and burn if it ever gets called (fingers crossed).
-
-#ifdef __cplusplus
-extern "C"
-#endif
-FILE* __cdecl __iob_func(unsigned i) 
-{
-	assert(false);
-	return nullptr;
-}
-
-#endif
@@ -3,6 +3,8 @@
 
 #include "Common/Base/hkBase.h"
 
+#include "NameIndex.h"
+
 namespace iohkx
 {
 	enum ErrorCode
@@ -11,7 +13,9 @@ namespace iohkx
 		ERR_INVALID_ARGS,
 		ERR_INVALID_INPUT,
 		ERR_READ_FAIL,
-		ERR_WRITE_FAIL
+		ERR_WRITE_FAIL,
+		//compared files are not the same
+		ERR_MISMATCH
 	};
 
 	struct Exception
@@ -69,25 +73,32 @@ namespace iohkx
 		float refValue{ 0.0f };
 	};
 
+	struct PairedTable;
+
 	struct Skeleton
 	{
 		std::string name;
 
 		int nBones{ 0 };
 		Bone* bones{ nullptr };
-		std::map<std::string, Bone*> boneIndex;
+		NameIndex<Bone> boneIndex;
 
 		int nFloats{ 0 };
 		Float* floats{ nullptr };
-		std::map<std::string, Float*> floatIndex;
+		NameIndex<Float> floatIndex;
 
 		Bone* rootBone{ nullptr };
+
+		//maps secondary skeleton to the paired track table for this pair
+		std::map<const Skeleton*, const PairedTable*> pairedTables;
 	};
 
 	struct BoneTrack
 	{
 		const Bone* target{ nullptr };
 		hkArray<hkQsTransform> keys;
+		//index of this track in the raw animation when packing, if it has one
+		int slot{ -1 };
 	};
 
 	struct FloatTrack
@@ -96,6 +107,35 @@ namespace iohkx
 		hkArray<hkReal> keys;
 	};
 
+	//Provides the keys of tracks that have not been read yet, so that they 
+	//can be read straight into their final location
+	class KeySource
+	{
+	public:
+		virtual ~KeySource() {}
+
+		//Write at most count keys to dst, stride elements apart. Return the number written.
+		virtual int readKeys(const BoneTrack* track, hkQsTransform* dst, int stride, int count) = 0;
+		virtual int readKeys(const FloatTrack* track, hkReal* dst, int stride, int count) = 0;
+	};
+
+	struct AnimationData;
+
+	//Receives decompressed keys a block of frames at a time, so that we don't
+	//need to keep the whole animation in memory
+	class KeySink
+	{
+	public:
+		virtual ~KeySink() {}
+
+		//Called once the tracks have been mapped, before any keys are decompressed
+		virtual void begin(const AnimationData& data) = 0;
+		//Frames [first, first + count) are in the first count keys of each track
+		virtual void writeBlock(int first, int count) = 0;
+		//Called when all keys and annotations have been decompressed
+		virtual void end(const AnimationData& data) = 0;
+	};
+
 	struct Annotation
 	{
 		int frame{ 0 };
@@ -1,10 +1,27 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <tchar.h>
@@ -15,7 +32,9 @@
 #include "Animation/Animation/hkaAnimationContainer.h"
 #include "Animation/Animation/Animation/hkaAnimation.h"
 #include "Animation/Animation/Rig/hkaSkeletonUtils.h"
+#include "Animation/Animation/Animation/DeltaCompressed/hkaDeltaCompressedAnimation.h"
 #include "Animation/Animation/Animation/SplineCompressed/hkaSplineCompressedAnimation.h"
+#include "Animation/Animation/Animation/WaveletCompressed/hkaWaveletCompressedAnimation.h"
 
 #include "Common/Serialize/Packfile/hkPackfileWriter.h"
 #include "Common/Serialize/Util/hkRootLevelContainer.h"
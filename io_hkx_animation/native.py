@@ -0,0 +1,319 @@
+import array
+import importlib.machinery
+import importlib.util
+import os
+
+import mathutils
+
+from io_hkx_animation.ixml import ReferenceFrame
+from io_hkx_animation.ixml import Track
+from io_hkx_animation.prefs import MODULE_NAME
+
+#Floats per transform key
+TRANSFORM_SIZE = 10
+#Floats per sparse key: frame, value, interpolation, left handle xy, right handle xy
+CURVE_KEY_SIZE = 7
+
+_module = None
+
+def load(preferences):
+    """Return the converter module, or None if we should use the converter tool"""
+    global _module
+
+    prefs = preferences.addons[__package__].preferences
+    if not prefs.use_native:
+        return None
+
+    d = os.path.dirname(prefs.converter_tool)
+    path = None
+    for suffix in importlib.machinery.EXTENSION_SUFFIXES:
+        candidate = os.path.join(d, MODULE_NAME + suffix)
+        if os.path.exists(candidate):
+            path = candidate
+            break
+
+    if not path:
+        return None
+
+    #A module can't be unloaded, so we keep whichever we loaded first
+    if _module:
+        return _module
+
+    try:
+        loader = importlib.machinery.ExtensionFileLoader(MODULE_NAME, path)
+        spec = importlib.util.spec_from_file_location(MODULE_NAME, path, loader=loader)
+        module = importlib.util.module_from_spec(spec)
+        loader.exec_module(module)
+    except ImportError:
+        #wrong Python version or architecture
+        return None
+
+    _module = module
+    return _module
+
+
+def curve_keys(fcurve):
+    """Return the keys of an fcurve as a float array of CURVE_KEY_SIZE per key"""
+    points = fcurve.keyframe_points
+    n = len(points)
+    co = array.array('f', bytes(8 * n))
+    left = array.array('f', bytes(8 * n))
+    right = array.array('f', bytes(8 * n))
+    interp = array.array('i', bytes(4 * n))
+    points.foreach_get("co", co)
+    points.foreach_get("handle_left", left)
+    points.foreach_get("handle_right", right)
+    points.foreach_get("interpolation", interp)
+
+    keys = array.array('f')
+    for i in range(n):
+        keys.extend((co[2 * i], co[2 * i + 1], interp[i], 
+                left[2 * i], left[2 * i + 1], right[2 * i], right[2 * i + 1]))
+    return keys
+
+
+def constant_keys(value):
+    """Sparse keys of an fcurve that is always value"""
+    return array.array('f', (0.0, value, 0.0, 0.0, 0.0, 0.0, 0.0))
+
+
+def unpack_transform(keys):
+    loc = mathutils.Vector(keys[0:3])
+    rot = mathutils.Quaternion(keys[3:7])
+    scl = mathutils.Vector(keys[7:10])
+    return loc, rot, scl
+
+
+class NativeKey():
+    #frame: int
+    #value: float or (mathutils.Vector, mathutils.Quaternion, mathutils.Vector)
+
+    def __init__(self, frame, value):
+        self.frame = frame
+        self.value = value
+
+
+def _track_data(track):
+    """The tuple pack expects for a track"""
+    if track.curves is None:
+        return (track.name, track.datatype.value, track.data)
+    if track.rest is None:
+        return (track.name, track.datatype.value, track.curves)
+    return (track.name, track.datatype.value, track.curves, tuple(track.rest), track.rest_parent)
+
+
+class NativeTrack():
+    name: str
+    datatype: Track
+
+    def __init__(self, name, datatype, keys=None):
+        self.name = name
+        self.datatype = datatype
+        #(frame, value) pairs of each fcurve, if the keys are laid out by channel
+        self.channels = None
+        #sparse keys of each fcurve, if the converter should sample them
+        self.curves = None
+        #rest pose of a bone-space track and the track it is relative to
+        self.rest = None
+        self.rest_parent = None
+        if keys is None:
+            self.data = array.array('f')
+        elif isinstance(keys, list):
+            self.data = None
+            self.channels = [memoryview(c).cast('B').cast('f') for c in keys]
+        else:
+            #flatten, the keys of transform tracks are 2D
+            self.data = memoryview(keys).cast('B').cast('f')
+
+    def add_key(self, index):
+        #keys must be added in order
+        assert index * self._width() == len(self.data), "key out of order"
+        return _NativeKeyWriter(self)
+
+    def set_curves(self, curves, rest=None, parent=None):
+        """Give the keys as one array of CURVE_KEY_SIZE floats per key for each fcurve,
+        and optionally the rest pose of the bone (as a transform key) relative to 
+        that of the track named parent (None for the armature)"""
+        self.curves = curves
+        self.rest = rest
+        self.rest_parent = parent
+
+    def keys(self):
+        width = self._width()
+        for i in range(len(self.data) // width):
+            if self.datatype == Track.TRANSFORM:
+                value = unpack_transform(self.data[i * width:(i + 1) * width])
+            else:
+                value = self.data[i]
+            #start counting frames at 1
+            yield NativeKey(i + 1, value)
+
+    def _width(self):
+        return TRANSFORM_SIZE if self.datatype == Track.TRANSFORM else 1
+
+
+class _NativeKeyWriter():
+
+    def __init__(self, track):
+        self.track = track
+
+    def set_value(self, *value):
+        if self.track.datatype == Track.TRANSFORM:
+            loc, rot, scl = value
+            self.track.data.extend((loc[0], loc[1], loc[2],
+                    rot[0], rot[1], rot[2], rot[3],
+                    scl[0], scl[1], scl[2]))
+        else:
+            self.track.data.append(value[0])
+
+
+class NativeAnnotation():
+
+    def __init__(self, frame, text):
+        #start counting frames at 1
+        self.frame = frame + 1
+        self.text = text
+
+
+class NativeAnimation():
+
+    def __init__(self, name, data=None):
+        self.name = name
+        self.skeleton = ""
+        self.reference_frame = ReferenceFrame.UNDEFINED
+        self._tracks = []
+        self._annotations = []
+
+        if data:
+            self.skeleton = data["skeleton"]
+            self.reference_frame = ReferenceFrame(data["referenceFrame"])
+            for name, datatype, keys in data["tracks"]:
+                self._tracks.append(NativeTrack(name, Track(datatype), keys))
+            for frame, text in data["annotations"]:
+                self._annotations.append(NativeAnnotation(frame, text))
+
+    def add_annotation(self, frame, text):
+        #store frame counting from 0
+        self._annotations.append(NativeAnnotation(int(frame) - 1, text))
+
+    def add_float_track(self, name):
+        track = NativeTrack(name, Track.FLOAT)
+        self._tracks.append(track)
+        return track
+
+    def add_transform_track(self, name):
+        track = NativeTrack(name, Track.TRANSFORM)
+        self._tracks.append(track)
+        return track
+
+    def set_reference_frame(self, ref):
+        self.reference_frame = ref
+
+    def set_skeleton_name(self, name):
+        self.skeleton = name
+
+    def annotations(self):
+        yield from self._annotations
+
+    def tracks(self):
+        yield from self._tracks
+
+    def data(self):
+        return {
+            "skeleton": self.skeleton,
+            "referenceFrame": self.reference_frame.value,
+            "tracks": [_track_data(t) for t in self._tracks],
+            "annotations": [(a.frame - 1, a.text) for a in self._annotations],
+        }
+
+
+class NativeSkeleton():
+    #name: str
+    #reference: (mathutils.Vector, mathutils.Quaternion, mathutils.Vector) or float
+
+    def __init__(self, name, reference=None):
+        self.name = name
+        self.reference = reference
+        self._bones = []
+        self._floats = []
+
+    def bones(self):
+        yield from self._bones
+
+    def floats(self):
+        yield from self._floats
+
+    def build(data):
+        skeleton = NativeSkeleton(data["name"])
+
+        #bones come parents first
+        bones = []
+        for name, parent, ref in data["bones"]:
+            bone = NativeSkeleton(name, unpack_transform(ref))
+            bones.append(bone)
+            if parent < 0:
+                skeleton._bones.append(bone)
+            else:
+                bones[parent]._bones.append(bone)
+
+        for name, ref in data["floats"]:
+            skeleton._floats.append(NativeSkeleton(name, ref))
+
+        return skeleton
+
+
+class NativeDocument():
+    """Same interface as ixml.DocumentInterface, but holds keys in float arrays"""
+    animations: [NativeAnimation]
+    skeletons: [NativeSkeleton]
+
+    def __init__(self, data=None):
+        self.animations = []
+        self.skeletons = []
+        self.frames = 0
+        self.framerate = 0
+        self.additive = False
+        #where to sample sparse keys
+        self.frame_start = 1.0
+        self.frame_step = 1.0
+
+        if data:
+            self.frames = data["frames"]
+            self.framerate = data["frameRate"]
+            self.additive = data["additive"]
+            for anim in data["animations"]:
+                self.animations.append(NativeAnimation(anim["name"], anim))
+            for skel in data["skeletons"]:
+                self.skeletons.append(NativeSkeleton.build(skel))
+
+    def add_animation(self, name):
+        ianim = NativeAnimation(name)
+        self.animations.append(ianim)
+        return ianim
+
+    def set_additive(self, value):
+        self.additive = bool(value)
+
+    def set_frames(self, value):
+        self.frames = value
+
+    def set_framerate(self, value):
+        self.framerate = value
+
+    def set_sampling(self, start, step):
+        self.frame_start = float(start)
+        self.frame_step = float(step)
+
+    def data(self):
+        """Return the document in the form the converter module expects"""
+        return {
+            "frames": self.frames,
+            "frameRate": self.framerate,
+            "additive": self.additive,
+            "frameStart": self.frame_start,
+            "frameStep": self.frame_step,
+            "animations": [a.data() for a in self.animations],
+        }
+
+    def create():
+        return NativeDocument()
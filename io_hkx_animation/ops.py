@@ -10,11 +10,15 @@ import mathutils
 from io_hkx_animation.ixml import DocumentInterface
 from io_hkx_animation.ixml import ReferenceFrame
 from io_hkx_animation.ixml import Track
+from io_hkx_animation import native
 from io_hkx_animation.prefs import EXEC_NAME
 from io_hkx_animation.props import AXES
 
 SAMPLING_RATE = 30
 
+#Keyframe interpolation modes that the converter can sample
+NATIVE_INTERPOLATION = {'CONSTANT', 'LINEAR', 'BEZIER'}
+
 class HKXIO(bpy.types.Operator):
     
     length_scale: bpy.props.FloatProperty(
@@ -143,26 +147,38 @@ class HKXImport(HKXIO, bpy_extras.io_utils.ImportHelper):
                 context.scene.render.fps = SAMPLING_RATE
                 self.report({'WARNING'}, "Setting framerate to %s fps" % str(SAMPLING_RATE))
             
-            #Look for the converter
-            tool = self.get_converter(context.preferences)
-            
-            #Invoke the converter
-            tmp_file = _tmpfilename(self.filepath, context.preferences)
-            skels = '"%s" "%s"' % (self.primary_skeleton, self.secondary_skeleton)
-            args = '"%s" unpack "%s" "%s" %s' % (tool, self.filepath, tmp_file, skels)
-            
-            try:
-                res = subprocess.run(args)
+            module = native.load(context.preferences)
+            if module:
+                #Convert in-process, no temporary file
+                with open(self.filepath, mode='rb') as file:
+                    hkx = file.read()
+                skels = [self.primary_skeleton, self.secondary_skeleton]
+                #get the keys ready to go into fcurves, axes and length converted
+                data = module.unpack(hkx, skels, layout='channels', 
+                        rotation=tuple(self.framerot.to_quaternion()), scale=self.length_scale)
+                doc = native.NativeDocument(data)
                 
-                #throw if the converter returned non-zero
-                res.check_returncode()
+            else:
+                #Look for the converter
+                tool = self.get_converter(context.preferences)
                 
-                #Load the xml
-                doc = DocumentInterface.open(tmp_file)
+                #Invoke the converter
+                tmp_file = _tmpfilename(self.filepath, context.preferences)
+                skels = '"%s" "%s"' % (self.primary_skeleton, self.secondary_skeleton)
+                args = '"%s" unpack "%s" "%s" %s' % (tool, self.filepath, tmp_file, skels)
                 
-            finally:
-                if os.path.exists(tmp_file):
-                    os.remove(tmp_file)
+                try:
+                    res = subprocess.run(args)
+                    
+                    #throw if the converter returned non-zero
+                    res.check_returncode()
+                    
+                    #Load the xml
+                    doc = DocumentInterface.open(tmp_file)
+                    
+                finally:
+                    if os.path.exists(tmp_file):
+                        os.remove(tmp_file)
                 
             
             #Look up all selected armatures
@@ -271,7 +287,9 @@ class HKXImport(HKXIO, bpy_extras.io_utils.ImportHelper):
         
         #import the tracks
         for track in ianim.tracks():
-            if track.datatype == Track.TRANSFORM:
+            if getattr(track, "channels", None):
+                self.import_channels(track, action, overrides.get(track.name, track.name))
+            elif track.datatype == Track.TRANSFORM:
                 self.import_transform(track, action, overrides.get(track.name, track.name))
             elif track.datatype == Track.FLOAT:
                 self.import_float(track, action)
@@ -314,6 +332,29 @@ class HKXImport(HKXIO, bpy_extras.io_utils.ImportHelper):
         
         return bone
     
+    def import_channels(self, itrack, action, name):
+        """Add the fcurves of a track whose keys are already converted and laid out by channel"""
+        if itrack.datatype == Track.TRANSFORM:
+            group = action.groups.new(name)
+            paths = [('pose.bones["%s"].location' % name, i) for i in range(3)]
+            paths += [('pose.bones["%s"].rotation_quaternion' % name, i) for i in range(4)]
+            paths += [('pose.bones["%s"].scale' % name, i) for i in range(3)]
+        else:
+            #float tracks are never renamed
+            group = None
+            paths = [('["%s"]' % itrack.name, 0)]
+        
+        for (path, index), keys in zip(paths, itrack.channels):
+            if group:
+                f = action.fcurves.new(path, index=index, action_group=name)
+            else:
+                f = action.fcurves.new(path, index=index)
+            
+            #keys are (frame, value) pairs
+            f.keyframe_points.add(len(keys) // 2)
+            f.keyframe_points.foreach_set("co", keys)
+            f.update()
+    
     def import_float(self, itrack, action):
         #create f-curve
         f = action.fcurves.new('["%s"]' % itrack.name)
@@ -466,7 +507,9 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
             self.axis_conversion(to_forward=self.bone_forward, to_up=self.bone_up)
             
             #Look for the converter
-            tool = self.get_converter(context.preferences)
+            module = native.load(context.preferences)
+            if not module:
+                tool = self.get_converter(context.preferences)
             
             #Look up all selected armatures
             selected, armatures = self.get_selected(context)
@@ -495,7 +538,10 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
                 arma.data.iohkx.bone_up = self.bone_up
             
             #create a document
-            doc = DocumentInterface.create()
+            if module:
+                doc = native.NativeDocument.create()
+            else:
+                doc = DocumentInterface.create()
             
             #determine our sampling parameters
             self.framestep = context.scene.render.fps / SAMPLING_RATE
@@ -512,16 +558,34 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
             doc.set_frames(self.frames)
             doc.set_framerate(SAMPLING_RATE)
             doc.set_additive(self.blend_mode)
+            if module:
+                doc.set_sampling(self.frame_interval[0], self.framestep)
             
             #add animations
             for armature in armatures:
                 context.view_layer.objects.active = armature
-                self.export_animation(doc, context)
+                #let the converter sample the action if nothing else moves the bones
+                if module and self.can_export_curves(context):
+                    self.export_curves(doc, context)
+                else:
+                    self.export_animation(doc, context)
                 
             #restore active state
             context.view_layer.objects.active = active
             
-            if len(doc.animations) != 0:
+            if self.output_format == 'LE':
+                fmt = "WIN32"
+            else:
+                fmt = "AMD64"
+            
+            if len(doc.animations) != 0 and module:
+                skels = [self.primary_skeleton, self.secondary_skeleton][:len(doc.animations)]
+                hkx = module.pack(doc.data(), skels, fmt, 
+                        rotation=tuple(self.framerotinv.to_quaternion()), scale=self.length_scale)
+                with open(self.filepath, mode='wb') as file:
+                    file.write(hkx)
+                
+            elif len(doc.animations) != 0:
                 tmp_file = _tmpfilename(self.filepath, context.preferences)
                 try:
                     #write xml
@@ -533,11 +597,6 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
                     else:
                         skels = '"%s" "%s"' % (self.primary_skeleton, self.secondary_skeleton)
                     
-                    if self.output_format == 'LE':
-                        fmt = "WIN32"
-                    else:
-                        fmt = "AMD64"
-                    
                     args = '"%s" pack %s "%s" "%s" %s' % (tool, fmt, tmp_file, self.filepath, skels)
                     
                     res = subprocess.run(args)
@@ -629,6 +688,9 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
         #restore state
         context.scene.frame_set(current_frame)
         
+        self.export_annotations(ianim, armature)
+    
+    def export_annotations(self, ianim, armature):
         #Add annotations from pose markers
         if armature.animation_data and armature.animation_data.action:
             for marker in armature.animation_data.action.pose_markers:
@@ -636,6 +698,93 @@ class HKXExport(HKXIO, bpy_extras.io_utils.ExportHelper):
                     #count from frame_interval[0]
                     i = (marker.frame - self.frame_interval[0]) / self.framestep + 1
                     ianim.add_annotation(i, marker.name)
+    
+    def can_export_curves(self, context):
+        """True if the pose of the selected bones is given by the keys of the action alone"""
+        armature = context.view_layer.objects.active
+        pbones = context.selected_pose_bones_from_active_object
+        if not pbones or armature.data.pose_position != 'POSE':
+            return False
+        
+        anim = armature.animation_data
+        if not anim or not anim.action or len(anim.drivers) != 0:
+            return False
+        if any(not track.mute for track in anim.nla_tracks):
+            return False
+        
+        for fcurve in anim.action.fcurves:
+            if fcurve.mute or len(fcurve.modifiers) != 0 or fcurve.extrapolation != 'CONSTANT':
+                return False
+            if any(key.interpolation not in NATIVE_INTERPOLATION for key in fcurve.keyframe_points):
+                return False
+        
+        selected = {pbone.name for pbone in pbones}
+        prefix = 'pose.bones["%s"].'
+        for pbone in pbones:
+            bone = pbone.bone
+            if pbone.rotation_mode != 'QUATERNION' or len(pbone.constraints) != 0:
+                return False
+            if not bone.use_inherit_rotation or bone.inherit_scale != 'FULL' or not bone.use_local_location:
+                return False
+            
+            #bones we don't export are assumed to be at rest
+            parent = pbone.parent
+            while parent:
+                if not parent.name in selected:
+                    if len(parent.constraints) != 0 or parent.matrix_basis != mathutils.Matrix.Identity(4):
+                        return False
+                    if any(f.data_path.startswith(prefix % parent.name) for f in anim.action.fcurves):
+                        return False
+                parent = parent.parent
+        
+        return True
+    
+    def export_curves(self, document, context):
+        """Export the keys of the action, to be sampled by the converter"""
+        armature = context.view_layer.objects.active
+        pbones = context.selected_pose_bones_from_active_object
+        action = armature.animation_data.action
+        
+        ianim = document.add_animation(str(len(document.animations)))
+        ianim.set_skeleton_name(armature.data.iohkx.skeleton_path)
+        #channels are relative to the rest pose of each bone
+        ianim.set_reference_frame(ReferenceFrame.BONE)
+        
+        override = lambda pbone: pbone.bone.iohkx.hkx_name if pbone.bone.iohkx.hkx_name != "" else pbone.name
+        selected = {pbone.name for pbone in pbones}
+        for pbone in pbones:
+            #The converter builds the pose on the rest pose of the armature, as Blender
+            #does, relative to the nearest exported ancestor (the bones in between are at rest)
+            parent = pbone.parent
+            while parent and not parent.name in selected:
+                parent = parent.parent
+            rest = pbone.bone.matrix_local @ self.framerot
+            if parent:
+                rest = (parent.bone.matrix_local @ self.framerot).inverted() @ rest
+            loc, rot, scl = rest.decompose()
+            loc *= self.length_scale
+            
+            curves = []
+            for prop, size in (("location", 3), ("rotation_quaternion", 4), ("scale", 3)):
+                for i in range(size):
+                    f = action.fcurves.find('pose.bones["%s"].%s' % (pbone.name, prop), index=i)
+                    if f:
+                        curves.append(native.curve_keys(f))
+                    else:
+                        #not animated, keep the current value
+                        curves.append(native.constant_keys(getattr(pbone, prop)[i]))
+            
+            track = ianim.add_transform_track(override(pbone))
+            track.set_curves(curves, (*loc, *rot, *scl), override(parent) if parent else None)
+        
+        #properties that are keyframed in the action
+        for prop in armature.keys():
+            f = action.fcurves.find('["%s"]' % prop)
+            if f:
+                track = ianim.add_float_track(prop)
+                track.set_curves([native.curve_keys(f)])
+        
+        self.export_annotations(ianim, armature)
 
 
 def _tmpfilename(file_name, preferences):
@@ -1,6 +1,8 @@
 import bpy
 
 EXEC_NAME = "blender-hkx.exe"
+#In-process converter, if built for this version of Blender
+MODULE_NAME = "_blender_hkx"
 
 class HKXAddonPreferences(bpy.types.AddonPreferences):
     bl_idname = __package__
@@ -23,8 +25,15 @@ class HKXAddonPreferences(bpy.types.AddonPreferences):
         description="Location to store temporary files",
     )
     
+    use_native: bpy.props.BoolProperty(
+        name="Use converter module",
+        description="Convert in-process with " + MODULE_NAME + " if it is found next to the converter tool",
+        default=True,
+    )
+    
     def draw(self, context):
         self.layout.prop(self, "converter_tool")
+        self.layout.prop(self, "use_native")
         self.layout.prop(self, "temp_location")
         self.layout.prop(self, "default_skeleton")
 